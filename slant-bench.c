@@ -0,0 +1,193 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <ncurses.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "extern.h"
+#include "slant.h"
+
+/*
+ * Samples of one benchmarked operation, in microseconds.
+ */
+struct	benchset {
+	double		*vals; /* samples */
+	size_t		 valsz; /* number of samples */
+	size_t		 valmax; /* allocated samples */
+	size_t		 lost; /* samples not recorded (memory) */
+};
+
+/*
+ * All benchmarked operations of a headless run.
+ */
+struct	bench {
+	struct benchset	 sets[BENCH__MAX];
+	struct timespec	 start; /* when the run started */
+};
+
+static	const char *const names[BENCH__MAX] = {
+	"cycle", /* BENCH_CYCLE */
+	"nodes_update", /* BENCH_UPDATE */
+	"decode", /* BENCH_DECODE */
+	"draw", /* BENCH_DRAW */
+};
+
+struct bench *
+bench_alloc(void)
+{
+	struct bench	*b;
+
+	if (NULL == (b = calloc(1, sizeof(struct bench))))
+		return NULL;
+	bench_start(&b->start);
+	return b;
+}
+
+void
+bench_free(struct bench *b)
+{
+	size_t	 i;
+
+	if (NULL == b)
+		return;
+	for (i = 0; i < BENCH__MAX; i++)
+		free(b->sets[i].vals);
+	free(b);
+}
+
+/*
+ * Mark the start of something we're going to time.
+ * This may be used from any thread.
+ */
+void
+bench_start(struct timespec *ts)
+{
+
+	if (-1 == clock_gettime(CLOCK_MONOTONIC, ts))
+		memset(ts, 0, sizeof(struct timespec));
+}
+
+/*
+ * Microseconds since "ts" was given to bench_start().
+ * This may be used from any thread.
+ */
+double
+bench_stop(const struct timespec *ts)
+{
+	struct timespec	 now;
+
+	bench_start(&now);
+	return (now.tv_sec - ts->tv_sec) * 1e6 +
+		(now.tv_nsec - ts->tv_nsec) / 1e3;
+}
+
+/*
+ * Seconds since the benchmark started.
+ */
+double
+bench_elapsed(const struct bench *b)
+{
+
+	return bench_stop(&b->start) / 1e6;
+}
+
+/*
+ * Record the time "usec" taken by operation "m".
+ * Samples we can't allocate for are counted, but not recorded.
+ */
+void
+bench_add(struct bench *b, enum benchm m, double usec)
+{
+	struct benchset	*s = &b->sets[m];
+	void		*pp;
+	size_t		 max;
+
+	if (s->valsz == s->valmax) {
+		max = 0 == s->valmax ? 1024 : s->valmax * 2;
+		pp = reallocarray(s->vals, max, sizeof(double));
+		if (NULL == pp) {
+			s->lost++;
+			return;
+		}
+		s->vals = pp;
+		s->valmax = max;
+	}
+
+	s->vals[s->valsz++] = usec;
+}
+
+static int
+cmp_double(const void *p1, const void *p2)
+{
+	double	 d1 = *(const double *)p1, d2 = *(const double *)p2;
+
+	return d1 < d2 ? -1 : d1 > d2;
+}
+
+/*
+ * The "pct" percentile of the "sz" sorted values "v".
+ */
+static double
+percentile(const double *v, size_t sz, size_t pct)
+{
+
+	return 0 == sz ? 0.0 : v[(sz - 1) * pct / 100];
+}
+
+/*
+ * Print the results of a run over "hosts" hosts as a single JSON
+ * object, so that runs can be compared across releases.
+ * Times are in microseconds; rates are per second of the run.
+ * Returns zero on failure, non-zero on success.
+ */
+int
+bench_print(FILE *f, struct bench *b, size_t hosts, size_t threads)
+{
+	struct benchset	*s;
+	double		 secs = bench_elapsed(b), sum;
+	size_t		 i, j;
+
+	fprintf(f, "{\"version\":\"" VERSION "\","
+		"\"hosts\":%zu,\"threads\":%zu,\"seconds\":%.3f",
+		hosts, threads, secs);
+
+	for (i = 0; i < BENCH__MAX; i++) {
+		s = &b->sets[i];
+		qsort(s->vals, s->valsz, sizeof(double), cmp_double);
+		for (sum = 0.0, j = 0; j < s->valsz; j++)
+			sum += s->vals[j];
+		fprintf(f, ",\"%s\":{\"count\":%zu,\"lost\":%zu,"
+			"\"rate\":%.3f,\"mean\":%.3f,\"p50\":%.3f,"
+			"\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+			names[i], s->valsz, s->lost,
+			secs > 0.0 ? s->valsz / secs : 0.0,
+			s->valsz ? sum / s->valsz : 0.0,
+			percentile(s->vals, s->valsz, 50),
+			percentile(s->vals, s->valsz, 90),
+			percentile(s->vals, s->valsz, 99),
+			percentile(s->vals, s->valsz, 100));
+	}
+
+	fputs("}\n", f);
+	return 0 == fflush(f) && ! ferror(f);
+}
@@ -0,0 +1,231 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <ncurses.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "extern.h"
+#include "slant.h"
+
+#define	BINARY_MAGIC "SLNT"
+#define	BINARY_VERSION 2
+#define	BINARY_COLS 12
+#define	BINARY_TIMES 10
+
+static uint32_t
+get_u32(const unsigned char *p)
+{
+
+	return (uint32_t)p[0] | 
+		(uint32_t)p[1] << 8 |
+		(uint32_t)p[2] << 16 | 
+		(uint32_t)p[3] << 24;
+}
+
+static uint64_t
+get_u64(const unsigned char *p)
+{
+
+	return (uint64_t)get_u32(p) | 
+		(uint64_t)get_u32(p + 4) << 32;
+}
+
+static double
+get_f64(const unsigned char *p)
+{
+	uint64_t u = get_u64(p);
+	double	 v;
+
+	memcpy(&v, &u, sizeof(double));
+	return v;
+}
+
+/*
+ * Read the "sz" records of a single interval, column by column, from
+ * "buf" into the newly-allocated "a".
+ * The caller has made sure there's enough data for all columns.
+ * Returns zero on memory exhaustion, non-zero on success.
+ */
+static int
+binary_records(struct recarray *a, const unsigned char *buf, size_t sz)
+{
+	size_t		 i, col;
+	int64_t		 v;
+
+	if ( ! recarray_alloc(a, sz))
+		return 0;
+
+	for (col = 0; col < BINARY_COLS; col++)
+		for (i = 0; i < sz; i++, buf += 8)
+			switch (col) {
+			case 0:
+				a->ctime[i] = get_u64(buf);
+				break;
+			case 1:
+				v = get_u64(buf);
+				a->entries[i] = v < 0 ? 0 :
+					v > UINT32_MAX ? UINT32_MAX : v;
+				break;
+			case 2:
+				a->cpu[i] = get_f64(buf);
+				break;
+			case 3:
+				a->mem[i] = get_f64(buf);
+				break;
+			case 4:
+				a->nettx[i] = get_u64(buf);
+				break;
+			case 5:
+				a->netrx[i] = get_u64(buf);
+				break;
+			case 6:
+				a->discread[i] = get_u64(buf);
+				break;
+			case 7:
+				a->discwrite[i] = get_u64(buf);
+				break;
+			case 8:
+				a->nprocs[i] = get_f64(buf);
+				break;
+			case 9:
+				a->rprocs[i] = get_f64(buf);
+				break;
+			case 10:
+				a->nfiles[i] = get_f64(buf);
+				break;
+			case 11:
+				a->id[i] = get_u64(buf);
+				break;
+			default:
+				abort();
+			}
+
+	return 1;
+}
+
+/*
+ * Parse the binary response for a given node, as documented in
+ * slant-cgi(8), directly into the record arrays of "rs", which must be
+ * zeroed, and which is freed on failure.
+ * Returns >0 on success, 0 on transient failure (malformed data), <0
+ * on fatal error (system should halt).
+ */
+int
+binary_parse(struct out *out, struct node *n, 
+	const char *str, size_t sz, struct recset *rs)
+{
+	const unsigned char *buf = (const unsigned char *)str;
+	int64_t		*times[BINARY_TIMES] = { 
+		&rs->system.nprocstime, &rs->system.nfilestime,
+		&rs->system.cputime, &rs->system.memtime,
+		&rs->system.nettime, &rs->system.disctime,
+		&rs->system.dbtime, &rs->cgiopen, &rs->cgilist,
+		&rs->cgisend };
+	uint32_t	 flags, vsz, rsz, bit;
+	size_t		 i;
+
+	if (sz < 32 || memcmp(buf, BINARY_MAGIC, 4)) {
+		xwarnx(out, "binary: bad header: %s", n->host);
+		goto err;
+	} else if (0 == get_u32(buf + 4) ||
+	    get_u32(buf + 4) > BINARY_VERSION) {
+		xwarnx(out, "binary: unknown version: %s", n->host);
+		goto err;
+	}
+
+	flags = get_u32(buf + 8);
+	rs->since = get_u64(buf + 12);
+	rs->has_since = 0 != (flags & 2);
+	rs->system.boot = get_u64(buf + 20);
+	rs->has_system = 0 != (flags & 1);
+	vsz = get_u32(buf + 28);
+	buf += 32;
+	sz -= 32;
+
+	if (vsz > sz) {
+		xwarnx(out, "binary: short version: %s", n->host);
+		goto err;
+	}
+
+	rs->version = strndup((const char *)buf, vsz);
+	if (NULL == rs->version)
+		goto syserr;
+
+	rs->has_version = 1;
+	buf += vsz;
+	sz -= vsz;
+
+	for (i = 0; i < INTERVALS; i++) {
+		if (sz < 4) {
+			xwarnx(out, "binary: short interval: %s", n->host);
+			goto err;
+		}
+		rsz = get_u32(buf);
+		buf += 4;
+		sz -= 4;
+		if (rsz > sz / (8 * BINARY_COLS)) {
+			xwarnx(out, "binary: short records: %s", n->host);
+			goto err;
+		}
+		if ( ! binary_records(&rs->ivs[i], buf, rsz))
+			goto syserr;
+		buf += (size_t)rsz * 8 * BINARY_COLS;
+		sz -= (size_t)rsz * 8 * BINARY_COLS;
+	}
+
+	/*
+	 * Sections are flagged from bit 2 and follow in order, each a
+	 * count of 64-bit values.
+	 * Bit 2 is the timings: those we don't know are ignored, as
+	 * are sections we don't know and anything after the sections.
+	 */
+
+	for (bit = 2; bit < 32; bit++) {
+		if ( ! (flags & (1U << bit)))
+			continue;
+		if (sz < 4 || (rsz = get_u32(buf)) > (sz - 4) / 8) {
+			xwarnx(out, "binary: short section: %s", n->host);
+			goto err;
+		}
+		buf += 4;
+		sz -= 4;
+		if (2 == bit) {
+			for (i = 0; i < rsz && i < BINARY_TIMES; i++)
+				*times[i] = get_u64(buf + i * 8);
+			rs->has_cgi = 1;
+		}
+		buf += (size_t)rsz * 8;
+		sz -= (size_t)rsz * 8;
+	}
+
+	return 1;
+syserr:
+	xwarn(out, NULL);
+	recset_free(rs);
+	return -1;
+err:
+	xwarnx(out, "binary parse: %s", n->host);
+	recset_free(rs);
+	return 0;
+}
@@ -0,0 +1,346 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <ncurses.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "slant.h"
+
+/*
+ * The cache holds the records of each node as we last saw them, so that
+ * we've something to show before the first responses come in.
+ * It's only read by the machine that wrote it, so everything is in
+ * native byte order, and the record arrays are those of recarray_buf().
+ * The file is a header followed by an entry per node, each followed by
+ * the node's URL and version, then its record arrays by interval.
+ * Everything starts on an eight-byte boundary.
+ */
+#define	CACHE_MAGIC	 "SLC1"
+#define	CACHE_ALIGN(_sz) (((_sz) + 7) & ~(size_t)7)
+
+struct	cachehdr {
+	char		 magic[4]; /* CACHE_MAGIC */
+	uint32_t	 entries; /* number of entries */
+	uint64_t	 size; /* size of whole file */
+};
+
+struct	cacheent {
+	int64_t		 lastseen; /* when the node was last seen */
+	int64_t		 system[9]; /* struct system, by field */
+	int64_t		 cgi[3]; /* cgiopen, cgilist, cgisend */
+	uint32_t	 flags;
+#define	CACHE_SYSTEM	 0x01 /* has_system */
+#define	CACHE_VERSION	 0x02 /* has_version */
+#define	CACHE_CGI	 0x04 /* has_cgi */
+	uint32_t	 urlsz; /* length of URL */
+	uint32_t	 versionsz; /* length of version */
+	uint32_t	 pad;
+	uint64_t	 ivsz[INTERVALS]; /* records by interval */
+};
+
+/*
+ * Size of the entry for records "r" of URL "url", including what
+ * follows it.
+ */
+static size_t
+cache_entsize(const char *url, const struct recset *r)
+{
+	size_t	 i, sz, bufsz;
+
+	sz = sizeof(struct cacheent) + CACHE_ALIGN(strlen(url));
+	if (r->has_version && NULL != r->version)
+		sz += CACHE_ALIGN(strlen(r->version));
+	for (i = 0; i < INTERVALS; i++) {
+		recarray_buf(&r->ivs[i], &bufsz);
+		sz += CACHE_ALIGN(bufsz);
+	}
+	return sz;
+}
+
+/*
+ * Load the records of entry "e" into "n", its URL, version, and records
+ * following at "p" (already checked to be within the file).
+ * Returns zero on memory exhaustion, non-zero on success.
+ */
+static int
+cache_entload(struct node *n, const struct cacheent *e, const char *p)
+{
+	struct recset	*r;
+	size_t		 i, sz;
+
+	if (NULL == (r = calloc(1, sizeof(struct recset))))
+		return 0;
+
+	p += CACHE_ALIGN(e->urlsz);
+	if (CACHE_VERSION & e->flags) {
+		if (NULL == (r->version = strndup(p, e->versionsz)))
+			goto err;
+		r->has_version = 1;
+		p += CACHE_ALIGN(e->versionsz);
+	}
+
+	if (CACHE_SYSTEM & e->flags) {
+		r->system.boot = e->system[0];
+		r->system.id = e->system[1];
+		r->system.nprocstime = e->system[2];
+		r->system.nfilestime = e->system[3];
+		r->system.cputime = e->system[4];
+		r->system.memtime = e->system[5];
+		r->system.nettime = e->system[6];
+		r->system.disctime = e->system[7];
+		r->system.dbtime = e->system[8];
+		r->has_system = 1;
+	}
+
+	if (CACHE_CGI & e->flags) {
+		r->cgiopen = e->cgi[0];
+		r->cgilist = e->cgi[1];
+		r->cgisend = e->cgi[2];
+		r->has_cgi = 1;
+	}
+
+	for (i = 0; i < INTERVALS; i++) {
+		if ( ! recarray_load(&r->ivs[i], e->ivsz[i], p))
+			goto err;
+		recarray_buf(&r->ivs[i], &sz);
+		p += CACHE_ALIGN(sz);
+	}
+
+	if ( ! recset_keep(r, n->depth))
+		goto err;
+
+	recset_free(n->recs);
+	free(n->recs);
+	n->recs = r;
+	n->lastseen = e->lastseen;
+	n->stale = 1;
+	n->dirty = 1;
+	return 1;
+err:
+	recset_free(r);
+	free(r);
+	return 0;
+}
+
+/*
+ * Give the nodes "n" the records cached in "fd", marking them as stale
+ * until they're next seen.
+ * Entries whose URLs aren't ours are ignored, as is the whole cache
+ * (with a warning) if it's malformed.
+ * Returns zero on memory exhaustion, non-zero otherwise.
+ */
+int
+cache_load(struct out *out, int fd, struct node *n, size_t nsz)
+{
+	struct stat	 st;
+	void		*map;
+	const char	*p, *end;
+	const struct cachehdr *h;
+	const struct cacheent *e;
+	size_t		 i, j, sz;
+	int		 rc = 1;
+
+	if (-1 == fstat(fd, &st)) {
+		xwarn(out, "cache");
+		return 1;
+	} else if (0 == st.st_size)
+		return 1;
+
+	if ((size_t)st.st_size < sizeof(struct cachehdr)) {
+		xwarnx(out, "cache: bad size");
+		return 1;
+	}
+
+	sz = st.st_size;
+	map = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (MAP_FAILED == map) {
+		xwarn(out, "cache");
+		return 1;
+	}
+
+	h = map;
+	p = (const char *)map + sizeof(struct cachehdr);
+	end = (const char *)map + sz;
+
+	if (memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic)) ||
+	    h->size != sz) {
+		xwarnx(out, "cache: bad header");
+		goto out;
+	}
+
+	for (i = 0; i < h->entries; i++) {
+		if ((size_t)(end - p) < sizeof(struct cacheent))
+			break;
+		e = (const struct cacheent *)p;
+		p += sizeof(struct cacheent);
+
+		/* Make sure what follows is all in the file. */
+
+		sz = CACHE_ALIGN((size_t)e->urlsz);
+		if (CACHE_VERSION & e->flags)
+			sz += CACHE_ALIGN((size_t)e->versionsz);
+		for (j = 0; j < INTERVALS; j++) {
+			if (e->ivsz[j] > (size_t)(end - p) / RECARRAY_ROW)
+				break;
+			sz += CACHE_ALIGN(e->ivsz[j] * RECARRAY_ROW);
+		}
+		if (j < INTERVALS || sz > (size_t)(end - p))
+			break;
+
+		for (j = 0; j < nsz; j++)
+			if (strlen(n[j].url) == e->urlsz &&
+			    0 == memcmp(n[j].url, p, e->urlsz))
+				break;
+
+		if (j < nsz && NULL == n[j].recs &&
+		    ! cache_entload(&n[j], e, p)) {
+			rc = 0;
+			break;
+		}
+		p += sz;
+	}
+
+	if (rc && i < h->entries)
+		xwarnx(out, "cache: bad entry");
+out:
+	munmap(map, st.st_size);
+	return rc;
+}
+
+/*
+ * Write the records of the nodes "n" into the cache "fd", replacing
+ * whatever it had, unless none of them has records (e.g., we exited
+ * before any were seen).
+ * The header is written last, so a cache we didn't finish writing is
+ * seen as malformed.
+ * Returns zero on failure, non-zero on success.
+ */
+int
+cache_save(struct out *out, int fd, const struct node *n, size_t nsz)
+{
+	struct cachehdr	*h;
+	struct cacheent	*e;
+	const struct recset *r;
+	void		*map;
+	char		*p;
+	const void	*buf;
+	size_t		 i, j, sz, bufsz, entries = 0;
+	int		 rc;
+
+	sz = sizeof(struct cachehdr);
+	for (i = 0; i < nsz; i++)
+		if (NULL != n[i].recs) {
+			sz += cache_entsize(n[i].url, n[i].recs);
+			entries++;
+		}
+
+	if (0 == entries)
+		return 1;
+
+	if (-1 == ftruncate(fd, 0) ||
+	    -1 == ftruncate(fd, sz)) {
+		xwarn(out, "cache");
+		return 0;
+	}
+
+	map = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == map) {
+		xwarn(out, "cache");
+		return 0;
+	}
+
+	/* The file is zero-filled, so padding is already zero. */
+
+	p = (char *)map + sizeof(struct cachehdr);
+
+	for (i = 0; i < nsz; i++) {
+		if (NULL == (r = n[i].recs))
+			continue;
+		e = (struct cacheent *)p;
+		p += sizeof(struct cacheent);
+
+		e->lastseen = n[i].lastseen;
+		e->urlsz = strlen(n[i].url);
+		memcpy(p, n[i].url, e->urlsz);
+		p += CACHE_ALIGN((size_t)e->urlsz);
+
+		if (r->has_version && NULL != r->version) {
+			e->flags |= CACHE_VERSION;
+			e->versionsz = strlen(r->version);
+			memcpy(p, r->version, e->versionsz);
+			p += CACHE_ALIGN((size_t)e->versionsz);
+		}
+
+		if (r->has_system) {
+			e->flags |= CACHE_SYSTEM;
+			e->system[0] = r->system.boot;
+			e->system[1] = r->system.id;
+			e->system[2] = r->system.nprocstime;
+			e->system[3] = r->system.nfilestime;
+			e->system[4] = r->system.cputime;
+			e->system[5] = r->system.memtime;
+			e->system[6] = r->system.nettime;
+			e->system[7] = r->system.disctime;
+			e->system[8] = r->system.dbtime;
+		}
+
+		if (r->has_cgi) {
+			e->flags |= CACHE_CGI;
+			e->cgi[0] = r->cgiopen;
+			e->cgi[1] = r->cgilist;
+			e->cgi[2] = r->cgisend;
+		}
+
+		for (j = 0; j < INTERVALS; j++) {
+			e->ivsz[j] = r->ivs[j].sz;
+			buf = recarray_buf(&r->ivs[j], &bufsz);
+			if (bufsz)
+				memcpy(p, buf, bufsz);
+			p += CACHE_ALIGN(bufsz);
+		}
+	}
+
+	assert(p == (char *)map + sz);
+
+	if (-1 == msync(map, sz, MS_SYNC)) {
+		xwarn(out, "cache");
+		munmap(map, sz);
+		return 0;
+	}
+
+	h = map;
+	h->entries = entries;
+	h->size = sz;
+	memcpy(h->magic, CACHE_MAGIC, sizeof(h->magic));
+
+	if ( ! (rc = (-1 != msync(map, sz, MS_SYNC))))
+		xwarn(out, "cache");
+	munmap(map, sz);
+	return rc;
+}
@@ -15,8 +15,11 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include <sys/queue.h>
+#include <sys/stat.h>
 
+#include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -39,90 +42,716 @@ enum	page {
 	PAGE__MAX
 };
 
+/*
+ * Content type of our binary format.
+ * This must be the same as in slant(1).
+ */
+#define	BINARY_MIME "application/x-slant"
+
+/*
+ * Binary format magic and version.
+ * Version 2 documents may end with sections (see sendbinary()), which
+ * version 1 readers don't know, so documents without any are still
+ * sent as version 1.
+ */
+#define	BINARY_MAGIC "SLNT"
+#define	BINARY_VERSION 2
+
+/*
+ * Number of per-record columns in the binary format.
+ */
+#define	BINARY_COLS 12
+
+/*
+ * Most seconds a client may ask us to hold its request until our
+ * records change.
+ * This must be well within the server's CGI timeout.
+ */
+#define	WAIT_MAX 60
+
+#define	INTERVALS (INTERVAL_byyear + 1)
+
+enum	key {
+	KEY_SINCE,
+	KEY_WAIT,
+	KEY_INTERVALS,
+	KEY_TIMING,
+	KEY__MAX
+};
+
+/*
+ * Our timings (microseconds) of answering from the database.
+ */
+struct	cgitime {
+	struct timespec	 mark; /* start of current step */
+	int64_t		 open; /* opening the database */
+	int64_t		 list; /* listing records and system */
+	int64_t		 send; /* serialising the response */
+};
+
+/*
+ * The records we're sending of each interval.
+ * The quarter-minute records are always listed, as our validator is
+ * made from them, even if they're not sent.
+ */
+struct	ivsel {
+	struct record_q	*q[INTERVALS]; /* records (or NULL) */
+	int		 want[INTERVALS]; /* whether sent */
+	size_t		 max[INTERVALS]; /* most sent (or zero for all) */
+};
+
+static const char *const ivnames[INTERVALS] = {
+	"qmin", /* INTERVAL_byqmin */
+	"min", /* INTERVAL_bymin */
+	"hour", /* INTERVAL_byhour */
+	"day", /* INTERVAL_byday */
+	"week", /* INTERVAL_byweek */
+	"year", /* INTERVAL_byyear */
+};
+
+/*
+ * Number of values in the binary format's timing block.
+ */
+#define	BINARY_TIMES 10
+
 static const char *const pages[PAGE__MAX] = {
 	"index", /* PAGE_INDEX */
 };
 
+static const struct kvalid keys[KEY__MAX] = {
+	{ kvalid_int, "since" }, /* KEY_SINCE */
+	{ kvalid_int, "wait" }, /* KEY_WAIT */
+	{ kvalid_stringne, "intervals" }, /* KEY_INTERVALS */
+	{ kvalid_int, "timing" }, /* KEY_TIMING */
+};
+
+/*
+ * Microseconds since the last step of "t" (or its start), which is
+ * then set to now.
+ */
+static int64_t
+cgitime_step(struct cgitime *t)
+{
+	struct timespec	 now;
+	int64_t		 us;
+
+	if (-1 == clock_gettime(CLOCK_MONOTONIC, &now))
+		return 0;
+	us = (now.tv_sec - t->mark.tv_sec) * 1000000 +
+		(now.tv_nsec - t->mark.tv_nsec) / 1000;
+	t->mark = now;
+	return us;
+}
+
 /*
  * Fill out generic headers then start the HTTP document body (no more
  * headers after this point!)
+ * If "type" is NULL, use the content type of the request.
+ * If "etag" is not NULL, it's the response's validator.
+ * The body is compressed if the client says it accepts compression.
  */
 static void
-http_open(struct kreq *r, enum khttp code)
+http_open(struct kreq *r, enum khttp code, 
+	const char *type, const char *etag)
 {
 
 	khttp_head(r, kresps[KRESP_STATUS], 
 		"%s", khttps[code]);
-	khttp_head(r, kresps[KRESP_CONTENT_TYPE], 
-		"%s", kmimetypes[r->mime]);
-	khttp_body(r);
+	khttp_head(r, kresps[KRESP_CONTENT_TYPE], "%s", 
+		NULL != type ? type : kmimetypes[r->mime]);
+	khttp_head(r, kresps[KRESP_VARY], "Accept-Encoding");
+	if (NULL != etag)
+		khttp_head(r, kresps[KRESP_ETAG], "%s", etag);
+	khttp_body_compress(r, 1);
 }
 
+/*
+ * Emit the named array of records of the given interval, which is
+ * empty if not selected and has at most the selected number.
+ * If "since" is non-zero, only emit records started at or after
+ * "since" (these are new or, for the head, may have been updated)
+ * along with the newest record started before it, which may have been
+ * the interval's head when the client last asked and thus updated in
+ * the meantime.
+ * This relies upon the records being ordered by descending ctime.
+ */
 static void
-sendindex(struct kreq *r, 
-	const struct system *sys, const struct record_q *q)
+sendinterval(struct kjsonreq *req, const struct ivsel *sel,
+	enum interval iv, int64_t since)
 {
-	struct kjsonreq	 req;
 	const struct record *rr;
+	size_t		 sz = 0;
 
-	http_open(r, KHTTP_200);
+	kjson_arrayp_open(req, ivnames[iv]);
+	if (sel->want[iv] && NULL != sel->q[iv])
+		TAILQ_FOREACH(rr, sel->q[iv], _entries) {
+			kjson_obj_open(req);
+			json_record_data(req, rr);
+			kjson_obj_close(req);
+			if (since && rr->ctime < since)
+				break;
+			if (++sz == sel->max[iv])
+				break;
+		}
+	kjson_array_close(req);
+}
+
+/*
+ * Send our records, either all of them or, if "since" is non-zero,
+ * only those changed since the client's newest quarter-minute
+ * record was started.
+ * In the latter case, the document contains a "since" key so that
+ * the client knows it's receiving a partial set.
+ * Our timings "t" are only sent if not NULL (the client asked).
+ */
+static void
+sendindex(struct kreq *r, const struct system *sys, 
+	const struct ivsel *sel, int64_t since, const char *etag,
+	struct cgitime *t)
+{
+	struct kjsonreq	 req;
+	enum interval	 iv;
+
+	http_open(r, KHTTP_200, NULL, etag);
 	kjson_open(&req, r);
 	kjson_obj_open(&req);
 
 	kjson_putstringp(&req, "version", VERSION);
+	if (since)
+		kjson_putintp(&req, "since", since);
 	json_system_obj(&req, sys);
 
-	kjson_arrayp_open(&req, "qmin");
-	TAILQ_FOREACH(rr, q, _entries)
-		if (INTERVAL_byqmin == rr->interval) {
-			kjson_obj_open(&req);
-			json_record_data(&req, rr);
-			kjson_obj_close(&req);
-		}
-	kjson_array_close(&req);
-	kjson_arrayp_open(&req, "min");
-	TAILQ_FOREACH(rr, q, _entries)
-		if (INTERVAL_bymin == rr->interval) {
-			kjson_obj_open(&req);
-			json_record_data(&req, rr);
-			kjson_obj_close(&req);
-		}
-	kjson_array_close(&req);
-	kjson_arrayp_open(&req, "hour");
-	TAILQ_FOREACH(rr, q, _entries)
-		if (INTERVAL_byhour == rr->interval) {
-			kjson_obj_open(&req);
-			json_record_data(&req, rr);
-			kjson_obj_close(&req);
-		}
-	kjson_array_close(&req);
-	kjson_arrayp_open(&req, "day");
-	TAILQ_FOREACH(rr, q, _entries)
-		if (INTERVAL_byday == rr->interval) {
-			kjson_obj_open(&req);
-			json_record_data(&req, rr);
-			kjson_obj_close(&req);
+	for (iv = INTERVAL_byqmin; iv <= INTERVAL_byyear; iv++)
+		sendinterval(&req, sel, iv, since);
+
+	/* Serialising is timed up to our own timings. */
+
+	if (NULL != t) {
+		t->send = cgitime_step(t);
+		kjson_objp_open(&req, "cgi");
+		kjson_putintp(&req, "open", t->open);
+		kjson_putintp(&req, "list", t->list);
+		kjson_putintp(&req, "send", t->send);
+		kjson_obj_close(&req);
+	}
+
+	kjson_obj_close(&req);
+	kjson_close(&req);
+}
+
+static void
+put_u32(char *p, uint32_t v)
+{
+
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
+
+static void
+put_u64(char *p, uint64_t v)
+{
+
+	put_u32(p, v & 0xffffffff);
+	put_u32(p + 4, v >> 32);
+}
+
+static void
+put_f64(char *p, double v)
+{
+	uint64_t u;
+
+	memcpy(&u, &v, sizeof(double));
+	put_u64(p, u);
+}
+
+/*
+ * Fill "buf" with column "col" of the "rsz" records "rv".
+ * Columns are in the order of the record fields.
+ */
+static void
+binary_col(char *buf, size_t col, 
+	const struct record *const *rv, size_t rsz)
+{
+	size_t	 i;
+
+	for (i = 0; i < rsz; i++, buf += 8)
+		switch (col) {
+		case 0:
+			put_u64(buf, rv[i]->ctime);
+			break;
+		case 1:
+			put_u64(buf, rv[i]->entries);
+			break;
+		case 2:
+			put_f64(buf, rv[i]->cpu);
+			break;
+		case 3:
+			put_f64(buf, rv[i]->mem);
+			break;
+		case 4:
+			put_u64(buf, rv[i]->nettx);
+			break;
+		case 5:
+			put_u64(buf, rv[i]->netrx);
+			break;
+		case 6:
+			put_u64(buf, rv[i]->discread);
+			break;
+		case 7:
+			put_u64(buf, rv[i]->discwrite);
+			break;
+		case 8:
+			put_f64(buf, rv[i]->nprocs);
+			break;
+		case 9:
+			put_f64(buf, rv[i]->rprocs);
+			break;
+		case 10:
+			put_f64(buf, rv[i]->nfiles);
+			break;
+		case 11:
+			put_u64(buf, rv[i]->id);
+			break;
+		default:
+			abort();
 		}
-	kjson_array_close(&req);
-	kjson_arrayp_open(&req, "week");
-	TAILQ_FOREACH(rr, q, _entries)
-		if (INTERVAL_byweek == rr->interval) {
-			kjson_obj_open(&req);
-			json_record_data(&req, rr);
-			kjson_obj_close(&req);
+}
+
+/*
+ * Like sendindex() but with our binary format, as documented in
+ * slant-cgi(8): a header followed by, for each interval, the number of
+ * records then each column of fixed-width, little-endian values.
+ * Records are selected as in sendinterval().
+ * If the client asked for timings "t", the system's then ours follow
+ * in a section: sections are flagged from bit 2, in order, and are
+ * each a count of the 64-bit values following, so readers can skip
+ * those they don't know.
+ */
+static void
+sendbinary(struct kreq *r, const struct system *sys, 
+	const struct ivsel *sel, int64_t since, const char *etag,
+	struct cgitime *t)
+{
+	const struct record *rr, **rv = NULL;
+	char		 hbuf[32], *buf = NULL;
+	int64_t		 times[BINARY_TIMES];
+	size_t		 vsz = strlen(VERSION), rsz, max = 0, col;
+	enum interval	 iv;
+
+	for (iv = INTERVAL_byqmin; iv <= INTERVAL_byyear; iv++)
+		if (NULL != sel->q[iv])
+			TAILQ_FOREACH(rr, sel->q[iv], _entries)
+				max++;
+
+	if (max > 0 &&
+	    (NULL == (rv = calloc(max, sizeof(struct record *))) ||
+	     NULL == (buf = calloc(max, 8)))) {
+		kutil_warn(NULL, NULL, NULL);
+		free(rv);
+		http_open(r, KHTTP_500, BINARY_MIME, NULL);
+		return;
+	}
+
+	http_open(r, KHTTP_200, BINARY_MIME, etag);
+
+	memcpy(hbuf, BINARY_MAGIC, 4);
+	put_u32(hbuf + 4, NULL != t ? BINARY_VERSION : 1);
+	put_u32(hbuf + 8, (NULL != sys ? 1 : 0) | 
+		(since ? 2 : 0) | (NULL != t ? 4 : 0));
+	put_u64(hbuf + 12, since);
+	put_u64(hbuf + 20, NULL != sys ? sys->boot : 0);
+	put_u32(hbuf + 28, vsz);
+	khttp_write(r, hbuf, 32);
+	khttp_write(r, VERSION, vsz);
+
+	for (iv = INTERVAL_byqmin; iv <= INTERVAL_byyear; iv++) {
+		rsz = 0;
+		if (sel->want[iv] && NULL != sel->q[iv])
+			TAILQ_FOREACH(rr, sel->q[iv], _entries) {
+				rv[rsz++] = rr;
+				if (since && rr->ctime < since)
+					break;
+				if (rsz == sel->max[iv])
+					break;
+			}
+		put_u32(hbuf, rsz);
+		khttp_write(r, hbuf, 4);
+		if (0 == rsz)
+			continue;
+		for (col = 0; col < BINARY_COLS; col++) {
+			binary_col(buf, col, rv, rsz);
+			khttp_write(r, buf, rsz * 8);
 		}
-	kjson_array_close(&req);
-	kjson_arrayp_open(&req, "year");
-	TAILQ_FOREACH(rr, q, _entries)
-		if (INTERVAL_byyear == rr->interval) {
-			kjson_obj_open(&req);
-			json_record_data(&req, rr);
-			kjson_obj_close(&req);
+	}
+
+	if (NULL == t)
+		goto out;
+
+	t->send = cgitime_step(t);
+	times[0] = NULL != sys ? sys->nprocstime : 0;
+	times[1] = NULL != sys ? sys->nfilestime : 0;
+	times[2] = NULL != sys ? sys->cputime : 0;
+	times[3] = NULL != sys ? sys->memtime : 0;
+	times[4] = NULL != sys ? sys->nettime : 0;
+	times[5] = NULL != sys ? sys->disctime : 0;
+	times[6] = NULL != sys ? sys->dbtime : 0;
+	times[7] = t->open;
+	times[8] = t->list;
+	times[9] = t->send;
+
+	put_u32(hbuf, BINARY_TIMES);
+	khttp_write(r, hbuf, 4);
+	for (col = 0; col < BINARY_TIMES; col++) {
+		put_u64(hbuf, times[col]);
+		khttp_write(r, hbuf, 8);
+	}
+out:
+	free(rv);
+	free(buf);
+}
+
+/*
+ * See if the client lists the content type "mime" in its Accept
+ * header.
+ * We don't bother with quality values: if it's asking for our binary
+ * format, it's preferred.
+ */
+static int
+accept_mime(const struct kreq *r, const char *mime)
+{
+	const char	*cp, *v;
+	size_t		 sz = strlen(mime);
+
+	if (NULL == r->reqmap[KREQU_ACCEPT])
+		return 0;
+
+	v = r->reqmap[KREQU_ACCEPT]->val;
+	for (cp = v; NULL != (cp = strstr(cp, mime)); cp += sz)
+		if ((cp == v || ',' == cp[-1] || ' ' == cp[-1]) &&
+		    ('\0' == cp[sz] || ',' == cp[sz] || 
+		     ';' == cp[sz] || ' ' == cp[sz]))
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Format the validator for the records whose opaque version is "base"
+ * into "etag".
+ * It's weak because our representations vary by compression, the
+ * since query value, the selected intervals, and whether timings are
+ * asked for; and it differs with our binary format.
+ */
+static void
+etag_make(char *etag, size_t sz, const char *base, int binary)
+{
+
+	snprintf(etag, sz, "W/\"%s%s\"", base, binary ? ".b" : "");
+}
+
+/*
+ * See if the client already has the representation "etag".
+ * This compares only the quoted part, so it matches both weak and
+ * strong forms of the validator.
+ */
+static int
+etag_match(const struct kreq *r, const char *etag)
+{
+	const char	*v;
+
+	if (NULL == r->reqmap[KREQU_IF_NONE_MATCH])
+		return 0;
+
+	v = r->reqmap[KREQU_IF_NONE_MATCH]->val;
+	return 0 == strcmp(v, "*") || NULL != strstr(v, etag + 2);
+}
+
+/*
+ * See if the client accepts gzip compression.
+ */
+static int
+accept_gzip(const struct kreq *r)
+{
+
+	return NULL != r->reqmap[KREQU_ACCEPT_ENCODING] &&
+		NULL != strstr(r->reqmap[KREQU_ACCEPT_ENCODING]->val, 
+			"gzip");
+}
+
+/*
+ * Open a snapshot written by slant-collectd(8) and read its opaque
+ * version from the first line, leaving the file at its body.
+ * Returns the file or NULL if it doesn't exist or is malformed.
+ */
+static FILE *
+snap_open(const char *fn, char *base, size_t basesz)
+{
+	FILE	*f;
+	size_t	 sz;
+
+	if (NULL == (f = fopen(fn, "r"))) {
+		if (ENOENT != errno)
+			kutil_warn(NULL, NULL, "%s", fn);
+		return NULL;
+	}
+
+	if (NULL == fgets(base, basesz, f) ||
+	    0 == (sz = strlen(base)) ||
+	    '\n' != base[sz - 1]) {
+		kutil_warnx(NULL, NULL, "%s: malformed", fn);
+		fclose(f);
+		return NULL;
+	}
+
+	base[sz - 1] = '\0';
+	return f;
+}
+
+/*
+ * Send the body of the snapshot "f" as our JSON document.
+ * If "gz", the body is already compressed.
+ */
+static void
+snap_send(struct kreq *r, FILE *f, const char *etag, int gz)
+{
+	char	 buf[BUFSIZ];
+	size_t	 sz;
+
+	khttp_head(r, kresps[KRESP_STATUS], 
+		"%s", khttps[KHTTP_200]);
+	khttp_head(r, kresps[KRESP_CONTENT_TYPE], 
+		"%s", kmimetypes[KMIME_APP_JSON]);
+	khttp_head(r, kresps[KRESP_VARY], "Accept-Encoding");
+	khttp_head(r, kresps[KRESP_ETAG], "%s", etag);
+	if (gz)
+		khttp_head(r, kresps[KRESP_CONTENT_ENCODING], "gzip");
+	khttp_body_compress(r, ! gz);
+
+	while ((sz = fread(buf, 1, sizeof(buf), f)) > 0)
+		khttp_write(r, buf, sz);
+}
+
+/*
+ * The snapshot written by slant-collectd(8) holding what's selected by
+ * "sel", or NULL if there's none.
+ * The full snapshot has all records, so it's only used when they're
+ * all asked for and not only those "since" a time.
+ * The head snapshot has the newest record of each interval, which is
+ * what's sent when each selected interval asks for at most one, since
+ * or not; the intervals not selected are sent too, which clients
+ * ignore.
+ */
+static const char *
+snap_select(const struct ivsel *sel, int64_t since)
+{
+	enum interval	 iv;
+	int		 all = 1, head = 0;
+
+	for (iv = INTERVAL_byqmin; iv <= INTERVAL_byyear; iv++) {
+		if ( ! sel->want[iv] || 0 != sel->max[iv])
+			all = 0;
+		if (sel->want[iv] && 1 != sel->max[iv])
+			break;
+		if (sel->want[iv])
+			head = 1;
+	}
+
+	if (all && 0 == since)
+		return SNAPFILE;
+	if (iv > INTERVAL_byyear && head)
+		return SNAPFILE ".head";
+	return NULL;
+}
+
+/*
+ * Try to answer the request from the snapshot written by
+ * slant-collectd(8), if one exists, without touching the database.
+ * If the client has the current version of the snapshot, we wait up to
+ * "wait" seconds for a new one, then send it a 304 if there's none;
+ * otherwise, JSON requests whose selection "sel" is in a snapshot are
+ * served from it.
+ * Clients asking for our binary format that also accept JSON ("json")
+ * are sent JSON, as the snapshots are.
+ * Returns zero if the request has not been answered.
+ */
+static int
+sendsnap(struct kreq *r, int binary, int json, 
+	const struct ivsel *sel, int64_t since, int64_t wait)
+{
+	FILE		*f, *zf;
+	char		 base[64], zbase[64], etag[80], zfn[PATH_MAX];
+	const char	*fn;
+
+	/* JSON validators are those of a snapshot being sent. */
+
+	if (NULL != (fn = json ? snap_select(sel, since) : NULL))
+		binary = 0;
+
+	if (NULL == (f = snap_open(SNAPFILE, base, sizeof(base))))
+		return 0;
+
+	etag_make(etag, sizeof(etag), base, binary);
+
+	for ( ; wait > 0 && etag_match(r, etag); wait--) {
+		fclose(f);
+		sleep(1);
+		if (NULL == (f = snap_open(SNAPFILE, base, sizeof(base))))
+			return 0;
+		etag_make(etag, sizeof(etag), base, binary);
+	}
+
+	if (etag_match(r, etag)) {
+		http_open(r, KHTTP_304, NULL, etag);
+		fclose(f);
+		return 1;
+	} else if (NULL == fn) {
+		fclose(f);
+		return 0;
+	}
+
+	/* The head snapshot is only sent if it's the same version. */
+
+	if (strcmp(fn, SNAPFILE)) {
+		fclose(f);
+		if (NULL == (f = snap_open(fn, zbase, sizeof(zbase))))
+			return 0;
+		if (strcmp(base, zbase)) {
+			fclose(f);
+			return 0;
 		}
-	kjson_array_close(&req);
+	}
 
-	kjson_obj_close(&req);
-	kjson_close(&req);
+	/* Use the compressed snapshot if it's the same version. */
+
+	snprintf(zfn, sizeof(zfn), "%s.gz", fn);
+	zf = accept_gzip(r) ? 
+		snap_open(zfn, zbase, sizeof(zbase)) : NULL;
+
+	if (NULL != zf && 0 == strcmp(base, zbase)) {
+		snap_send(r, zf, etag, 1);
+	} else
+		snap_send(r, f, etag, 0);
+
+	if (NULL != zf)
+		fclose(zf);
+	fclose(f);
+	return 1;
+}
+
+/*
+ * Parse the selected intervals "v" (or NULL for all records of all
+ * intervals), a comma-separated list of interval names each optionally
+ * followed by a colon and the most records to send.
+ * Unknown intervals and bad counts are ignored.
+ */
+static void
+ivsel_parse(struct ivsel *sel, const char *v)
+{
+	char		 buf[16];
+	const char	*er;
+	size_t		 sz, nsz;
+	enum interval	 iv;
+
+	memset(sel, 0, sizeof(struct ivsel));
+
+	if (NULL == v) {
+		for (iv = INTERVAL_byqmin; iv <= INTERVAL_byyear; iv++)
+			sel->want[iv] = 1;
+		return;
+	}
+
+	for ( ; '\0' != *v; v += sz + (',' == v[sz])) {
+		sz = strcspn(v, ",");
+		nsz = strcspn(v, ":,");
+		for (iv = INTERVAL_byqmin; iv <= INTERVAL_byyear; iv++)
+			if (strlen(ivnames[iv]) == nsz &&
+			    0 == strncmp(v, ivnames[iv], nsz))
+				break;
+		if (iv > INTERVAL_byyear)
+			continue;
+		sel->want[iv] = 1;
+		sel->max[iv] = 0;
+		if (nsz == sz || sz - nsz > sizeof(buf))
+			continue;
+		memcpy(buf, v + nsz + 1, sz - nsz - 1);
+		buf[sz - nsz - 1] = '\0';
+		sel->max[iv] = strtonum(buf, 1, INT_MAX, &er);
+	}
+}
+
+/*
+ * List the records of each selected interval with its own query, and
+ * the quarter-minute records for our validator.
+ */
+static void
+ivsel_list(struct kwbp *db, struct ivsel *sel)
+{
+	enum interval	 iv;
+
+	for (iv = INTERVAL_byqmin; iv <= INTERVAL_byyear; iv++)
+		if (sel->want[iv] || INTERVAL_byqmin == iv)
+			sel->q[iv] = db_record_list_byinterval(db, iv);
+}
+
+static void
+ivsel_free(struct ivsel *sel)
+{
+	enum interval	 iv;
+
+	for (iv = INTERVAL_byqmin; iv <= INTERVAL_byyear; iv++) {
+		if (NULL != sel->q[iv])
+			db_record_freeq(sel->q[iv]);
+		sel->q[iv] = NULL;
+	}
+}
+
+/*
+ * Find the newest of the quarter-minute records "q", from which our
+ * validator is made into "etag".
+ * Returns the record or NULL if there are none (and no validator).
+ */
+static const struct record *
+record_etag(const struct record_q *q, int binary, char *etag, size_t sz)
+{
+	const struct record *rr;
+	char		 base[64];
+
+	if (NULL == q || NULL == (rr = TAILQ_FIRST(q)))
+		return NULL;
+
+	snprintf(base, sizeof(base), "%" PRId64 "-%lld", 
+		rr->id, (long long)rr->ctime);
+	etag_make(etag, sz, base, binary);
+	return rr;
+}
+
+/*
+ * Cheap signature of the database: the modification times and sizes of
+ * it and its write-ahead log (if any).
+ * If this hasn't changed, neither have our records.
+ */
+static void
+db_stamp(struct stat st[2])
+{
+
+	memset(st, 0, 2 * sizeof(struct stat));
+	stat(DBFILE, &st[0]);
+	stat(DBFILE "-wal", &st[1]);
+}
+
+static int
+db_stamp_eq(const struct stat *st1, const struct stat *st2)
+{
+	size_t	 i;
+
+	for (i = 0; i < 2; i++)
+		if (st1[i].st_size != st2[i].st_size ||
+		    st1[i].st_mtim.tv_sec != st2[i].st_mtim.tv_sec ||
+		    st1[i].st_mtim.tv_nsec != st2[i].st_mtim.tv_nsec)
+			return 0;
+	return 1;
 }
 
 int
@@ -130,8 +759,14 @@ main(void)
 {
 	struct kreq	 r;
 	enum kcgi_err	 er;
-	struct record_q	*rq;
+	struct ivsel	 sel;
 	struct system	*sys;
+	int64_t		 since = 0, wait = 0;
+	int		 binary, json, timing;
+	const struct record *rr;
+	char		 etag[80];
+	struct cgitime	 t;
+	struct stat	 st[2], nst[2];
 
 	if (-1 == pledge("stdio rpath "
 	    "cpath wpath flock fattr proc", NULL)) {
@@ -140,7 +775,7 @@ main(void)
 	}
 
 	er = khttp_parsex(&r, ksuffixmap,
-             kmimetypes, KMIME__MAX, NULL, 0,
+             kmimetypes, KMIME__MAX, keys, KEY__MAX,
              pages, PAGE__MAX, KMIME_APP_JSON,
              PAGE_INDEX, NULL, NULL, 0, NULL);
 
@@ -151,26 +786,71 @@ main(void)
 
 	/*
 	 * Front line of defence: make sure we're a proper method, make
-	 * sure we're a page, make sure we're a JSON file.
+	 * sure we're a page, make sure we're a JSON (or binary) file.
 	 */
 
 	if (KMETHOD_GET != r.method) {
-		http_open(&r, KHTTP_405);
+		http_open(&r, KHTTP_405, NULL, NULL);
+		khttp_free(&r);
+		return EXIT_SUCCESS;
+	}
+
+	/*
+	 * Our binary format is either asked for by suffix or, for an
+	 * unadorned request, by the Accept header.
+	 */
+
+	binary = 0 == strcmp(r.suffix, "bin") ||
+		('\0' == r.suffix[0] && accept_mime(&r, BINARY_MIME));
+	json = ! binary || ('\0' == r.suffix[0] && 
+		accept_mime(&r, kmimetypes[KMIME_APP_JSON]));
+
+	if (PAGE__MAX == r.page || 
+	    ( ! binary && KMIME_APP_JSON != r.mime)) {
+		http_open(&r, KHTTP_404, NULL, NULL);
 		khttp_free(&r);
 		return EXIT_SUCCESS;
-	} else if (PAGE__MAX == r.page || 
-	           KMIME_APP_JSON != r.mime) {
-		http_open(&r, KHTTP_404);
+	}
+
+	if (NULL != r.fieldmap[KEY_SINCE] &&
+	    r.fieldmap[KEY_SINCE]->parsed.i > 0)
+		since = r.fieldmap[KEY_SINCE]->parsed.i;
+
+	/* Clients may ask us to hold them until our records change. */
+
+	if (NULL != r.fieldmap[KEY_WAIT] &&
+	    r.fieldmap[KEY_WAIT]->parsed.i > 0)
+		wait = r.fieldmap[KEY_WAIT]->parsed.i > WAIT_MAX ?
+			WAIT_MAX : r.fieldmap[KEY_WAIT]->parsed.i;
+
+	/* Clients only get our timings if they ask. */
+
+	timing = NULL != r.fieldmap[KEY_TIMING] &&
+		r.fieldmap[KEY_TIMING]->parsed.i > 0;
+
+	/* Clients may only want some records of some intervals. */
+
+	ivsel_parse(&sel, NULL == r.fieldmap[KEY_INTERVALS] ? NULL :
+		r.fieldmap[KEY_INTERVALS]->parsed.s);
+
+	if (sendsnap(&r, binary, json, &sel, since, wait)) {
 		khttp_free(&r);
 		return EXIT_SUCCESS;
 	}
 
+	memset(&t, 0, sizeof(struct cgitime));
+	cgitime_step(&t);
+
 	if (NULL == (r.arg = db_open(DBFILE))) {
 		khttp_free(&r);
 		return EXIT_SUCCESS;
 	}
 
-	if (-1 == pledge("stdio", NULL)) {
+	t.open = cgitime_step(&t);
+
+	/* Waiting clients need us to look at the database files. */
+
+	if (-1 == pledge(wait > 0 ? "stdio rpath" : "stdio", NULL)) {
 		kutil_warn(NULL, NULL, "pledge");
 		db_close(r.arg);
 		khttp_free(&r);
@@ -179,13 +859,53 @@ main(void)
 
 	db_role(r.arg, ROLE_consume);
 
-	rq = db_record_list_lister(r.arg);
+	db_stamp(st);
+	ivsel_list(r.arg, &sel);
+	rr = record_etag(sel.q[INTERVAL_byqmin], 
+		binary, etag, sizeof(etag));
+
+	/*
+	 * If the client already has our records and wants to wait for
+	 * new ones, only re-list them when the database has changed.
+	 */
+
+	while (NULL != rr && etag_match(&r, etag) && wait > 0) {
+		for ( ; wait > 0; wait--) {
+			sleep(1);
+			db_stamp(nst);
+			if ( ! db_stamp_eq(st, nst))
+				break;
+		}
+		if (0 == wait)
+			break;
+		memcpy(st, nst, sizeof(st));
+		cgitime_step(&t);
+		ivsel_free(&sel);
+		ivsel_list(r.arg, &sel);
+		rr = record_etag(sel.q[INTERVAL_byqmin], 
+			binary, etag, sizeof(etag));
+	}
+
+	if (NULL != rr && etag_match(&r, etag)) {
+		http_open(&r, KHTTP_304, NULL, etag);
+		ivsel_free(&sel);
+		db_close(r.arg);
+		khttp_free(&r);
+		return EXIT_SUCCESS;
+	}
+
 	sys = db_system_get_id(r.arg, 1);
+	t.list = cgitime_step(&t);
 
-	sendindex(&r, sys, rq);
+	if (binary)
+		sendbinary(&r, sys, &sel, since, 
+			NULL != rr ? etag : NULL, timing ? &t : NULL);
+	else
+		sendindex(&r, sys, &sel, since, 
+			NULL != rr ? etag : NULL, timing ? &t : NULL);
 
 	db_system_free(sys);
-	db_record_freeq(rq);
+	ivsel_free(&sel);
 
 	db_close(r.arg);
 	khttp_free(&r);
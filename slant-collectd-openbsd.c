@@ -67,6 +67,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "slant-collectd.h"
@@ -90,6 +91,17 @@ struct	ifstat {
 	char		ifs_flag;
 };
 
+/*
+ * A grow-only buffer for sysctl(2) results.
+ * These are kept between samples so that we needn't allocate for (or
+ * even size) each sample.
+ */
+struct	scratch {
+	void		*buf;
+	size_t		 max; /* allocated size */
+	size_t		 sz; /* size of last result */
+};
+
 /* 
  * Define pagetok in terms of pageshift.
  */
@@ -97,6 +109,8 @@ struct	ifstat {
 
 struct	sysinfo {
 	size_t		 sample; /* sample number */
+	struct timespec	 last; /* monotonic time of last sample */
+	double		 elapsed; /* seconds since last sample */
 	int		 pageshift; /* used for memory pages */
 	double		 mem_avg; /* average memory */
 	double		 nproc_pct; /* nprocs percent */
@@ -116,6 +130,12 @@ struct	sysinfo {
 	int64_t	 	 disc_ravg; /* average reads/sec */
 	int64_t	 	 disc_wavg; /* average reads/sec */
 	time_t		 boottime; /* time booted */
+	struct scratch	 procs; /* KERN_PROC results */
+	struct scratch	 ifs; /* NET_RT_IFLIST results */
+	struct scratch	 discs; /* HW_DISKSTATS results */
+	const char	**cmds; /* sorted syscfg commands */
+	char		*cmdseen; /* whether sorted command seen */
+	int64_t		 probes[PROBE__MAX]; /* last sample (usec) */
 };
 
 static int
@@ -189,9 +209,87 @@ sysinfo_free(struct sysinfo *p)
 	free(p->cp_diff);
 	free(p->cpu_states);
 	free(p->ifstats);
+	free(p->procs.buf);
+	free(p->ifs.buf);
+	free(p->discs.buf);
+	free(p->cmds);
+	free(p->cmdseen);
 	free(p);
 }
 
+/*
+ * Fill "s" with the results of the sysctl(2) "mib".
+ * We first try with the buffer we already have: only if it's too small
+ * do we size the results, grow the buffer (with some slop for growth)
+ * and try again.
+ * If "elemsz" is non-zero, the last element of the mib is the number of
+ * elements of this size the buffer can hold (as with KERN_PROC).
+ * Returns zero on failure (with errno set), non-zero on success.
+ */
+static int
+sysctl_scratch(int *mib, u_int miblen, struct scratch *s, size_t elemsz)
+{
+	size_t	 need;
+	void	*pp;
+
+	for (;;) {
+		if (s->max > 0) {
+			if (elemsz)
+				mib[miblen - 1] = s->max / elemsz;
+			need = s->max;
+			if (0 == sysctl(mib, miblen, 
+			    s->buf, &need, NULL, 0)) {
+				s->sz = need;
+				return 1;
+			} else if (ENOMEM != errno)
+				return 0;
+		}
+
+		if (elemsz)
+			mib[miblen - 1] = 0;
+		if (-1 == sysctl(mib, miblen, NULL, &need, NULL, 0))
+			return 0;
+
+		need += need / 4;
+		if (need <= s->max)
+			need = s->max * 2;
+		if (NULL == (pp = realloc(s->buf, need)))
+			return 0;
+		s->buf = pp;
+		s->max = need;
+	}
+}
+
+static int
+cmp_cmd(const void *p1, const void *p2)
+{
+
+	return strcmp(*(const char *const *)p1, 
+		*(const char *const *)p2);
+}
+
+/*
+ * Mark the command "comm" (and any duplicates) as being seen amongst
+ * our sorted commands.
+ */
+static void
+cmds_seen(const struct syscfg *cfg, struct sysinfo *p, const char *comm)
+{
+	const char	**cp;
+	size_t		  i, j;
+
+	cp = bsearch(&comm, p->cmds, cfg->cmdsz, sizeof(char *), cmp_cmd);
+	if (NULL == cp)
+		return;
+
+	i = j = cp - p->cmds;
+	while (i > 0 && 0 == strcmp(p->cmds[i - 1], comm))
+		i--;
+	while (j + 1 < cfg->cmdsz && 0 == strcmp(p->cmds[j + 1], comm))
+		j++;
+	memset(&p->cmdseen[i], 1, j - i + 1);
+}
+
 static int
 sysinfo_init_boottime(struct sysinfo *p)
 {
@@ -331,13 +429,13 @@ sysinfo_update_nfiles(const struct syscfg *cfg, struct sysinfo *p)
 static int
 sysinfo_update_nprocs(const struct syscfg *cfg, struct sysinfo *p)
 {
-	size_t	 i, j, size, len, rprocs = 0;
+	size_t	 i, size, len, rprocs = 0;
 	int	 maxproc, nprocs;
 	int	 cp_nproc_mib[] = { CTL_KERN, KERN_NPROCS },
 		 cp_maxproc_mib[] = { CTL_KERN, KERN_MAXPROC },
 		 cp_procs_mib[] = { CTL_KERN, KERN_PROC, 
 			 0, 0, sizeof(struct kinfo_proc), 0};
-	struct kinfo_proc *pb = NULL;
+	const struct kinfo_proc *pb;
 
 	size = sizeof(int);
 	if (sysctl(cp_maxproc_mib, 2, &maxproc, &size, NULL, 0) < 0) {
@@ -366,42 +464,39 @@ sysinfo_update_nprocs(const struct syscfg *cfg, struct sysinfo *p)
 		p->rproc_pct = 100.0;
 		return 1;
 	}
-retry:
-	free(pb);
-	size = sizeof(int);
-	if (sysctl(cp_procs_mib, 6, NULL, &size, NULL, 0) < 0) {
-		warn("sysctl: CTL_KERN, KERN_PROC");
-		return 0;
-	}
 
-	/* Add extra slop for new interim processes. */
+	/* 
+	 * Build our sorted command set the first time: this way, each
+	 * process is looked up instead of scanned for each command.
+	 */
 
-	size = 5 * size / 4;
-	if (NULL == (pb = malloc(size))) {
-		warn(NULL);
-		return 0;
+	if (NULL == p->cmds) {
+		p->cmds = reallocarray(NULL, cfg->cmdsz, sizeof(char *));
+		p->cmdseen = malloc(cfg->cmdsz);
+		if (NULL == p->cmds || NULL == p->cmdseen) {
+			warn(NULL);
+			return 0;
+		}
+		for (i = 0; i < cfg->cmdsz; i++)
+			p->cmds[i] = cfg->cmds[i];
+		qsort(p->cmds, cfg->cmdsz, sizeof(char *), cmp_cmd);
 	}
 
-	cp_procs_mib[5] = (int)(size / sizeof(struct kinfo_proc));
-	if (sysctl(cp_procs_mib, 6, pb, &size, NULL, 0) < 0) {
-		if (errno == ENOMEM)
-			goto retry;
+	if ( ! sysctl_scratch(cp_procs_mib, 6, 
+	    &p->procs, sizeof(struct kinfo_proc))) {
 		warn("sysctl: CTL_KERN, KERN_PROC");
-		free(pb);
 		return 0;
 	}
 
-	len = size / sizeof(struct kinfo_proc);
-	for (j = 0; j < cfg->cmdsz; j++) {
-		for (i = 0; i < len; i++) {
-			if (0 == strcmp(pb[i].p_comm, cfg->cmds[j]))
-				break;
-		}
-		if (i < len)
+	pb = p->procs.buf;
+	len = p->procs.sz / sizeof(struct kinfo_proc);
+	memset(p->cmdseen, 0, cfg->cmdsz);
+	for (i = 0; i < len; i++)
+		cmds_seen(cfg, p, pb[i].p_comm);
+	for (i = 0; i < cfg->cmdsz; i++)
+		if (p->cmdseen[i])
 			rprocs++;
-	}
 
-	free(pb);
 	p->nproc_pct = 100.0 * len / (double)maxproc;
 	p->rproc_pct = 100.0 * rprocs / (double)cfg->cmdsz;
 	return 1;
@@ -474,7 +569,7 @@ sysinfo_update_cpu(struct sysinfo *p)
 		ifs->ifs_now.x = ifm.y; \
 		ifs->ifs_cur.x = ifs->ifs_now.x - ifs->ifs_old.x; \
 		ifs->ifs_old.x = ifs->ifs_now.x; \
-		ifs->ifs_cur.x /= 15; \
+		ifs->ifs_cur.x /= p->elapsed; \
 		if ((up)) \
 			p->ifsum.x += ifs->ifs_cur.x; \
 	} while(0)
@@ -495,18 +590,14 @@ sysinfo_update_if(struct sysinfo *p)
 	mib[4] = NET_RT_IFLIST;
 	mib[5] = 0;
 
-	if (-1 == sysctl(mib, 6, NULL, &need, NULL, 0)) {
-		warn("sysctl: CTL_NET, PF_ROUTE, NET_RT_IFLIST");
-		return 0;
-	} else if (NULL == (buf = malloc(need))) {
-		warn(NULL);
-		return 0;
-	} else if (-1 == sysctl(mib, 6, buf, &need, NULL, 0)) {
+	if ( ! sysctl_scratch(mib, 6, &p->ifs, 0)) {
 		warn("sysctl: CTL_NET, PF_ROUTE, NET_RT_IFLIST");
-		free(buf);
 		return 0;
 	}
 
+	buf = p->ifs.buf;
+	need = p->ifs.sz;
+
 	memset(&p->ifsum, 0, sizeof(p->ifsum));
 
 	lim = buf + need;
@@ -524,7 +615,6 @@ sysinfo_update_if(struct sysinfo *p)
 				 sizeof(struct ifstat));
 			if (NULL == newstats) {
 				warn(NULL);
-				free(buf);
 				return 0;
 			}
 			p->ifstats = newstats;
@@ -555,7 +645,6 @@ sysinfo_update_if(struct sysinfo *p)
 		ifs->ifs_flag++;
 	}
 
-	free(buf);
 	return 1;
 }
 
@@ -571,18 +660,14 @@ sysinfo_update_disc(const struct syscfg *cfg, struct sysinfo *p)
 	mib[0] = CTL_HW;
 	mib[1] = HW_DISKSTATS;
 
-	if (sysctl(mib, 2, NULL, &need, NULL, 0) < 0) {
-		warn("sysctl: CTL_HW, HW_DISKSTATS");
-		return 0;
-	} else if (NULL == (buf = malloc(need))) {
-		warn(NULL);
-		return 0;
-	} else if (-1 == sysctl(mib, 2, buf, &need, NULL, 0)) {
+	if ( ! sysctl_scratch(mib, 2, &p->discs, 0)) {
 		warn("sysctl: CTL_HW, HW_DISKSTATS");
-		free(buf);
 		return 0;
 	}
 
+	buf = p->discs.buf;
+	need = p->discs.sz;
+
 	lim = buf + need;
 	for (next = buf; next < lim; next += sizeof(q)) {
 		memcpy(&q, next, sizeof(q));
@@ -596,7 +681,7 @@ sysinfo_update_disc(const struct syscfg *cfg, struct sysinfo *p)
 	}
 
 	if (rb > p->disc_rbytes) {
-		p->disc_ravg = (rb - p->disc_rbytes) / 15; 
+		p->disc_ravg = (rb - p->disc_rbytes) / p->elapsed;
 		p->disc_rbytes = rb;
 	} else {
 		p->disc_ravg = 0;
@@ -604,33 +689,79 @@ sysinfo_update_disc(const struct syscfg *cfg, struct sysinfo *p)
 	}
 
 	if (wb > p->disc_wbytes) {
-		p->disc_wavg = (wb - p->disc_wbytes) / 15; 
+		p->disc_wavg = (wb - p->disc_wbytes) / p->elapsed;
 		p->disc_wbytes = wb;
 	} else {
 		p->disc_wavg = 0;
 		p->disc_wbytes = wb;
 	}
 
-	free(buf);
 	return 1;
 }
 
+/*
+ * Record the time since "last" as that of probe "pr", then reset
+ * "last" to now.
+ */
+static void
+probe_time(struct sysinfo *p, enum probe pr, struct timespec *last)
+{
+	struct timespec	 now;
+
+	if (-1 == clock_gettime(CLOCK_MONOTONIC, &now)) {
+		p->probes[pr] = 0;
+		return;
+	}
+
+	p->probes[pr] = (now.tv_sec - last->tv_sec) * 1000000 +
+		(now.tv_nsec - last->tv_nsec) / 1000;
+	*last = now;
+}
+
 int
 sysinfo_update(const struct syscfg *cfg, struct sysinfo *p)
 {
+	struct timespec	 now;
+
+	/*
+	 * Rates are over the measured time since the last sample, not
+	 * the configured interval, as sleeping or sampling may run long.
+	 * The first sample has no predecessor, so use the interval.
+	 */
+
+	if (-1 == clock_gettime(CLOCK_MONOTONIC, &now)) {
+		warn("clock_gettime");
+		return 0;
+	}
+
+	if (p->sample)
+		p->elapsed = (now.tv_sec - p->last.tv_sec) +
+			(now.tv_nsec - p->last.tv_nsec) / 1e9;
+	else
+		p->elapsed = cfg->interval;
+
+	if (p->elapsed < 0.001)
+		p->elapsed = 0.001;
+	p->last = now;
 
 	if ( ! sysinfo_update_nprocs(cfg, p))
 		return 0;
+	probe_time(p, PROBE_NPROCS, &now);
 	if ( ! sysinfo_update_nfiles(cfg, p))
 		return 0;
+	probe_time(p, PROBE_NFILES, &now);
 	if ( ! sysinfo_update_cpu(p))
 		return 0;
+	probe_time(p, PROBE_CPU, &now);
 	if ( ! sysinfo_update_mem(p))
 		return 0;
+	probe_time(p, PROBE_MEM, &now);
 	if ( ! sysinfo_update_if(p))
 		return 0;
+	probe_time(p, PROBE_IF, &now);
 	if ( ! sysinfo_update_disc(cfg, p))
 		return 0;
+	probe_time(p, PROBE_DISC, &now);
 
 	p->sample++;
 	return 1;
@@ -713,3 +844,13 @@ sysinfo_get_boottime(const struct sysinfo *p)
 
 	return p->boottime;
 }
+
+/*
+ * Microseconds taken by probe "pr" of the last sample.
+ */
+int64_t
+sysinfo_get_probetime(const struct sysinfo *p, enum probe pr)
+{
+
+	return p->probes[pr];
+}
@@ -15,9 +15,11 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include <sys/queue.h>
+#include <sys/time.h>
 
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -28,6 +30,7 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include <ksql.h>
 
@@ -44,46 +47,535 @@ sig(int sig)
 	doexit = 1;
 }
 
+/*
+ * Number of intervals (interval enumeration values).
+ */
+#define	INTERVALS (INTERVAL_byyear + 1)
+
+/*
+ * In-memory state of a single interval's records.
+ * This holds the records from newest (the head) to oldest (the tail)
+ * in a circular buffer.
+ * It's loaded from the database when we start, then kept in sync with
+ * what we write, so we never need to read the database again.
+ */
+struct	ring {
+	struct record	*recs; /* records */
+	size_t		 cap; /* allocated records */
+	size_t		 head; /* position of head in recs */
+	size_t		 count; /* number of records */
+};
+
+#define	RING_HEAD(_r) (&(_r)->recs[(_r)->head])
+#define	RING_NTH(_r, _i) (&(_r)->recs[((_r)->head + (_i)) % (_r)->cap])
+
+/*
+ * All of our in-memory database state.
+ * Records roll up from one interval to the next: each interval is only
+ * written when the interval below it closes a record.
+ * The exception is the by-minute interval, whose open record is kept in
+ * memory (it's visible as base records) and written once it closes.
+ */
+struct	rollup {
+	struct ring	 rings[INTERVALS]; /* per-interval records */
+	struct record	 acc; /* open by-minute record */
+	int		 hasacc; /* whether acc is open */
+	time_t		 interval; /* seconds between samples */
+	int64_t		 dbtime; /* last update transaction (usec) */
+};
+
+/*
+ * Per-interval record span and backlog.
+ * The backlog is the number of records after which the oldest will be
+ * recycled as the newest.
+ * Base (by default quarter-minute) records have no span: each sample is
+ * a new record, and the backlog is in seconds, so that the tier covers
+ * the same time whatever the sampling interval.
+ * A record is closed when a record below it starts after its span.
+ */
+static	const struct {
+	time_t		 span;
+	size_t		 allowed;
+} ivals[INTERVALS] = {
+	{ 0, 60 * 10 }, /* 600 seconds (10 minute) byqmin */
+	{ 60, 60 * 5 }, /* 300 (5 hours) bymin */
+	{ 60 * 60, 24 * 5 }, /* 120 (5 days) byhour */
+	{ 60 * 60 * 24, 7 * 4 }, /* 28 (4 weeks) byday */
+	{ 60 * 60 * 24 * 7, 52 * 2 }, /* 104 (two year) byweek */
+	{ 60 * 60 * 24 * 365, SIZE_MAX }, /* endless byyear */
+};
+
+/*
+ * Backlog of interval "ival" in records.
+ */
+static size_t
+ring_allowed(const struct rollup *ru, enum interval ival)
+{
+	size_t	 allowed = ivals[ival].allowed;
+
+	if (INTERVAL_byqmin == ival)
+		allowed /= ru->interval;
+	return allowed > 0 ? allowed : 1;
+}
+
+/*
+ * Make sure we can add another record to the ring.
+ * Returns zero on memory exhaustion, non-zero otherwise.
+ */
+static int
+ring_reserve(struct ring *r)
+{
+	struct record	*recs;
+	size_t		 i, cap;
+
+	if (r->count < r->cap)
+		return 1;
+
+	cap = 0 == r->cap ? 64 : r->cap * 2;
+	recs = reallocarray(NULL, cap, sizeof(struct record));
+	if (NULL == recs) {
+		warn(NULL);
+		return 0;
+	}
+
+	/* Re-order from the newest as the first element. */
+
+	for (i = 0; i < r->count; i++)
+		recs[i] = *RING_NTH(r, i);
+
+	free(r->recs);
+	r->recs = recs;
+	r->cap = cap;
+	r->head = 0;
+	return 1;
+}
+
+/*
+ * Add the samples of record "src" to "dst".
+ */
 static void
-update_interval(struct kwbp *db, time_t span, 
-	size_t have, size_t allowed,
-	const struct record *first, const struct record *last, 
-	enum interval ival, time_t now, const struct record *r)
+record_add(struct record *dst, const struct record *src)
 {
 
-	assert(allowed > 0);
+	dst->entries += src->entries;
+	dst->cpu += src->cpu;
+	dst->mem += src->mem;
+	dst->nettx += src->nettx;
+	dst->netrx += src->netrx;
+	dst->discread += src->discread;
+	dst->discwrite += src->discwrite;
+	dst->nprocs += src->nprocs;
+	dst->rprocs += src->rprocs;
+	dst->nfiles += src->nfiles;
+}
 
-	if (NULL != first && first->ctime + span > now) {
-		/* Update the current entry. */
-		assert(NULL != first);
-		assert(NULL != last);
-		db_record_update_current(db, 
-			first->entries + 1, 
-			first->cpu + r->cpu, 
-			first->mem + r->mem, 
-			first->nettx + r->nettx, 
-			first->netrx + r->netrx, 
-			first->discread + r->discread, 
-			first->discwrite + r->discwrite, 
-			first->nprocs + r->nprocs,
-			first->rprocs + r->rprocs,
-			first->nfiles + r->nfiles,
-			first->id);
-	} else if (have > allowed) {
+/*
+ * Load our in-memory state from the database.
+ * This is only done once, when starting up.
+ * The open by-minute record is re-built from the base records
+ * started after the last by-minute record's span.
+ * Returns zero on memory exhaustion, non-zero otherwise.
+ */
+static int
+ring_load(struct kwbp *db, struct rollup *ru)
+{
+	struct record_q	*rq;
+	const struct record *rr;
+	struct ring	*r;
+	time_t		 since = 0;
+	int		 rc = 0;
+
+	rq = db_record_list_lister(db);
+
+	/* Records are ordered newest first. */
+
+	TAILQ_FOREACH(rr, rq, _entries) {
+		r = &ru->rings[rr->interval];
+		if ( ! ring_reserve(r))
+			goto out;
+		r->recs[(r->head + r->count) % r->cap] = *rr;
+		r->count++;
+	}
+
+	r = &ru->rings[INTERVAL_bymin];
+	if (r->count)
+		since = RING_HEAD(r)->ctime + 
+			ivals[INTERVAL_bymin].span;
+
+	TAILQ_FOREACH(rr, rq, _entries) {
+		if (INTERVAL_byqmin != rr->interval ||
+		    rr->ctime < since)
+			continue;
+		if (ru->hasacc)
+			record_add(&ru->acc, rr);
+		else
+			ru->acc = *rr;
+		ru->acc.ctime = rr->ctime;
+		ru->acc.interval = INTERVAL_bymin;
+		ru->hasacc = 1;
+	}
+
+	rc = 1;
+out:
+	db_record_freeq(rq);
+	return rc;
+}
+
+/*
+ * Delete the oldest records of intervals with more than their backlog,
+ * as when we were last run with a shorter sampling interval, so that
+ * they hold no more than they'd have been recycled at.
+ */
+static void
+ring_trim(struct kwbp *db, struct rollup *ru)
+{
+	struct ring	*r;
+	size_t		 i, allowed;
+	int		 trans = 0;
+
+	for (i = 0; i < INTERVALS; i++) {
+		r = &ru->rings[i];
+		allowed = ring_allowed(ru, i);
+		while (r->count > allowed) {
+			if ( ! trans) {
+				db_trans_open(db, 2, 0);
+				trans = 1;
+			}
+			db_record_delete_surplus(db, 
+				RING_NTH(r, r->count - 1)->id);
+			r->count--;
+		}
+	}
+
+	if (trans)
+		db_trans_commit(db, 2);
+}
+
+static void
+ring_free(struct rollup *ru)
+{
+	size_t	 i;
+
+	for (i = 0; i < INTERVALS; i++)
+		free(ru->rings[i].recs);
+}
+
+/*
+ * Write "r" as the newest record of interval "ival", either recycling
+ * the oldest record (if the backlog is full) or inserting a new one.
+ * Returns zero on memory exhaustion, non-zero on success.
+ */
+static int
+ring_push(struct kwbp *db, struct rollup *ru,
+	enum interval ival, const struct record *r)
+{
+	struct ring	*ring = &ru->rings[ival];
+	int64_t		 id;
+
+	if (ring->count > ring_allowed(ru, ival)) {
 		/* New entry: shift end of circular queue. */
-		assert(NULL != first);
-		assert(NULL != last);
-		db_record_update_tail(db, now, 1, 
+		id = RING_NTH(ring, ring->count - 1)->id;
+		db_record_update_tail(db, r->ctime, r->entries,
 			r->cpu, r->mem, r->nettx, r->netrx,
 			r->discread, r->discwrite, r->nprocs,
-			r->rprocs, r->nfiles, last->id);
+			r->rprocs, r->nfiles, id);
+		ring->count--;
 	} else {
 		/* New entry. */
-		db_record_insert(db, now, 1, 
+		id = db_record_insert(db, r->ctime, r->entries,
 			r->cpu, r->mem, r->nettx, r->netrx,
 			r->discread, r->discwrite, r->nprocs, 
 			r->rprocs, r->nfiles, ival);
+		if (id < 0) {
+			warnx("db_record_insert");
+			return 1;
+		}
 	}
+
+	if ( ! ring_reserve(ring))
+		return 0;
+
+	ring->head = (ring->head + ring->cap - 1) % ring->cap;
+	ring->count++;
+
+	*RING_HEAD(ring) = *r;
+	RING_HEAD(ring)->interval = ival;
+	RING_HEAD(ring)->id = id;
+	return 1;
+}
+
+/*
+ * Roll the just-closed record "c" of the interval below into interval
+ * "ival".
+ * If "c" started within the span of the current record, it's added to
+ * it; otherwise, the current record closes (rolling up in turn) and "c"
+ * starts a new one.
+ * Returns zero on memory exhaustion, non-zero on success.
+ */
+static int
+rollup(struct kwbp *db, struct rollup *ru, 
+	enum interval ival, const struct record *c)
+{
+	struct ring	*ring = &ru->rings[ival];
+	struct record	*cur;
+
+	cur = ring->count ? RING_HEAD(ring) : NULL;
+
+	if (NULL != cur && cur->ctime + ivals[ival].span > c->ctime) {
+		/* Update the current entry. */
+		record_add(cur, c);
+		db_record_update_current(db, 
+			cur->entries, cur->cpu, cur->mem, 
+			cur->nettx, cur->netrx, 
+			cur->discread, cur->discwrite, 
+			cur->nprocs, cur->rprocs, cur->nfiles,
+			cur->id);
+		return 1;
+	}
+
+	if (NULL != cur && ival < INTERVAL_byyear &&
+	    ! rollup(db, ru, ival + 1, cur))
+		return 0;
+
+	return ring_push(db, ru, ival, c);
+}
+
+/*
+ * Output location of our snapshot, if any.
+ */
+struct	snap {
+	int		 dirfd; /* directory (opened before chroot) */
+	const char	*name; /* file within directory */
+	int		 gz; /* also write name.gz */
+};
+
+/*
+ * Format the snapshot of the records in "ru" as the same JSON document
+ * produced by slant-cgi(8): all of them, or only the newest "max" of
+ * each interval if non-zero.
+ * The accumulated values are printed with enough digits to be read
+ * back exactly, so clients see the same values either way.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+snap_json(FILE *f, const struct rollup *ru, 
+	const struct sysinfo *p, size_t max)
+{
+	size_t		 i, j;
+	const struct ring *ring;
+	const struct record *r;
+	static const char *const names[INTERVALS] = {
+		"qmin", "min", "hour", "day", "week", "year" };
+
+	fprintf(f, "{\"version\":\"" VERSION "\","
+		"\"system\":{\"boot\":%lld,\"id\":1,"
+		"\"nprocstime\":%" PRId64 ","
+		"\"nfilestime\":%" PRId64 ","
+		"\"cputime\":%" PRId64 ","
+		"\"memtime\":%" PRId64 ","
+		"\"nettime\":%" PRId64 ","
+		"\"disctime\":%" PRId64 ","
+		"\"dbtime\":%" PRId64 "}", 
+		(long long)sysinfo_get_boottime(p),
+		sysinfo_get_probetime(p, PROBE_NPROCS),
+		sysinfo_get_probetime(p, PROBE_NFILES),
+		sysinfo_get_probetime(p, PROBE_CPU),
+		sysinfo_get_probetime(p, PROBE_MEM),
+		sysinfo_get_probetime(p, PROBE_IF),
+		sysinfo_get_probetime(p, PROBE_DISC),
+		ru->dbtime);
+
+	for (i = 0; i < INTERVALS; i++) {
+		ring = &ru->rings[i];
+		fprintf(f, ",\"%s\":[", names[i]);
+		for (j = 0; j < ring->count; j++) {
+			if (max && j == max)
+				break;
+			r = RING_NTH(ring, j);
+			fprintf(f, "%s{\"ctime\":%lld,"
+				"\"entries\":%" PRId64 ","
+				"\"cpu\":%.17g,\"mem\":%.17g,"
+				"\"nettx\":%" PRId64 ","
+				"\"netrx\":%" PRId64 ","
+				"\"discread\":%" PRId64 ","
+				"\"discwrite\":%" PRId64 ","
+				"\"nprocs\":%.17g,\"rprocs\":%.17g,"
+				"\"nfiles\":%.17g,\"interval\":%zu,"
+				"\"id\":%" PRId64 "}",
+				0 == j ? "" : ",",
+				(long long)r->ctime, r->entries, 
+				r->cpu, r->mem, r->nettx, r->netrx,
+				r->discread, r->discwrite, r->nprocs,
+				r->rprocs, r->nfiles, i, r->id);
+		}
+		fputc(']', f);
+	}
+
+	fputc('}', f);
+	return ! ferror(f);
+}
+
+/*
+ * Atomically replace "name" in "dirfd" with the validator line "etag"
+ * followed by "buf" of length "sz".
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+snap_file(int dirfd, const char *name, 
+	const char *etag, const char *buf, size_t sz)
+{
+	char	 tmp[PATH_MAX];
+	int	 fd, c;
+	FILE	*f;
+
+	c = snprintf(tmp, sizeof(tmp), ".%s.tmp", name);
+	if (c < 0 || (size_t)c >= sizeof(tmp)) {
+		warnx("%s: name too long", name);
+		return 0;
+	}
+
+	fd = openat(dirfd, tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (-1 == fd) {
+		warn("%s", tmp);
+		return 0;
+	} else if (NULL == (f = fdopen(fd, "w"))) {
+		warn("%s", tmp);
+		close(fd);
+		unlinkat(dirfd, tmp, 0);
+		return 0;
+	}
+
+	fprintf(f, "%s\n", etag);
+	fwrite(buf, 1, sz, f);
+
+	if (ferror(f) | fclose(f)) {
+		warn("%s", tmp);
+		unlinkat(dirfd, tmp, 0);
+		return 0;
+	} else if (-1 == renameat(dirfd, tmp, dirfd, name)) {
+		warn("%s", name);
+		unlinkat(dirfd, tmp, 0);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Compress "buf" of length "sz" with gzip into "res".
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+snap_gzip(const char *buf, size_t sz, char **res, size_t *ressz)
+{
+	z_stream	 z;
+	uLong		 max;
+
+	memset(&z, 0, sizeof(z_stream));
+	if (Z_OK != deflateInit2(&z, Z_BEST_COMPRESSION,
+	    Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY)) {
+		warnx("deflateInit2");
+		return 0;
+	}
+
+	max = deflateBound(&z, sz);
+	if (NULL == (*res = malloc(max))) {
+		warn(NULL);
+		deflateEnd(&z);
+		return 0;
+	}
+
+	z.next_in = (Bytef *)buf;
+	z.avail_in = sz;
+	z.next_out = (Bytef *)*res;
+	z.avail_out = max;
+
+	if (Z_STREAM_END != deflate(&z, Z_FINISH)) {
+		warnx("deflate");
+		deflateEnd(&z);
+		free(*res);
+		return 0;
+	}
+
+	*ressz = max - z.avail_out;
+	deflateEnd(&z);
+	return 1;
+}
+
+/*
+ * Write the snapshot "name" of the records in "ru" (the newest "max" of
+ * each interval, or all if zero), and its compressed version if asked,
+ * with validator "etag".
+ * Returns zero on failure (the snapshot is left as-is), non-zero on
+ * success.
+ */
+static int
+snap_write(const struct snap *sn, const char *name, 
+	const struct rollup *ru, const struct sysinfo *p, 
+	size_t max, const char *etag)
+{
+	char		*buf = NULL, *zbuf = NULL, gzname[PATH_MAX];
+	size_t		 sz, zsz;
+	FILE		*f;
+	int		 rc = 0;
+
+	if (NULL == (f = open_memstream(&buf, &sz))) {
+		warn(NULL);
+		return 0;
+	} else if ( ! snap_json(f, ru, p, max)) {
+		warn(NULL);
+		fclose(f);
+		goto out;
+	} else if (fclose(f)) {
+		warn(NULL);
+		goto out;
+	}
+
+	/* 
+	 * slant-cgi(8) only serves the compressed snapshot if its
+	 * validator matches the uncompressed one.
+	 */
+
+	if (sn->gz) {
+		snprintf(gzname, sizeof(gzname), "%s.gz", name);
+		if ( ! snap_gzip(buf, sz, &zbuf, &zsz) ||
+		    ! snap_file(sn->dirfd, gzname, etag, zbuf, zsz))
+			goto out;
+	}
+
+	rc = snap_file(sn->dirfd, name, etag, buf, sz);
+out:
+	free(buf);
+	free(zbuf);
+	return rc;
+}
+
+/*
+ * Write ready-to-serve snapshots of our records for slant-cgi(8): one
+ * of all records, and a "head" one of the newest record of each
+ * interval, which is what most clients ask for.
+ * The validator is derived from the newest quarter-minute record, which
+ * changes with every sample.
+ * Returns zero on failure (a snapshot may be left as-is), non-zero on
+ * success.
+ */
+static int
+snap(const struct snap *sn, const struct rollup *ru, 
+	const struct sysinfo *p)
+{
+	char		 etag[64], headname[PATH_MAX];
+	const struct record *r;
+
+	if (0 == ru->rings[INTERVAL_byqmin].count)
+		return 1;
+
+	r = RING_HEAD(&ru->rings[INTERVAL_byqmin]);
+	snprintf(etag, sizeof(etag), "%" PRId64 "-%lld", 
+		r->id, (long long)r->ctime);
+	snprintf(headname, sizeof(headname), "%s.head", sn->name);
+
+	return snap_write(sn, sn->name, ru, p, 0, etag) &&
+		snap_write(sn, headname, ru, p, 1, etag);
 }
 
 static void
@@ -128,32 +620,33 @@ init(struct kwbp *db, const struct sysinfo *p)
 		db_system_free(s);
 	} else
 		db_system_insert
-			(db, sysinfo_get_boottime(p), 1);
+			(db, sysinfo_get_boottime(p), 1, 
+			 0, 0, 0, 0, 0, 0, 0);
 
 	db_trans_commit(db, 1);
 }
 
 /*
- * Update the database "db" given the current record "p" and all
- * existing database records "rq".
+ * Update the database "db" given the current record "p" and our
+ * in-memory state of the database records "ru".
+ * Every sample is a new base record and is added to the open
+ * by-minute record.
+ * When that closes, it's written and rolled up into the higher
+ * intervals.
+ * How long we took to sample and write is kept alongside the system.
+ * Returns zero on memory exhaustion, non-zero on success.
  */
-static void
-update(struct kwbp *db, const struct sysinfo *p, 
-	const struct record_q *rq)
+static int
+update(struct kwbp *db, const struct sysinfo *p, struct rollup *ru)
 {
-	size_t	 	 bymin = 0, byhour = 0, byqmin = 0,
-			 byday = 0, byweek = 0, byyear = 0;
 	time_t		 t = time(NULL);
 	struct record	 rr;
-	const struct record *r, 
-	      		*first_bymin = NULL, *last_bymin = NULL,
-			*first_byqmin = NULL, *last_byqmin = NULL,
-			*first_byhour = NULL, *last_byhour = NULL,
-			*first_byday = NULL, *last_byday = NULL,
-			*first_byweek = NULL, *last_byweek = NULL,
-			*first_byyear = NULL, *last_byyear = NULL;
+	struct timespec	 start, end;
+	int		 rc;
 
 	memset(&rr, 0, sizeof(struct record));
+	rr.ctime = t;
+	rr.entries = 1;
 	rr.cpu = sysinfo_get_cpu_avg(p);
 	rr.mem = sysinfo_get_mem_avg(p);
 	rr.nettx = sysinfo_get_nettx_avg(p);
@@ -164,102 +657,89 @@ update(struct kwbp *db, const struct sysinfo *p,
 	rr.rprocs = sysinfo_get_rprocs(p);
 	rr.nfiles = sysinfo_get_nfiles(p);
 
-	/* 
-	 * First count what we have.
-	 * We need this when determining how many "spare" entries to
-	 * keep in any given interval, e.g., we keep 5 minutes of
-	 * quarter-minute interval data, but only really need the last
-	 * single minute for accumulation.
-	 */
-
-	TAILQ_FOREACH(r, rq, _entries)
-		switch (r->interval) {
-		case INTERVAL_byqmin:
-			if (NULL == first_byqmin)
-				first_byqmin = r;
-			last_byqmin = r;
-			byqmin++;
-			break;
-		case INTERVAL_bymin:
-			if (NULL == first_bymin)
-				first_bymin = r;
-			last_bymin = r;
-			bymin++;
-			break;
-		case INTERVAL_byhour:
-			if (NULL == first_byhour)
-				first_byhour = r;
-			last_byhour = r;
-			byhour++;
-			break;
-		case INTERVAL_byday:
-			if (NULL == first_byday)
-				first_byday = r;
-			last_byday = r;
-			byday++;
-			break;
-		case INTERVAL_byweek:
-			if (NULL == first_byweek)
-				first_byweek = r;
-			last_byweek = r;
-			byweek++;
-			break;
-		case INTERVAL_byyear:
-			if (NULL == first_byyear)
-				first_byyear = r;
-			last_byyear = r;
-			byyear++;
-			break;
-		}
+	if (-1 == clock_gettime(CLOCK_MONOTONIC, &start))
+		memset(&start, 0, sizeof(struct timespec));
 
 	db_trans_open(db, 0, 0);
 
-	/* 40 (10 minute) backlog of quarter-minute entries. */
-
-	if (byqmin > (4 * 10)) {
-		assert(NULL != last_byqmin);
-		assert(NULL != first_byqmin);
-		db_record_update_tail(db, t, 1, 
-			rr.cpu, rr.mem, rr.nettx, rr.netrx,
-			rr.discread, rr.discwrite, rr.nprocs,
-			rr.rprocs, rr.nfiles, last_byqmin->id);
-	} else
-		db_record_insert(db, t, 1,
-			rr.cpu, rr.mem, rr.nettx, rr.netrx,
-			rr.discread, rr.discwrite, rr.nprocs,
-			rr.rprocs, rr.nfiles, INTERVAL_byqmin);
-
-	/* 300 (5 hours) backlog of by-minute entries. */
-
-	update_interval(db, 60, bymin, 
-		60 * 5, first_bymin, last_bymin, 
-		INTERVAL_bymin, t, &rr);
-
-	/* 96 (5 days) backlog of by-hour entries. */
+	/* 
+	 * Our own timings go in with the records.
+	 * We can only know the time of the last transaction.
+	 */
 
-	update_interval(db, 60 * 60, byhour, 
-		24 * 5, first_byhour, last_byhour, 
-		INTERVAL_byhour, t, &rr);
+	db_system_update_timing(db,
+		sysinfo_get_probetime(p, PROBE_NPROCS),
+		sysinfo_get_probetime(p, PROBE_NFILES),
+		sysinfo_get_probetime(p, PROBE_CPU),
+		sysinfo_get_probetime(p, PROBE_MEM),
+		sysinfo_get_probetime(p, PROBE_IF),
+		sysinfo_get_probetime(p, PROBE_DISC),
+		ru->dbtime, 1);
+
+	rc = ring_push(db, ru, INTERVAL_byqmin, &rr);
+
+	if (rc && ru->hasacc && 
+	    ru->acc.ctime + ivals[INTERVAL_bymin].span > t) {
+		record_add(&ru->acc, &rr);
+	} else if (rc) {
+		if (ru->hasacc)
+			rc = ring_push(db, ru, 
+				INTERVAL_bymin, &ru->acc) &&
+			     rollup(db, ru, INTERVAL_byhour, 
+				RING_HEAD(&ru->rings[INTERVAL_bymin]));
+		ru->acc = rr;
+		ru->acc.interval = INTERVAL_bymin;
+		ru->hasacc = 1;
+	}
 
-	/* 28 (4 weeks) backlog of by-day entries. */
+	db_trans_commit(db, 0);
 
-	update_interval(db, 60 * 60 * 24, byday, 
-		7 * 4, first_byday, last_byday, 
-		INTERVAL_byday, t, &rr);
+	if (-1 == clock_gettime(CLOCK_MONOTONIC, &end))
+		ru->dbtime = 0;
+	else
+		ru->dbtime = (end.tv_sec - start.tv_sec) * 1000000 +
+			(end.tv_nsec - start.tv_nsec) / 1000;
+	return rc;
+}
 
-	/* 104 (two year) backlog of by-week entries. */
+/*
+ * Sleep until the absolute monotonic deadline "next", which is advanced
+ * past any samples we've missed (e.g., a slow database) so that we
+ * don't try to catch up with a burst of samples.
+ * Returns early (and non-zero) if we've been signalled to exit.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+sample_wait(struct timespec *next, time_t interval)
+{
+	struct timespec	 now, ts;
 
-	update_interval(db, 60 * 60 * 24 * 7, byweek, 
-		52 * 2, first_byday, last_byweek, 
-		INTERVAL_byweek, t, &rr);
+	if (-1 == clock_gettime(CLOCK_MONOTONIC, &now)) {
+		warn("clock_gettime");
+		return 0;
+	}
 
-	/* Endless backlog of yearly entries. */
+	if (timespeccmp(&now, next, >=))
+		next->tv_sec += interval * 
+			((now.tv_sec - next->tv_sec) / interval + 1);
 
-	update_interval(db, 60 * 60 * 24 * 365, byyear, 
-		SIZE_MAX, first_byyear, last_byyear, 
-		INTERVAL_byyear, t, &rr);
+	while ( ! doexit) {
+		timespecsub(next, &now, &ts);
+		if (0 == nanosleep(&ts, NULL))
+			break;
+		if (EINTR != errno) {
+			warn("nanosleep");
+			return 0;
+		}
+		if (-1 == clock_gettime(CLOCK_MONOTONIC, &now)) {
+			warn("clock_gettime");
+			return 0;
+		}
+		if (timespeccmp(&now, next, >=))
+			break;
+	}
 
-	db_trans_commit(db, 0);
+	return 1;
 }
 
 static void
@@ -280,12 +760,17 @@ int
 main(int argc, char *argv[])
 {
 	struct kwbp	*db = NULL;
-	struct record_q	*rq;
-	struct sysinfo	*info;
+	struct rollup	 ru;
+	struct sysinfo	*info = NULL;
 	int		 c, rc = 0, noop = 0, verb = 0;
 	const char	*dbfile = "/var/www/data/slant.db";
-	char		*d, *discs = NULL, *procs = NULL;
+	char		*d, *discs = NULL, *procs = NULL, 
+			*snapfile = NULL, *cp;
+	const char	*sdir;
 	struct syscfg	 cfg;
+	struct snap	 sn;
+	struct timespec	 next;
+	const char	*er;
 
 	/*
 	 * FIXME: relax this restriction.
@@ -300,8 +785,12 @@ main(int argc, char *argv[])
 		errx(EXIT_FAILURE, "must be run as root");
 
 	memset(&cfg, 0, sizeof(struct syscfg));
+	memset(&ru, 0, sizeof(struct rollup));
+	memset(&sn, 0, sizeof(struct snap));
+	sn.dirfd = -1;
+	cfg.interval = 15;
 
-	while (-1 != (c = getopt(argc, argv, "d:nvf:p:")))
+	while (-1 != (c = getopt(argc, argv, "d:i:nvf:p:s:z")))
 		switch (c) {
 		case 'd':
 			discs = optarg;
@@ -309,15 +798,26 @@ main(int argc, char *argv[])
 		case 'f':
 			dbfile = optarg;
 			break;
+		case 'i':
+			cfg.interval = strtonum(optarg, 1, 60, &er);
+			if (NULL != er)
+				errx(EXIT_FAILURE, "-i: %s", er);
+			break;
 		case 'n':
 			noop = 1;
 			break;
 		case 'p':
 			procs = optarg;
 			break;
+		case 's':
+			snapfile = optarg;
+			break;
 		case 'v':
 			verb = 1;
 			break;
+		case 'z':
+			sn.gz = 1;
+			break;
 		default:
 			goto usage;
 		}
@@ -335,6 +835,27 @@ main(int argc, char *argv[])
 	if ( ! noop && NULL == (db = db_open(dbfile)))
 		errx(EXIT_FAILURE, "%s", dbfile);
 
+	/* 
+	 * Open the snapshot's directory before we chroot.
+	 * We'll write and rename files relative to it.
+	 */
+
+	if ( ! noop && NULL != snapfile) {
+		if (NULL != (cp = strrchr(snapfile, '/'))) {
+			*cp = '\0';
+			sn.name = cp + 1;
+			sdir = '\0' == snapfile[0] ? "/" : snapfile;
+		} else {
+			sn.name = snapfile;
+			sdir = ".";
+		}
+		if ('\0' == sn.name[0])
+			errx(EXIT_FAILURE, "-s: missing file name");
+		sn.dirfd = open(sdir, O_RDONLY | O_DIRECTORY);
+		if (-1 == sn.dirfd)
+			err(EXIT_FAILURE, "%s", sdir);
+	}
+
 	/* FIXME: once we have unveil, this is moot. */
 
 	if (-1 == chroot(_PATH_VAREMPTY))
@@ -392,44 +913,63 @@ main(int argc, char *argv[])
 		goto out;
 	}
 
-	if (NULL != db)
+	ru.interval = cfg.interval;
+
+	if (NULL != db) {
 		init(db, info);
+		if ( ! ring_load(db, &ru))
+			goto out;
+		ring_trim(db, &ru);
+	}
 	if (verb)
 		printinit(info);
 
 	/*
 	 * Now enter our main loop.
-	 * The body will run every 15 seconds.
+	 * The body will run every interval (15 seconds by default) on
+	 * absolute monotonic deadlines, so time spent sampling and
+	 * writing doesn't accumulate as drift.
 	 * Start each iteration by grabbing the current system state
 	 * using sysctl(3).
-	 * Then grab what we have in the database.
-	 * Lastly, modify the database state given our current.
+	 * Then modify the database state given our current, keeping
+	 * our in-memory view of the database in sync.
 	 */
 
+	if (-1 == clock_gettime(CLOCK_MONOTONIC, &next)) {
+		warn("clock_gettime");
+		goto out;
+	}
+
 	while ( ! doexit) {
 		if ( ! sysinfo_update(&cfg, info))
 			goto out;
-		if (NULL != db) {
-			rq = db_record_list_lister(db);
-			update(db, info, rq);
-			db_record_freeq(rq);
-		} 
+		if (NULL != db && ! update(db, info, &ru))
+			goto out;
+		if (-1 != sn.dirfd)
+			snap(&sn, &ru, info);
 		if (verb)
 			print(info);
-		if (sleep(15))
-			break;
+		next.tv_sec += cfg.interval;
+		if ( ! sample_wait(&next, cfg.interval))
+			goto out;
 	}
 
 	rc = 1;
 out:
 	cfg_free(&cfg);
+	ring_free(&ru);
 	sysinfo_free(info);
+	if (-1 != sn.dirfd)
+		close(sn.dirfd);
 	db_close(db);
 	return rc ? EXIT_SUCCESS : EXIT_FAILURE;
 usage:
 	fprintf(stderr, "usage: %s "
-		"[-nv] "
+		"[-nvz] "
 		"[-d discs] "
-		"[-f dbfile]\n", getprogname());
+		"[-f dbfile] "
+		"[-i interval] "
+		"[-p procs] "
+		"[-s snapfile]\n", getprogname());
 	return EXIT_FAILURE;
 }
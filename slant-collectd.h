@@ -25,6 +25,20 @@ struct	syscfg {
 	size_t	  discsz;
 	char	**cmds; /* commands (e.g., httpd) */
 	size_t	  cmdsz;
+	time_t	  interval; /* seconds between samples */
+};
+
+/*
+ * Parts of a sample, each of which is timed.
+ */
+enum	probe {
+	PROBE_NPROCS = 0, /* processes and commands */
+	PROBE_NFILES, /* open files */
+	PROBE_CPU, /* CPU time */
+	PROBE_MEM, /* memory */
+	PROBE_IF, /* network interfaces */
+	PROBE_DISC, /* discs */
+	PROBE__MAX
 };
 
 __BEGIN_DECLS
@@ -43,6 +57,7 @@ double		 sysinfo_get_nfiles(const struct sysinfo *);
 double		 sysinfo_get_nprocs(const struct sysinfo *);
 double		 sysinfo_get_rprocs(const struct sysinfo *);
 time_t		 sysinfo_get_boottime(const struct sysinfo *);
+int64_t		 sysinfo_get_probetime(const struct sysinfo *, enum probe);
 
 __END_DECLS
 
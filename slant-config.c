@@ -28,6 +28,7 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "extern.h"
@@ -158,6 +159,94 @@ parse_waittime(struct parse *p, struct config *cfg)
 	return 1;
 }
 
+/*
+ * "maxconns" num ";"
+ */
+static int
+parse_maxconns(struct parse *p, struct config *cfg)
+{
+	const char	*er;
+
+	assert(p->pos < p->toksz);
+	cfg->maxconns = strtonum
+		(p->toks[p->pos], 0, INT_MAX, &er);
+	if (NULL != er) {
+		warnx("%s: bad maxconns: %s", p->fn, er);
+		return 0;
+	} else if ( ! tok_adv(p)) {
+		return 0;
+	} else if ( ! tok_expect_adv(p, ";"))
+		return 0;
+
+	return 1;
+}
+
+/*
+ * "hidewait" num ";"
+ */
+static int
+parse_hidewait(struct parse *p, struct config *cfg)
+{
+	const char	*er;
+
+	assert(p->pos < p->toksz);
+	cfg->hidewait = strtonum
+		(p->toks[p->pos], 15, INT_MAX, &er);
+	if (NULL != er) {
+		warnx("%s: bad hidewait: %s", p->fn, er);
+		return 0;
+	} else if ( ! tok_adv(p)) {
+		return 0;
+	} else if ( ! tok_expect_adv(p, ";"))
+		return 0;
+
+	return 1;
+}
+
+/*
+ * "longpoll" num ";"
+ */
+static int
+parse_longpoll(struct parse *p, struct config *cfg)
+{
+	const char	*er;
+
+	assert(p->pos < p->toksz);
+	cfg->longpoll = strtonum
+		(p->toks[p->pos], 1, 60, &er);
+	if (NULL != er) {
+		warnx("%s: bad longpoll: %s", p->fn, er);
+		return 0;
+	} else if ( ! tok_adv(p)) {
+		return 0;
+	} else if ( ! tok_expect_adv(p, ";"))
+		return 0;
+
+	return 1;
+}
+
+/*
+ * "jitter" num ";"
+ */
+static int
+parse_jitter(struct parse *p, struct config *cfg)
+{
+	const char	*er;
+
+	assert(p->pos < p->toksz);
+	cfg->jitter = strtonum
+		(p->toks[p->pos], 0, 100, &er);
+	if (NULL != er) {
+		warnx("%s: bad jitter: %s", p->fn, er);
+		return 0;
+	} else if ( ! tok_adv(p)) {
+		return 0;
+	} else if ( ! tok_expect_adv(p, ";"))
+		return 0;
+
+	return 1;
+}
+
 /*
  * ["waittime" num] "}"
  */
@@ -328,14 +417,23 @@ parse_layout_host(struct parse *p, struct config *cfg)
 					return tok_unknown(p);
 		} else if (tok_eq_adv(p, "host")) {
 			b->cat = DRAWCAT_HOST;
-			b->args = HOST_ACCESS;
 			while (p->pos < p->toksz)
-				if (tok_eq(p, ";"))
+				if (tok_eq_adv(p, "access"))
+					b->args |= HOST_ACCESS;
+				else if (tok_eq_adv(p, "collect"))
+					b->args |= HOST_COLLECT;
+				else if (tok_eq_adv(p, "db"))
+					b->args |= HOST_DB;
+				else if (tok_eq_adv(p, "cgi"))
+					b->args |= HOST_CGI;
+				else if (tok_eq(p, ";"))
 					break;
 				else if (tok_eq(p, "}"))
 					break;
 				else
 					return tok_unknown(p);
+			if (0 == b->args)
+				b->args = HOST_ACCESS;
 		} else if (tok_eq_adv(p, "nprocs")) {
 			b->cat = DRAWCAT_PROCS;
 			while (p->pos < p->toksz)
@@ -405,6 +503,32 @@ parse_layout_host(struct parse *p, struct config *cfg)
 					break;
 				else
 					return tok_unknown(p);
+		} else if (tok_eq_adv(p, "latency")) {
+			b->cat = DRAWCAT_LATENCY;
+			while (p->pos < p->toksz)
+				if (tok_eq_adv(p, "dns"))
+					b->args |= LATENCY_DNS;
+				else if (tok_eq_adv(p, "connect"))
+					b->args |= LATENCY_CONNECT;
+				else if (tok_eq_adv(p, "tls"))
+					b->args |= LATENCY_TLS;
+				else if (tok_eq_adv(p, "ttfb"))
+					b->args |= LATENCY_TTFB;
+				else if (tok_eq_adv(p, "body"))
+					b->args |= LATENCY_BODY;
+				else if (tok_eq_adv(p, "p90"))
+					b->args |= LATENCY_P90;
+				else if (tok_eq(p, ";"))
+					break;
+				else if (tok_eq(p, "}"))
+					break;
+				else
+					return tok_unknown(p);
+			/* Percentiles alone are of all phases. */
+			if (LATENCY_P90 == b->args)
+				b->args |= LATENCY_DNS | LATENCY_CONNECT |
+					LATENCY_TLS | LATENCY_TTFB |
+					LATENCY_BODY;
 		} else
 			return tok_unknown(p);
 
@@ -422,6 +546,35 @@ parse_layout_host(struct parse *p, struct config *cfg)
 	return 1;
 }
 
+/*
+ * "threshold" ("cpu"|"mem") num
+ */
+static int
+parse_layout_threshold(struct parse *p, struct config *cfg)
+{
+	const char	*er;
+	enum sumfield	 f;
+
+	if ( ! tok_nadv(p))
+		return 0;
+	if (tok_eq_adv(p, "cpu"))
+		f = SUMF_CPU;
+	else if (tok_eq_adv(p, "mem"))
+		f = SUMF_MEM;
+	else
+		return tok_unknown(p);
+
+	if ( ! tok_nadv(p))
+		return 0;
+	cfg->draw->thresh[f] = strtonum
+		(p->toks[p->pos], 1, 100, &er);
+	if (NULL != er) {
+		warnx("%s: bad layout threshold: %s", p->fn, er);
+		return 0;
+	}
+	return tok_adv(p);
+}
+
 /*
  * Parse a layout statement.
  * Return zero on success, non-zero otherwise.
@@ -449,6 +602,11 @@ parse_layout(struct parse *p, struct config *cfg)
 	while (p->pos < p->toksz) {
 		if (tok_eq_adv(p, "header")) {
 			cfg->draw->header = 1;
+		} else if (tok_eq_adv(p, "summary")) {
+			cfg->draw->summary = 1;
+		} else if (tok_eq_adv(p, "threshold")) {
+			if ( ! parse_layout_threshold(p, cfg))
+				return 0;
 		} else if (tok_eq_adv(p, "errlog")) {
 			cfg->draw->errlog = strtonum
 				(p->toks[p->pos], 0, INT_MAX, &er);
@@ -646,6 +804,22 @@ config_parse(const char *fn, struct config *cfg,
 		} else if (tok_eq_adv(&p, "waittime")) {
 			if ( ! parse_waittime(&p, cfg))
 				break;
+		} else if (tok_eq_adv(&p, "maxconns")) {
+			if ( ! parse_maxconns(&p, cfg))
+				break;
+		} else if (tok_eq_adv(&p, "jitter")) {
+			if ( ! parse_jitter(&p, cfg))
+				break;
+		} else if (tok_eq_adv(&p, "hidewait")) {
+			if ( ! parse_hidewait(&p, cfg))
+				break;
+		} else if (tok_eq_adv(&p, "longpoll")) {
+			if ( ! parse_longpoll(&p, cfg))
+				break;
+		} else if (tok_eq_adv(&p, "latencylog")) {
+			cfg->latencylog = 1;
+			if ( ! tok_expect_adv(&p, ";"))
+				break;
 		} else {
 			tok_unknown(&p);
 			break;
@@ -15,15 +15,18 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include <sys/queue.h>
+#include <sys/poll.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
+#include <asr.h>
 #include <err.h>
 #include <netdb.h>
 #include <ncurses.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "extern.h"
@@ -91,30 +94,12 @@ dns_parse_url(struct out *out, struct node *n)
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
-int
-dns_resolve(struct out *out, const char *host, struct dns *vec)
+static void
+dns_addrs(struct out *out, const char *host, 
+	struct dns *vec, struct addrinfo *res0)
 {
-	struct addrinfo	 hints, *res0, *res;
+	struct addrinfo	*res;
 	struct sockaddr	*sa;
-	int		 error;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = PF_UNSPEC;
-	hints.ai_socktype = SOCK_DGRAM; /* DUMMY */
-
-	error = getaddrinfo(host, NULL, &hints, &res0);
-
-	xdbg(out, "DNS resolving: %s", host);
-
-	if (error == EAI_AGAIN || error == EAI_NONAME) {
-		xwarnx(out, "DNS resolve error: %s: %s", 
-			host, gai_strerror(error));
-		return 0;
-	} else if (error) {
-		xwarnx(out, "DNS parse error: %s: %s",
-			host, gai_strerror(error));
-		return 0;
-	}
 
 	for (vec->addrsz = 0, res = res0;
 	     NULL != res && vec->addrsz < MAX_SERVERS_DNS;
@@ -143,6 +128,97 @@ dns_resolve(struct out *out, const char *host, struct dns *vec)
 		vec->addrsz++;
 	}
 
-	freeaddrinfo(res0);
+	vec->curaddr = 0;
+}
+
+/*
+ * Run a step of the asynchronous resolution of n->host with asr(3),
+ * starting it if not already started.
+ * While the query is running, its descriptor is what we wait upon.
+ * When it finishes, we move into STATE_CONNECT_READY or, if we have no
+ * addresses at all (not even old ones), STATE_CONNECT_WAITING to try
+ * again after our wait time.
+ * Returns zero on system failure, non-zero on success.
+ */
+int
+dns_resolve(struct out *out, struct node *n)
+{
+	struct addrinfo	 	 hints;
+	struct asr_result	 ar;
+	struct dns		*vec = &n->addrs;
+
+	if (NULL == vec->query) {
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = PF_UNSPEC;
+		hints.ai_socktype = SOCK_DGRAM; /* DUMMY */
+		xdbg(out, "DNS resolving: %s", n->host);
+		http_phase_start(n, PHASE_DNS);
+		vec->query = getaddrinfo_async
+			(n->host, NULL, &hints, NULL);
+		if (NULL == vec->query) {
+			xwarn(out, "getaddrinfo_async: %s", n->host);
+			return 0;
+		}
+		n->dirty = 1;
+	}
+
+	if (0 == asr_run(vec->query, &ar)) {
+		n->xfer.pfd->fd = ar.ar_fd;
+		n->xfer.pfd->events = 
+			ASR_WANT_READ == ar.ar_cond ? POLLIN : POLLOUT;
+		return 1;
+	}
+
+	vec->query = NULL;
+	vec->resolved = time(NULL);
+	vec->fails = 0;
+	n->xfer.pfd->fd = -1;
+	n->dirty = 1;
+	http_phase(n, PHASE__MAX);
+
+	if (EAI_AGAIN == ar.ar_gai_errno || 
+	    EAI_NONAME == ar.ar_gai_errno)
+		xwarnx(out, "DNS resolve error: %s: %s", 
+			n->host, gai_strerror(ar.ar_gai_errno));
+	else if (ar.ar_gai_errno)
+		xwarnx(out, "DNS parse error: %s: %s",
+			n->host, gai_strerror(ar.ar_gai_errno));
+	else {
+		dns_addrs(out, n->host, vec, ar.ar_addrinfo);
+		freeaddrinfo(ar.ar_addrinfo);
+	}
+
+	if (0 == vec->addrsz) {
+		n->state = STATE_CONNECT_WAITING;
+		n->waitstart = vec->resolved;
+	} else
+		n->state = STATE_CONNECT_READY;
+
 	return 1;
 }
+
+/*
+ * Whether we should re-resolve a node's host before connecting.
+ * This is if we don't have any addresses, we've failed to connect to
+ * all of them in turn, or they're simply old.
+ */
+int
+dns_stale(const struct node *n, time_t t)
+{
+
+	return 0 == n->addrs.addrsz ||
+		n->addrs.fails >= n->addrs.addrsz ||
+		n->addrs.resolved + DNS_REFRESH <= t;
+}
+
+/*
+ * Abort any resolution in progress.
+ */
+void
+dns_free(struct dns *vec)
+{
+
+	if (NULL != vec->query)
+		asr_abort(vec->query);
+	vec->query = NULL;
+}
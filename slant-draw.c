@@ -23,6 +23,7 @@
 #include <curses.h>
 #include <float.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -41,115 +42,22 @@ static const char *const states[] = {
 	"cldn", /* STATE_CLOSE_DONE */
 	"cler", /* STATE_CLOSE_ERR */
 	"wrte", /* STATE_WRITE */
-	"read" /* STATE_READ */
+	"read", /* STATE_READ */
+	"keep" /* STATE_CONNECT_KEEPALIVE */
 };
 
 /*
- * Define a function for drawing bars and percentages.
- * This is a bit messy to functionify because of accessing the member
- * variable in each structure.
- * It can be passed in, but would need some smarts.
+ * Define a function for drawing bars and percentages of a field.
  */
-#define DEFINE_draw_bars(_NAME, _MEMBER, _DRAW_PCT, \
+#define DEFINE_draw_bars(_NAME, _FIELD, _DRAW_PCT, \
 	_QMIN_BARS, _QMIN, _MIN, _HOUR, _DAY, _WEEK, _YEAR) \
 static void \
 _NAME(unsigned int bits, WINDOW *win, const struct node *n) \
 { \
-	double	 vv; \
-	const struct recset *r = n->recs; \
-	if (_QMIN_BARS & bits) { \
-		bits &= ~_QMIN_BARS; \
-		if (NULL != r && \
-		    r->byqminsz && r->byqmin[0].entries) { \
-			vv = r->byqmin[0]._MEMBER / \
-			     r->byqmin[0].entries; \
-			draw_bars(win, vv); \
-		} else \
-			wprintw(win, "%10s", " "); \
-		if (bits) \
-			waddch(win, ' '); \
-	} \
-	if (_QMIN & bits) { \
-		bits &= ~_QMIN; \
-		if (NULL != r && \
-		    r->byqminsz && r->byqmin[0].entries) { \
-			vv = r->byqmin[0]._MEMBER / \
-			     r->byqmin[0].entries; \
-			wattron(win, A_BOLD); \
-			_DRAW_PCT(win, vv); \
-			wattroff(win, A_BOLD); \
-		} else if (NULL != n->recs) { \
-			wprintw(win, "%6s", " "); \
-		} else  \
-			wprintw(win, "------%"); \
-		if (bits) \
-			draw_sub_separator(win); \
-	} \
-	if (_MIN & bits) { \
-		bits &= ~_MIN; \
-		if (NULL != r && \
-		    r->byminsz && r->bymin[0].entries) { \
-			vv = r->bymin[0]._MEMBER / \
-		   	     r->bymin[0].entries; \
-			_DRAW_PCT(win, vv); \
-		} else if (NULL != n->recs) { \
-			wprintw(win, "%6s", " ");  \
-		} else \
-			wprintw(win, "------%"); \
-		if (bits) \
-			draw_sub_separator(win); \
-	} \
-	if (_HOUR & bits) { \
-		bits &= ~_HOUR; \
-		if (NULL != r && \
-		    r->byhoursz && r->byhour[0].entries) { \
-			vv = r->byhour[0]._MEMBER / \
-		   	     r->byhour[0].entries; \
-			_DRAW_PCT(win, vv); \
-		} else if (NULL != n->recs) { \
-			wprintw(win, "%6s", " ");  \
-		} else \
-			wprintw(win, "------%"); \
-		if (bits) \
-			draw_sub_separator(win); \
-	} \
-	if (_DAY & bits) { \
-		bits &= ~_DAY; \
-		if (NULL != r && \
-		    r->bydaysz && r->byday[0].entries) { \
-			vv = r->byday[0]._MEMBER / \
-			     r->byday[0].entries; \
-			_DRAW_PCT(win, vv); \
-		} else if (NULL != n->recs) { \
-			wprintw(win, "%6s", " ");  \
-		} else \
-			wprintw(win, "------%"); \
-	} \
-	if (_WEEK & bits) { \
-		bits &= ~_WEEK; \
-		if (NULL != r && \
-		    r->byweeksz && r->byweek[0].entries) { \
-			vv = r->byweek[0]._MEMBER / \
-		  	     r->byweek[0].entries; \
-			_DRAW_PCT(win, vv); \
-		} else if (NULL != n->recs) { \
-			wprintw(win, "%6s", " ");  \
-		} else \
-			wprintw(win, "------%"); \
-	} \
-	if (_YEAR & bits) { \
-		bits &= ~_YEAR; \
-		if (NULL != r && \
-		    r->byyearsz && r->byyear[0].entries) { \
-			vv = r->byyear[0]._MEMBER / \
-			     r->byyear[0].entries; \
-			_DRAW_PCT(win, vv); \
-		} else if (NULL != n->recs) { \
-			wprintw(win, "%6s", " ");  \
-		} else \
-			wprintw(win, "------%"); \
-	} \
-	assert(0 == bits); \
+	static const unsigned int ivbits[INTERVALS] = { \
+		_QMIN, _MIN, _HOUR, _DAY, _WEEK, _YEAR }; \
+	draw_field(bits, win, n, _FIELD, \
+		_DRAW_PCT, _QMIN_BARS, ivbits); \
 }
 
 /*
@@ -207,28 +115,11 @@ _NAME(unsigned int bits) \
 static time_t
 get_last(const struct node *n)
 {
+	enum interval	 iv;
 
-	if (NULL == n->recs)
-		return 0;
-
-	if (n->recs->byqminsz &&
-	    n->recs->byqmin[0].entries)
-		return n->recs->byqmin[0].ctime;
-	if (n->recs->byminsz &&
-	    n->recs->bymin[0].entries)
-		return n->recs->bymin[0].ctime;
-	if (n->recs->byhoursz &&
-	    n->recs->byhour[0].entries)
-		return n->recs->byhour[0].ctime;
-	if (n->recs->bydaysz &&
-	    n->recs->byday[0].entries)
-		return n->recs->byday[0].ctime;
-	if (n->recs->byweeksz &&
-	    n->recs->byweek[0].entries)
-		return n->recs->byweek[0].ctime;
-	if (n->recs->byyearsz &&
-	    n->recs->byyear[0].entries)
-		return n->recs->byyear[0].ctime;
+	for (iv = INTERVAL_byqmin; iv <= INTERVAL_byyear; iv++)
+		if (recset_get(n->recs, iv, 0, RECF_ENTRIES) > 0.0)
+			return recset_ctime(n->recs, iv, 0);
 
 	return 0;
 }
@@ -505,235 +396,254 @@ draw_link(unsigned int bits, size_t maxipsz, time_t timeo,
 	assert(0 == bits);
 }
 
+/*
+ * Draw the pair of transfer rates "f1" and "f2" for the intervals whose
+ * box bits are given in "ivbits" (by enum interval).
+ */
 static void
-draw_disc(unsigned int bits, WINDOW *win, const struct node *n)
+draw_xfers(unsigned int bits, WINDOW *win, const struct node *n,
+	enum recfield f1, enum recfield f2, const unsigned int *ivbits)
 {
-	double	 vv;
+	double		 v1, v2;
+	enum interval	 iv;
 
-	if (DISC_QMIN & bits) {
-		bits &= ~DISC_QMIN;
-		if (NULL != n->recs &&
-		    n->recs->byqminsz &&
-		    n->recs->byqmin[0].entries) {
-			vv = n->recs->byqmin[0].discread /
-				(double)n->recs->byqmin[0].entries;
-			wattron(win, A_BOLD);
-			draw_xfer(win, vv, 0);
-			wattroff(win, A_BOLD);
+	for (iv = INTERVAL_byqmin; iv <= INTERVAL_byyear; iv++) {
+		if ( ! (ivbits[iv] & bits))
+			continue;
+		bits &= ~ivbits[iv];
+		if (recset_avg(n->recs, iv, 0, f1, &v1) &&
+		    recset_avg(n->recs, iv, 0, f2, &v2)) {
+			if (INTERVAL_byqmin == iv)
+				wattron(win, A_BOLD);
+			draw_xfer(win, v1, 0);
+			if (INTERVAL_byqmin == iv)
+				wattroff(win, A_BOLD);
 			waddch(win, ':');
-			vv = n->recs->byqmin[0].discwrite /
-				(double)n->recs->byqmin[0].entries;
-			wattron(win, A_BOLD);
-			draw_xfer(win, vv, 1);
-			wattroff(win, A_BOLD);
+			if (INTERVAL_byqmin == iv)
+				wattron(win, A_BOLD);
+			draw_xfer(win, v2, 1);
+			if (INTERVAL_byqmin == iv)
+				wattroff(win, A_BOLD);
 		} else
 			waddstr(win, "------:------");
-		if (bits)
+		if (bits && iv < INTERVAL_byday)
 			draw_sub_separator(win);
 	}
 
-	if (DISC_MIN & bits) {
-		bits &= ~DISC_MIN;
-		if (NULL != n->recs &&
-		    n->recs->byminsz &&
-		    n->recs->bymin[0].entries) {
-			vv = n->recs->bymin[0].discread /
-				(double)n->recs->bymin[0].entries;
-			draw_xfer(win, vv, 0);
-			waddch(win, ':');
-			vv = n->recs->bymin[0].discwrite /
-				(double)n->recs->bymin[0].entries;
-			draw_xfer(win, vv, 1);
-		} else
-			waddstr(win, "------:------");
-		if (bits)
-			draw_sub_separator(win);
-	}
+	assert(0 == bits);
+}
 
-	if (DISC_HOUR & bits) {
-		bits &= ~DISC_HOUR;
-		if (NULL != n->recs &&
-		    n->recs->byhoursz &&
-		    n->recs->byhour[0].entries) {
-			vv = n->recs->byhour[0].discread /
-				(double)n->recs->byhour[0].entries;
-			draw_xfer(win, vv, 0);
-			waddch(win, ':');
-			vv = n->recs->byhour[0].discwrite /
-				(double)n->recs->byhour[0].entries;
-			draw_xfer(win, vv, 1);
-		} else
-			waddstr(win, "------:------");
-		if (bits)
-			draw_sub_separator(win);
-	}
+static void
+draw_disc(unsigned int bits, WINDOW *win, const struct node *n)
+{
+	static const unsigned int ivbits[INTERVALS] = {
+		DISC_QMIN, DISC_MIN, DISC_HOUR, 
+		DISC_DAY, DISC_WEEK, DISC_YEAR };
 
-	if (DISC_DAY & bits) {
-		bits &= ~DISC_DAY;
-		if (NULL != n->recs &&
-		    n->recs->bydaysz &&
-		    n->recs->byday[0].entries) {
-			vv = n->recs->byday[0].discread /
-				(double)n->recs->byday[0].entries;
-			draw_xfer(win, vv, 0);
-			waddch(win, ':');
-			vv = n->recs->byday[0].discwrite /
-				(double)n->recs->byday[0].entries;
-			draw_xfer(win, vv, 1);
-		} else
-			waddstr(win, "------:------");
-	}
+	draw_xfers(bits, win, n, RECF_DISCREAD, RECF_DISCWRITE, ivbits);
+}
 
-	if (DISC_WEEK & bits) {
-		bits &= ~DISC_WEEK;
-		if (NULL != n->recs &&
-		    n->recs->byweeksz &&
-		    n->recs->byweek[0].entries) {
-			vv = n->recs->byweek[0].discread /
-				(double)n->recs->byweek[0].entries;
-			draw_xfer(win, vv, 0);
-			waddch(win, ':');
-			vv = n->recs->byweek[0].discwrite /
-				(double)n->recs->byweek[0].entries;
-			draw_xfer(win, vv, 1);
-		} else
-			waddstr(win, "------:------");
-	}
+static void
+draw_inet(unsigned int bits, WINDOW *win, const struct node *n)
+{
+	static const unsigned int ivbits[INTERVALS] = {
+		NET_QMIN, NET_MIN, NET_HOUR, 
+		NET_DAY, NET_WEEK, NET_YEAR };
 
-	if (DISC_YEAR & bits) {
-		bits &= ~DISC_YEAR;
-		if (NULL != n->recs &&
-		    n->recs->byyearsz &&
-		    n->recs->byyear[0].entries) {
-			vv = n->recs->byyear[0].discread /
-				(double)n->recs->byyear[0].entries;
-			draw_xfer(win, vv, 0);
-			waddch(win, ':');
-			vv = n->recs->byyear[0].discwrite /
-				(double)n->recs->byyear[0].entries;
-			draw_xfer(win, vv, 1);
-		} else
-			waddstr(win, "------:------");
+	draw_xfers(bits, win, n, RECF_NETRX, RECF_NETTX, ivbits);
+}
+
+/*
+ * Box bits of each transfer phase.
+ */
+static	const unsigned int latency_bits[PHASE__MAX] = {
+	LATENCY_DNS, /* PHASE_DNS */
+	LATENCY_CONNECT, /* PHASE_CONNECT */
+	LATENCY_TLS, /* PHASE_TLS */
+	LATENCY_TTFB, /* PHASE_TTFB */
+	LATENCY_BODY, /* PHASE_BODY */
+};
+
+static size_t
+size_latency(unsigned int bits)
+{
+	size_t	 i, sz = 0;
+
+	for (i = 0; i < PHASE__MAX; i++)
+		if (latency_bits[i] & bits)
+			sz += 5 + (sz ? 1 : 0);
+	return sz;
+}
+
+/*
+ * Draw a phase time of "vv" milliseconds in five columns, or something
+ * indicating no time if negative.
+ * Times over a second are yellow; over five, red.
+ */
+static void
+draw_msecs(WINDOW *win, double vv)
+{
+	int	 attrs = 0;
+
+	if (vv < 0.0) {
+		waddstr(win, "  ---");
+		return;
 	}
 
-	assert(0 == bits);
+	if (vv >= 5000.0)
+		wattron(win, attrs = COLOR_PAIR(2));
+	else if (vv >= 1000.0)
+		wattron(win, attrs = COLOR_PAIR(1));
+
+	if (vv < 1.0)
+		waddstr(win, " <1ms");
+	else if (vv < 999.5)
+		wprintw(win, "%3.0fms", vv);
+	else if (vv < 9950.0)
+		wprintw(win, "%4.1fs", vv / 1000.0);
+	else if (vv < 9999500.0)
+		wprintw(win, "%4.0fs", vv / 1000.0);
+	else
+		waddstr(win, "9999s");
+
+	if (attrs)
+		wattroff(win, attrs);
 }
 
+/*
+ * Draw the phases of the last successful poll or, with LATENCY_P90,
+ * their 90th percentile over recent polls.
+ */
 static void
-draw_inet(unsigned int bits, WINDOW *win, const struct node *n)
+draw_latency(unsigned int bits, WINDOW *win, const struct node *n)
 {
+	size_t	 i;
+	int	 first = 1;
 	double	 vv;
 
-	if (NET_QMIN & bits) {
-		bits &= ~NET_QMIN;
-		if (NULL != n->recs &&
-		    n->recs->byqminsz &&
-		    n->recs->byqmin[0].entries) {
-			vv = n->recs->byqmin[0].netrx /
-				(double)n->recs->byqmin[0].entries;
-			wattron(win, A_BOLD);
-			draw_xfer(win, vv, 0);
-			wattroff(win, A_BOLD);
-			waddch(win, ':');
-			vv = n->recs->byqmin[0].nettx /
-				(double)n->recs->byqmin[0].entries;
-			wattron(win, A_BOLD);
-			draw_xfer(win, vv, 1);
-			wattroff(win, A_BOLD);
-		} else
-			waddstr(win, "------:------");
-		if (bits)
+	for (i = 0; i < PHASE__MAX; i++) {
+		if ( ! (latency_bits[i] & bits))
+			continue;
+		if ( ! first)
 			draw_sub_separator(win);
+		first = 0;
+		vv = (LATENCY_P90 & bits) ?
+			latency_pct(&n->latency, i, 90) :
+			latency_last(&n->latency, i);
+		draw_msecs(win, vv);
 	}
+}
 
-	if (NET_MIN & bits) {
-		bits &= ~NET_MIN;
-		if (NULL != n->recs &&
-		    n->recs->byminsz &&
-		    n->recs->bymin[0].entries) {
-			vv = n->recs->bymin[0].netrx /
-				(double)n->recs->bymin[0].entries;
-			draw_xfer(win, vv, 0);
-			waddch(win, ':');
-			vv = n->recs->bymin[0].nettx /
-				(double)n->recs->bymin[0].entries;
-			draw_xfer(win, vv, 1);
-		} else
-			waddstr(win, "------:------");
-		if (bits)
+static size_t
+size_host(unsigned int bits)
+{
+	size_t	 sz = 0;
+
+	if (HOST_ACCESS & bits)
+		sz += 9;
+	if (HOST_COLLECT & bits)
+		sz += 5 + (sz ? 1 : 0);
+	if (HOST_DB & bits)
+		sz += 5 + (sz ? 1 : 0);
+	if (HOST_CGI & bits)
+		sz += 5 + (sz ? 1 : 0);
+	return sz;
+}
+
+/*
+ * Draw the host's own timings (in microseconds) of its last sample:
+ * that of collecting, writing to the database, and serving the
+ * response.
+ * Servers not reporting timings have them all at zero.
+ */
+static void
+draw_host_times(unsigned int bits, int sep, 
+	WINDOW *win, const struct node *n)
+{
+	const struct recset *r = n->recs;
+	double	 vv;
+
+	if (HOST_COLLECT & bits) {
+		vv = -1.0;
+		if (NULL != r && r->has_system)
+			vv = (r->system.nprocstime + 
+			      r->system.nfilestime +
+			      r->system.cputime + r->system.memtime +
+			      r->system.nettime + 
+			      r->system.disctime) / 1000.0;
+		if (sep)
 			draw_sub_separator(win);
+		draw_msecs(win, vv > 0.0 ? vv : -1.0);
+		sep = 1;
 	}
 
-	if (NET_HOUR & bits) {
-		bits &= ~NET_HOUR;
-		if (NULL != n->recs &&
-		    n->recs->byhoursz &&
-		    n->recs->byhour[0].entries) {
-			vv = n->recs->byhour[0].netrx /
-				(double)n->recs->byhour[0].entries;
-			draw_xfer(win, vv, 0);
-			waddch(win, ':');
-			vv = n->recs->byhour[0].nettx /
-				(double)n->recs->byhour[0].entries;
-			draw_xfer(win, vv, 1);
-		} else
-			waddstr(win, "------:------");
-		if (bits)
+	if (HOST_DB & bits) {
+		vv = -1.0;
+		if (NULL != r && r->has_system)
+			vv = r->system.dbtime / 1000.0;
+		if (sep)
 			draw_sub_separator(win);
+		draw_msecs(win, vv > 0.0 ? vv : -1.0);
+		sep = 1;
 	}
 
-	if (NET_DAY & bits) {
-		bits &= ~NET_DAY;
-		if (NULL != n->recs &&
-		    n->recs->bydaysz &&
-		    n->recs->byday[0].entries) {
-			vv = n->recs->byday[0].netrx /
-				(double)n->recs->byday[0].entries;
-			draw_xfer(win, vv, 0);
-			waddch(win, ':');
-			vv = n->recs->byday[0].nettx /
-				(double)n->recs->byday[0].entries;
-			draw_xfer(win, vv, 1);
-		} else
-			waddstr(win, "------:------");
+	if (HOST_CGI & bits) {
+		vv = -1.0;
+		if (NULL != r && r->has_cgi)
+			vv = (r->cgiopen + r->cgilist + 
+			      r->cgisend) / 1000.0;
+		if (sep)
+			draw_sub_separator(win);
+		draw_msecs(win, vv);
 	}
+}
 
-	if (NET_WEEK & bits) {
-		bits &= ~NET_WEEK;
-		if (NULL != n->recs &&
-		    n->recs->byweeksz &&
-		    n->recs->byweek[0].entries) {
-			vv = n->recs->byweek[0].netrx /
-				(double)n->recs->byweek[0].entries;
-			draw_xfer(win, vv, 0);
-			waddch(win, ':');
-			vv = n->recs->byweek[0].nettx /
-				(double)n->recs->byweek[0].entries;
-			draw_xfer(win, vv, 1);
-		} else
-			waddstr(win, "------:------");
+/*
+ * Draw the bars and percentages of field "f" for the intervals whose
+ * box bits are given in "ivbits" (by enum interval), along with the
+ * bars of the quarter-minute record if "barbit" is set.
+ * Percentages are drawn with "pct".
+ */
+static void
+draw_field(unsigned int bits, WINDOW *win, const struct node *n,
+	enum recfield f, void (*pct)(WINDOW *, double),
+	unsigned int barbit, const unsigned int *ivbits)
+{
+	double		 vv;
+	enum interval	 iv;
+
+	if (barbit & bits) {
+		bits &= ~barbit;
+		if (recset_avg(n->recs, INTERVAL_byqmin, 0, f, &vv))
+			draw_bars(win, vv);
+		else
+			wprintw(win, "%10s", " ");
+		if (bits)
+			waddch(win, ' ');
 	}
 
-	if (NET_YEAR & bits) {
-		bits &= ~NET_YEAR;
-		if (NULL != n->recs &&
-		    n->recs->byyearsz &&
-		    n->recs->byyear[0].entries) {
-			vv = n->recs->byyear[0].netrx /
-				(double)n->recs->byyear[0].entries;
-			draw_xfer(win, vv, 0);
-			waddch(win, ':');
-			vv = n->recs->byyear[0].nettx /
-				(double)n->recs->byyear[0].entries;
-			draw_xfer(win, vv, 1);
+	for (iv = INTERVAL_byqmin; iv <= INTERVAL_byyear; iv++) {
+		if ( ! (ivbits[iv] & bits))
+			continue;
+		bits &= ~ivbits[iv];
+		if (recset_avg(n->recs, iv, 0, f, &vv)) {
+			if (INTERVAL_byqmin == iv)
+				wattron(win, A_BOLD);
+			pct(win, vv);
+			if (INTERVAL_byqmin == iv)
+				wattroff(win, A_BOLD);
+		} else if (NULL != n->recs) {
+			wprintw(win, "%6s", " ");
 		} else
-			waddstr(win, "------:------");
+			waddstr(win, "------%");
+		if (bits && iv < INTERVAL_byday)
+			draw_sub_separator(win);
 	}
 
 	assert(0 == bits);
 }
 
-DEFINE_draw_bars(draw_files, nfiles, draw_pct,
+DEFINE_draw_bars(draw_files, RECF_NFILES, draw_pct,
 	FILES_QMIN_BARS, 
 	FILES_QMIN, FILES_MIN, 
 	FILES_HOUR, FILES_DAY,
@@ -741,7 +651,7 @@ DEFINE_draw_bars(draw_files, nfiles, draw_pct,
 DEFINE_size_bars(size_files, FILES_QMIN_BARS, FILES_QMIN, FILES_MIN, 
 	FILES_HOUR, FILES_DAY, FILES_WEEK, FILES_YEAR)
 
-DEFINE_draw_bars(draw_procs, nprocs, draw_pct,
+DEFINE_draw_bars(draw_procs, RECF_NPROCS, draw_pct,
 	PROCS_QMIN_BARS, 
 	PROCS_QMIN, PROCS_MIN, 
 	PROCS_HOUR, PROCS_DAY,
@@ -749,7 +659,7 @@ DEFINE_draw_bars(draw_procs, nprocs, draw_pct,
 DEFINE_size_bars(size_procs, PROCS_QMIN_BARS, PROCS_QMIN, PROCS_MIN, 
 	PROCS_HOUR, PROCS_DAY, PROCS_WEEK, PROCS_YEAR)
 
-DEFINE_draw_bars(draw_rprocs, rprocs, draw_rpct,
+DEFINE_draw_bars(draw_rprocs, RECF_RPROCS, draw_rpct,
 	RPROCS_QMIN_BARS, 
 	RPROCS_QMIN, RPROCS_MIN, 
 	RPROCS_HOUR, RPROCS_DAY,
@@ -757,7 +667,7 @@ DEFINE_draw_bars(draw_rprocs, rprocs, draw_rpct,
 DEFINE_size_bars(size_rprocs, RPROCS_QMIN_BARS, RPROCS_QMIN, 
 	RPROCS_MIN, RPROCS_HOUR, RPROCS_DAY, RPROCS_WEEK, RPROCS_YEAR)
 
-DEFINE_draw_bars(draw_mem, mem, draw_pct,
+DEFINE_draw_bars(draw_mem, RECF_MEM, draw_pct,
 	MEM_QMIN_BARS, 
 	MEM_QMIN, MEM_MIN, 
 	MEM_HOUR, MEM_DAY,
@@ -765,7 +675,7 @@ DEFINE_draw_bars(draw_mem, mem, draw_pct,
 DEFINE_size_bars(size_mem, MEM_QMIN_BARS, MEM_QMIN, 
 	MEM_MIN, MEM_HOUR, MEM_DAY, MEM_WEEK, MEM_YEAR)
 
-DEFINE_draw_bars(draw_cpu, cpu, draw_pct,
+DEFINE_draw_bars(draw_cpu, RECF_CPU, draw_pct,
 	CPU_QMIN_BARS, 
 	CPU_QMIN, CPU_MIN, 
 	CPU_HOUR, CPU_DAY,
@@ -903,8 +813,10 @@ compute_width(const struct node *n, size_t nsz,
 			assert(0 == bits);
 			break;
 		case DRAWCAT_HOST:
-			/* "Last" time. */
-			sz += 9;
+			sz += size_host(bits);
+			break;
+		case DRAWCAT_LATENCY:
+			sz += size_latency(bits);
 			break;
 		}
 	}
@@ -1041,48 +953,408 @@ draw_header(struct out *out, const struct draw *d,
 			draw_centre(out->mainwin, "link state", sz);
 			break;
 		case DRAWCAT_HOST:
-			wprintw(out->mainwin, "%9s", "last");
+			if (HOST_ACCESS == bits) {
+				wprintw(out->mainwin, "%9s", "last");
+				break;
+			}
+			sz = size_host(bits);
+			draw_centre(out->mainwin, "host", sz);
+			break;
+		case DRAWCAT_LATENCY:
+			sz = size_latency(bits);
+			if (sz < 7) {
+				draw_centre(out->mainwin, "lat", sz);
+				break;
+			} else if (sz < 11 || ! (LATENCY_P90 & bits)) {
+				draw_centre(out->mainwin, "latency", sz);
+				break;
+			}
+			draw_centre(out->mainwin, "latency p90", sz);
+			break;
+		}
+		waddch(out->mainwin, ' ');
+	}
+}
+
+/*
+ * Record fields of the summary, by enum sumfield, and their names.
+ */
+static	const enum recfield sumfields[SUMF__MAX] = {
+	RECF_CPU, /* SUMF_CPU */
+	RECF_MEM /* SUMF_MEM */
+};
+
+static	const char *const sumnames[SUMF__MAX] = {
+	"cpu", /* SUMF_CPU */
+	"mem" /* SUMF_MEM */
+};
+
+/*
+ * Allocate the columns of "s" for "nsz" nodes, all (and the scratch
+ * column) carved from one allocation, freeing what it had.
+ * Returns zero on memory exhaustion, non-zero on success.
+ */
+int
+draw_sum_alloc(struct drawsum *s, size_t nsz)
+{
+	uint32_t	*p;
+	size_t		 i;
+
+	draw_sum_free(s);
+	if (0 == nsz)
+		return 1;
+	p = reallocarray(NULL, nsz, (SUMF__MAX + 1) * sizeof(uint32_t));
+	if (NULL == p)
+		return 0;
+
+	for (i = 0; i < SUMF__MAX; i++)
+		s->vals[i] = p + i * nsz;
+	s->scratch = p + SUMF__MAX * nsz;
+	return 1;
+}
+
+void
+draw_sum_free(struct drawsum *s)
+{
+
+	free(s->vals[SUMF_CPU]);
+	memset(s, 0, sizeof(struct drawsum));
+}
+
+/*
+ * A percentage "vv" in the hundredths we summarise with.
+ */
+static uint32_t
+sum_value(double vv)
+{
+
+	if (vv <= 0.0)
+		return 0;
+	if (vv >= 100.0)
+		return 10000;
+	return vv * 100.0 + 0.5;
+}
+
+/*
+ * Partially order the "sz" values "v" such that the "k"th smallest
+ * (from zero) is at "k", returning it.
+ * This is Hoare's selection with a three-way partition, so it stays
+ * linear on average when many values are the same (e.g., idle hosts).
+ */
+static uint32_t
+sum_select(uint32_t *v, size_t sz, size_t k)
+{
+	size_t		 lo = 0, hi = sz - 1, lt, gt, i;
+	uint32_t	 pivot, t;
+
+	assert(k < sz);
+
+	while (lo < hi) {
+		pivot = v[lo + (hi - lo) / 2];
+
+		/* Less in [lo, lt), equal in [lt, gt), more after. */
+
+		lt = i = lo;
+		gt = hi + 1;
+		while (i < gt)
+			if (v[i] < pivot) {
+				t = v[lt];
+				v[lt++] = v[i];
+				v[i++] = t;
+			} else if (v[i] > pivot) {
+				t = v[--gt];
+				v[gt] = v[i];
+				v[i] = t;
+			} else
+				i++;
+
+		if (k < lt)
+			hi = lt - 1;
+		else if (k >= gt)
+			lo = gt;
+		else
+			return pivot;
+	}
+
+	return v[k];
+}
+
+/*
+ * Recompute the fleet summary of "d" from the newest quarter-minute
+ * records of the nodes "n".
+ * The nodes are visited once, to gather their values into the columns;
+ * the reductions then only see the columns.
+ * Nodes without both values aren't counted.
+ */
+static void
+draw_sum(struct draw *d, struct node *const *n, size_t nsz)
+{
+	struct drawsum	*s = &d->sum;
+	const uint32_t	*v;
+	double		 vv[SUMF__MAX];
+	uint64_t	 sum;
+	uint32_t	 max, lim;
+	size_t		 i, j, sz, over;
+
+	for (sz = i = 0; i < nsz; i++) {
+		for (j = 0; j < SUMF__MAX; j++)
+			if ( ! recset_avg(n[i]->recs, INTERVAL_byqmin,
+			    0, sumfields[j], &vv[j]))
+				break;
+		if (j < SUMF__MAX)
+			continue;
+		for (j = 0; j < SUMF__MAX; j++)
+			s->vals[j][sz] = sum_value(vv[j]);
+		sz++;
+	}
+
+	s->valsz = sz;
+
+	for (j = 0; j < SUMF__MAX; j++) {
+		v = s->vals[j];
+		lim = 0 == d->thresh[j] ? 
+			UINT32_MAX : d->thresh[j] * 100;
+		sum = 0;
+		max = 0;
+		over = 0;
+		for (i = 0; i < sz; i++) {
+			sum += v[i];
+			max = v[i] > max ? v[i] : max;
+			over += v[i] > lim;
+		}
+
+		s->max[j] = max;
+		s->over[j] = over;
+		if (0 == sz) {
+			s->avg[j] = s->p95[j] = 0;
+			continue;
+		}
+
+		/* Nearest-rank percentile, selected from a copy. */
+
+		s->avg[j] = sum / sz;
+		memcpy(s->scratch, v, sz * sizeof(uint32_t));
+		s->p95[j] = sum_select(s->scratch, 
+			sz, (95 * sz + 99) / 100 - 1);
+	}
+}
+
+/*
+ * Whether a value of the newest quarter-minute record of "n" is over
+ * its threshold in "d".
+ */
+static int
+draw_breach(const struct draw *d, const struct node *n)
+{
+	double	 vv;
+	size_t	 i;
+
+	for (i = 0; i < SUMF__MAX; i++)
+		if (d->thresh[i] &&
+		    recset_avg(n->recs, INTERVAL_byqmin, 
+		     0, sumfields[i], &vv) &&
+		    sum_value(vv) > d->thresh[i] * 100)
+			return 1;
+	return 0;
+}
+
+/*
+ * Draw the fleet summary below the header (if any): for each field,
+ * its mean, 95th percentile, maximum, and (if it has a threshold) how
+ * many hosts are over it.
+ * Fields that won't fit on the line are left out.
+ */
+static void
+draw_summary(struct out *out, const struct draw *d)
+{
+	const struct drawsum *s = &d->sum;
+	size_t		 i, sz;
+	int		 maxx;
+
+	maxx = getmaxx(out->mainwin);
+
+	wmove(out->mainwin, d->header, 1);
+	wclrtoeol(out->mainwin);
+	wattron(out->mainwin, A_BOLD);
+	wprintw(out->mainwin, "%*s", (int)d->maxhostsz, "fleet");
+	wattroff(out->mainwin, A_BOLD);
+	waddch(out->mainwin, ' ');
+
+	for (i = 0; i < SUMF__MAX; i++) {
+		sz = 38 + (d->thresh[i] ? 12 : 0);
+		if (getcurx(out->mainwin) + sz >= (size_t)maxx)
 			break;
+		draw_main_separator(out->mainwin);
+		wprintw(out->mainwin, " %s avg ", sumnames[i]);
+		if (0 == s->valsz) {
+			wprintw(out->mainwin, "%-30s", "------%");
+			continue;
+		}
+		draw_pct(out->mainwin, s->avg[i] / 100.0);
+		waddstr(out->mainwin, " p95 ");
+		draw_pct(out->mainwin, s->p95[i] / 100.0);
+		waddstr(out->mainwin, " max ");
+		draw_pct(out->mainwin, s->max[i] / 100.0);
+		if (d->thresh[i]) {
+			wprintw(out->mainwin, " >%3zu%%: ", d->thresh[i]);
+			if (s->over[i])
+				wattron(out->mainwin, 
+					A_BOLD | COLOR_PAIR(2));
+			wprintw(out->mainwin, "%3zu", s->over[i]);
+			if (s->over[i])
+				wattroff(out->mainwin, 
+					A_BOLD | COLOR_PAIR(2));
 		}
 		waddch(out->mainwin, ' ');
 	}
 }
 
+/*
+ * Screen row of row "i" of nodes, which are below the header and the
+ * summary.
+ */
+static int
+row_y(const struct draw *d, size_t i)
+{
+
+	return i + d->header + d->summary;
+}
+
+/*
+ * Whether the node on row "i" differs from what we last drew there,
+ * whether by its data, its position in the ordering, its state, or its
+ * address.
+ */
+static int
+row_changed(const struct draw *d, const struct node *n, size_t i)
+{
+
+	return n->dirty ||
+		d->rows[i].url != n->url ||
+		d->rows[i].state != n->state ||
+		d->rows[i].curaddr != n->addrs.curaddr;
+}
+
+/*
+ * Redraw the interval from last collection and last ping time for the
+ * node on row "i".
+ * We do this by overwriting only that data, which reduces screen update
+ * and keeps our display running tight.
+ */
+static void
+draw_times(struct out *out, const struct draw *d, 
+	const struct node *n, size_t i, time_t t)
+{
+
+	if (d->intervalpos) {
+		wmove(out->mainwin, row_y(d, i), d->intervalpos);
+		draw_interval(out->mainwin, 15, 
+			n->waittime, get_last(n), t);
+	}
+	if (d->lastseenpos) {
+		wmove(out->mainwin, row_y(d, i), d->lastseenpos);
+		draw_interval(out->mainwin, n->waittime, 
+			n->waittime, n->lastseen, t);
+	}
+}
+
+/*
+ * Draw the nodes in the display order "n" that fit on the screen,
+ * starting at d->top, but only repainting rows that have changed since
+ * we last drew them: the others just have their times updated.
+ * Column widths are cached and only computed from all nodes on the
+ * first draw; then they grow (repainting everything) if a repainted
+ * node's address is wider.
+ */
 void
 draw(struct out *out, struct draw *d, int first,
-	const struct node *n, size_t nsz, time_t t)
+	struct node *const *n, size_t nsz, time_t t)
 {
-	size_t		 i, j, sz, maxhostsz, maxipsz,
-			 lastseenpos = 0, intervalpos = 0, chhead;
-	int		 x, y, maxy, maxx;
+	size_t		 i, j, sz, lastseenpos, intervalpos;
+	int		 x, y, maxy, maxx, chhead, widen = 0, resum = 0;
 	unsigned int	 bits;
+	attr_t		 attr;
+
+	if (first) {
+		d->maxhostsz = strlen("hostname");
+		for (i = 0; i < nsz; i++) {
+			sz = strlen(n[i]->host);
+			if (sz > d->maxhostsz)
+				d->maxhostsz = sz;
+		}
+		d->maxipsz = strlen("address");
+		widen = 1;
+	}
+
+	/* 
+	 * The summary is of all nodes, shown or not, so it's redone
+	 * when any node has changed.
+	 * Thresholds are checked whether or not it's shown.
+	 */
 
-	/* Don't let us run off the window. */
+	if (d->summary || d->thresh[SUMF_CPU] || d->thresh[SUMF_MEM]) {
+		for (i = 0; i < nsz && ! first; i++)
+			if (n[i]->dirty)
+				break;
+		if ((resum = first || i < nsz))
+			draw_sum(d, n, nsz);
+	}
+
+	/* 
+	 * Only draw the window into the list that fits on the screen,
+	 * keeping it within the list.
+	 */
 
 	getmaxyx(out->mainwin, maxy, maxx);
-	if (nsz > (size_t)maxy - 1)
-		nsz = maxy - 1;
+	y = d->header + d->summary;
+	d->visible = maxy > y ? (size_t)(maxy - y) : 0;
+	if (d->visible > d->rowsz)
+		d->visible = d->rowsz;
+	if (d->top + d->visible > nsz)
+		d->top = nsz > d->visible ? nsz - d->visible : 0;
+
+	n += d->top;
+	nsz -= d->top;
+	if (nsz > d->visible)
+		nsz = d->visible;
 
-	maxhostsz = strlen("hostname");
 	for (i = 0; i < nsz; i++) {
-		sz = strlen(n[i].host);
-		if (sz > maxhostsz)
-			maxhostsz = sz;
+		if ( ! widen && ! row_changed(d, n[i], i))
+			continue;
+		sz = strlen(n[i]->addrs.addrs[n[i]->addrs.curaddr].ip);
+		if (sz > d->maxipsz) {
+			d->maxipsz = sz;
+			widen = 1;
+		}
 	}
 
-	maxipsz = strlen("address");
-	for (i = 0; i < nsz; i++) {
-		sz = strlen(n[i].addrs.addrs[n[i].addrs.curaddr].ip);
-		if (sz > maxipsz)
-			maxipsz = sz;
-	}
+	lastseenpos = d->lastseenpos;
+	intervalpos = d->intervalpos;
 
 	for (i = 0; i < nsz; i++) {
-		wmove(out->mainwin, i + d->header, 1);
+		if ( ! widen && ! row_changed(d, n[i], i)) {
+			draw_times(out, d, n[i], i, t);
+			continue;
+		}
+
+		d->rows[i].url = n[i]->url;
+		d->rows[i].state = n[i]->state;
+		d->rows[i].curaddr = n[i]->addrs.curaddr;
+
+		/* 
+		 * Hosts only showing cached records are dimmed, and
+		 * those over a threshold are red.
+		 */
+
+		attr = n[i]->stale ? A_DIM : A_BOLD;
+		if (draw_breach(d, n[i]))
+			attr |= COLOR_PAIR(2);
+		wmove(out->mainwin, row_y(d, i), 1);
 		wclrtoeol(out->mainwin);
-		wattron(out->mainwin, A_BOLD);
-		wprintw(out->mainwin, "%*s", (int)maxhostsz, n[i].host);
-		wattroff(out->mainwin, A_BOLD);
+		wattron(out->mainwin, attr);
+		wprintw(out->mainwin, "%*s", 
+			(int)d->maxhostsz, n[i]->host);
+		wattroff(out->mainwin, attr);
 		waddch(out->mainwin, ' ');
 
 		for (j = 0; j < d->boxsz; j++) {
@@ -1092,37 +1364,46 @@ draw(struct out *out, struct draw *d, int first,
 			waddch(out->mainwin, ' ');
 			switch (d->box[j].cat) {
 			case DRAWCAT_CPU:
-				draw_cpu(bits, out->mainwin, &n[i]);
+				draw_cpu(bits, out->mainwin, n[i]);
 				break;
 			case DRAWCAT_MEM:
-				draw_mem(bits, out->mainwin, &n[i]);
+				draw_mem(bits, out->mainwin, n[i]);
 				break;
 			case DRAWCAT_NET:
-				draw_inet(bits, out->mainwin, &n[i]);
+				draw_inet(bits, out->mainwin, n[i]);
 				break;
 			case DRAWCAT_DISC:
-				draw_disc(bits, out->mainwin, &n[i]);
+				draw_disc(bits, out->mainwin, n[i]);
 				break;
 			case DRAWCAT_LINK:
-				draw_link(bits, maxipsz, 
-					n[i].waittime, t, 
-					out->mainwin, &n[i], 
+				draw_link(bits, d->maxipsz, 
+					n[i]->waittime, t, 
+					out->mainwin, n[i], 
 					&lastseenpos);
 				break;
 			case DRAWCAT_HOST:
-				getyx(out->mainwin, y, x);
-				intervalpos = x;
-				draw_interval(out->mainwin, 15, 
-					n[i].waittime, get_last(&n[i]), t);
+				if (HOST_ACCESS & bits) {
+					getyx(out->mainwin, y, x);
+					intervalpos = x;
+					draw_interval(out->mainwin, 15, 
+						n[i]->waittime, 
+						get_last(n[i]), t);
+				}
+				draw_host_times(bits, 
+					HOST_ACCESS & bits, 
+					out->mainwin, n[i]);
 				break;
 			case DRAWCAT_PROCS:
-				draw_procs(bits, out->mainwin, &n[i]);
+				draw_procs(bits, out->mainwin, n[i]);
 				break;
 			case DRAWCAT_RPROCS:
-				draw_rprocs(bits, out->mainwin, &n[i]);
+				draw_rprocs(bits, out->mainwin, n[i]);
 				break;
 			case DRAWCAT_FILES:
-				draw_files(bits, out->mainwin, &n[i]);
+				draw_files(bits, out->mainwin, n[i]);
+				break;
+			case DRAWCAT_LATENCY:
+				draw_latency(bits, out->mainwin, n[i]);
 				break;
 			}
 			waddch(out->mainwin, ' ');
@@ -1138,44 +1419,134 @@ draw(struct out *out, struct draw *d, int first,
 	d->intervalpos = intervalpos;
 	d->lastseenpos = lastseenpos;
 
-	if (d->header && (chhead || first))
-		draw_header(out, d, maxhostsz, maxipsz);
+	if (d->header && (chhead || widen))
+		draw_header(out, d, d->maxhostsz, d->maxipsz);
+	if (d->summary && (resum || widen))
+		draw_summary(out, d);
 }
 
 /*
- * If we have no new data but one second has elapsed, then redraw the
- * interval from last collection and last ping time.
- * We do this by overwriting only that data, which reduces screen update
- * and keeps our display running tight.
+ * The intervals (RECS_QMIN, etc.) whose records are drawn by the boxes
+ * of "d", so we needn't fetch the others, with "depth" set to how
+ * many of each interval's newest records are drawn (zero if none).
+ * We always want the newest quarter-minute record, as it tells us when
+ * the host was last seen.
  */
-void
-drawtimes(struct out *out, const struct draw *d, 
-	const struct node *n, size_t nsz, time_t t)
+unsigned int
+draw_intervals(const struct draw *d, size_t *depth)
 {
-	size_t	 i;
-	int	 maxy, maxx;
+	unsigned int	 bits = RECS_QMIN, a;
+	size_t		 i;
 
-	/* Hasn't collected data yet... */
+	for (i = 0; i < d->boxsz; i++) {
+		a = d->box[i].args;
+		switch (d->box[i].cat) {
+		case DRAWCAT_CPU:
+		case DRAWCAT_MEM:
+		case DRAWCAT_PROCS:
+		case DRAWCAT_FILES:
+			/* These share their bit values. */
+			if (CPU_MIN & a)
+				bits |= RECS_MIN;
+			if (CPU_HOUR & a)
+				bits |= RECS_HOUR;
+			if (CPU_DAY & a)
+				bits |= RECS_DAY;
+			if (CPU_WEEK & a)
+				bits |= RECS_WEEK;
+			if (CPU_YEAR & a)
+				bits |= RECS_YEAR;
+			break;
+		case DRAWCAT_NET:
+		case DRAWCAT_DISC:
+		case DRAWCAT_RPROCS:
+			/* As do these. */
+			if (NET_MIN & a)
+				bits |= RECS_MIN;
+			if (NET_HOUR & a)
+				bits |= RECS_HOUR;
+			if (NET_DAY & a)
+				bits |= RECS_DAY;
+			if (NET_WEEK & a)
+				bits |= RECS_WEEK;
+			if (NET_YEAR & a)
+				bits |= RECS_YEAR;
+			break;
+		default:
+			break;
+		}
+	}
 
-	if (0 == d->intervalpos && 0 == d->lastseenpos)
-		return;
+	/* Boxes only draw each interval's newest record. */
 
-	/* Don't let us run off the window. */
+	for (i = 0; i < INTERVALS; i++)
+		depth[i] = (1U << i) & bits ? 1 : 0;
 
-	getmaxyx(out->mainwin, maxy, maxx);
-	if (nsz > (size_t)maxy - 1)
-		nsz = maxy - 1;
+	return bits;
+}
 
-	for (i = 0; i < nsz; i++) {
-		if (d->intervalpos) {
-			wmove(out->mainwin, i + 1, d->intervalpos);
-			draw_interval(out->mainwin, 15, 
-				n[i].waittime, get_last(&n[i]), t);
-		}
-		if (d->lastseenpos) {
-			wmove(out->mainwin, i + 1, d->lastseenpos);
-			draw_interval(out->mainwin, n[i].waittime, 
-				n[i].waittime, n[i].lastseen, t);
-		}
+/*
+ * Whether the boxes of "d" draw server timings, which servers only send
+ * when asked.
+ */
+int
+draw_timings(const struct draw *d)
+{
+	size_t	 i;
+
+	for (i = 0; i < d->boxsz; i++)
+		if (DRAWCAT_HOST == d->box[i].cat &&
+		    ((HOST_COLLECT | HOST_DB | HOST_CGI) & d->box[i].args))
+			return 1;
+	return 0;
+}
+
+/*
+ * Move our window into the list of "nsz" nodes according to the key
+ * "key": by a row, a page, or to either end.
+ * This is clamped to the list by draw().
+ * Returns whether we've moved.
+ */
+int
+draw_scroll(struct draw *d, int key, size_t nsz)
+{
+	size_t	 top = d->top, page;
+
+	page = d->visible > 1 ? d->visible - 1 : 1;
+
+	switch (key) {
+	case KEY_UP:
+	case 'k':
+		if (top > 0)
+			top--;
+		break;
+	case KEY_DOWN:
+	case 'j':
+		if (top + d->visible < nsz)
+			top++;
+		break;
+	case KEY_PPAGE:
+	case 'b':
+		top = top > page ? top - page : 0;
+		break;
+	case KEY_NPAGE:
+	case ' ':
+		top += page;
+		break;
+	case KEY_HOME:
+	case 'g':
+		top = 0;
+		break;
+	case KEY_END:
+	case 'G':
+		top = nsz;
+		break;
+	default:
+		break;
 	}
+
+	if (top == d->top)
+		return 0;
+	d->top = top;
+	return 1;
 }
@@ -0,0 +1,558 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/types.h>
+#if HAVE_KQUEUE
+# include <sys/event.h>
+#endif
+#include <sys/poll.h>
+#include <sys/time.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "slant-event.h"
+
+/*
+ * Common to both backends.
+ * The "when" array holds the current deadline for each slot (or zero),
+ * which is cleared when it's been delivered.
+ * The "ready" array is of slots ready to be visited, with "mark" making
+ * sure each slot appears only once.
+ */
+struct	events {
+	struct pollfd	 *pfds; /* descriptors by slot */
+	size_t		  sz; /* number of slots */
+	time_t		 *when; /* deadline by slot */
+	size_t		 *ready; /* ready slots */
+	size_t		  readysz;
+	char		 *mark; /* whether slot is ready */
+	sigset_t	  sigs; /* signals we handle */
+#if HAVE_KQUEUE
+	int		  kq; /* kqueue(2) descriptor */
+	struct kevent	 *chs; /* pending changes */
+	size_t		  chsz;
+	size_t		  chmax;
+	struct kevent	 *evs; /* returned events */
+	size_t		  evmax;
+	size_t		 *now; /* slots with expired deadlines */
+	size_t		  nowsz;
+	char		 *nowmark; /* whether slot is in "now" */
+#else
+	struct timer	 *ents; /* min-heap by "when" */
+	size_t		  entsz;
+	size_t		  entmax;
+	sigset_t	  waitmask; /* mask while waiting */
+#endif
+};
+
+#if ! HAVE_KQUEUE
+/*
+ * A timer on a slot: when the slot should next be visited.
+ * Only the timer matching the slot's "when" is valid: others were
+ * superseded and are discarded when popped.
+ */
+struct	timer {
+	time_t		 when;
+	size_t		 slot;
+};
+#endif
+
+static void
+ready_add(struct events *ev, size_t slot)
+{
+
+	if (ev->mark[slot])
+		return;
+	ev->mark[slot] = 1;
+	ev->ready[ev->readysz++] = slot;
+}
+
+/*
+ * Clear out the ready slots from the last wait.
+ */
+static void
+ready_reset(struct events *ev)
+{
+	size_t	 i;
+
+	for (i = 0; i < ev->readysz; i++)
+		ev->mark[ev->ready[i]] = 0;
+	ev->readysz = 0;
+}
+
+/*
+ * How long to sleep until whatever is next.
+ * Deadlines have a granularity of one second, so unless one has already
+ * expired ("now" is non-zero), we sleep until the next second (which
+ * also keeps our time displays current).
+ */
+static void
+wait_timeout(int now, struct timespec *ts)
+{
+	struct timespec	 cur;
+
+	ts->tv_sec = 0;
+	ts->tv_nsec = 0;
+
+	if (now)
+		return;
+	if (-1 == clock_gettime(CLOCK_REALTIME, &cur))
+		ts->tv_sec = 1;
+	else
+		ts->tv_nsec = 1000000000L - cur.tv_nsec;
+}
+
+#if HAVE_KQUEUE
+
+/*
+ * Queue a change to be submitted with our next kevent(2).
+ * Returns zero on memory exhaustion, non-zero on success.
+ */
+static int
+change_add(struct events *ev, uintptr_t ident, 
+	short filter, u_short flags, int64_t data, size_t slot)
+{
+	void	*pp;
+	size_t	 max;
+
+	if (ev->chsz == ev->chmax) {
+		max = 0 == ev->chmax ? 64 : ev->chmax * 2;
+		pp = reallocarray(ev->chs, max, sizeof(struct kevent));
+		if (NULL == pp)
+			return 0;
+		ev->chs = pp;
+		ev->chmax = max;
+	}
+
+	EV_SET(&ev->chs[ev->chsz], ident, filter, 
+		flags, 0, data, (void *)(uintptr_t)slot);
+	ev->chsz++;
+	return 1;
+}
+
+struct events *
+events_alloc(struct pollfd *pfds, size_t sz, const sigset_t *sigs)
+{
+	struct events	*ev;
+	int		 i;
+
+	if (NULL == (ev = calloc(1, sizeof(struct events))))
+		return NULL;
+
+	ev->kq = -1;
+	ev->pfds = pfds;
+	ev->sz = sz;
+	ev->sigs = *sigs;
+	ev->when = calloc(sz, sizeof(time_t));
+	ev->ready = calloc(sz, sizeof(size_t));
+	ev->now = calloc(sz, sizeof(size_t));
+	ev->nowmark = calloc(sz, 1);
+	ev->mark = calloc(sz, 1);
+	ev->evmax = 2 * sz + NSIG;
+	ev->evs = calloc(ev->evmax, sizeof(struct kevent));
+
+	if (NULL == ev->when || NULL == ev->ready || 
+	    NULL == ev->now || NULL == ev->nowmark ||
+	    NULL == ev->mark || NULL == ev->evs)
+		goto err;
+	if (-1 == (ev->kq = kqueue()))
+		goto err;
+
+	/* 
+	 * Our signals are blocked, so they're delivered here instead
+	 * of to their handlers.
+	 */
+
+	for (i = 1; i < NSIG; i++)
+		if (sigismember(sigs, i) &&
+		    ! change_add(ev, i, EVFILT_SIGNAL, EV_ADD, 0, 0))
+			goto err;
+
+	return ev;
+err:
+	events_free(ev);
+	return NULL;
+}
+
+void
+events_free(struct events *ev)
+{
+
+	if (NULL == ev)
+		return;
+	if (-1 != ev->kq)
+		close(ev->kq);
+	free(ev->when);
+	free(ev->ready);
+	free(ev->now);
+	free(ev->nowmark);
+	free(ev->mark);
+	free(ev->chs);
+	free(ev->evs);
+	free(ev);
+}
+
+/*
+ * Bring the kqueue(2) into line with a slot's descriptor and deadline.
+ * Descriptor filters are one-shot and re-added each time: this way, we
+ * needn't track when descriptors are closed (or closed and re-opened
+ * with the same number).
+ * Expired deadlines are put directly on our ready list.
+ * Returns zero on memory exhaustion, non-zero on success.
+ */
+int
+events_set(struct events *ev, size_t slot, time_t when)
+{
+	struct pollfd	*pfd = &ev->pfds[slot];
+	struct timespec	 cur;
+	int64_t		 ms;
+
+	if (-1 != pfd->fd && (POLLIN & pfd->events) &&
+	    ! change_add(ev, pfd->fd, EVFILT_READ, 
+		    EV_ADD|EV_ONESHOT, 0, slot))
+		return 0;
+	if (-1 != pfd->fd && (POLLOUT & pfd->events) &&
+	    ! change_add(ev, pfd->fd, EVFILT_WRITE, 
+		    EV_ADD|EV_ONESHOT, 0, slot))
+		return 0;
+
+	if (when == ev->when[slot])
+		return 1;
+
+	/* Disarm any timer we had before. */
+
+	if (ev->when[slot] && 
+	    ! change_add(ev, slot, EVFILT_TIMER, EV_DELETE, 0, slot))
+		return 0;
+
+	if (0 == (ev->when[slot] = when))
+		return 1;
+
+	if (-1 == clock_gettime(CLOCK_REALTIME, &cur))
+		return 0;
+
+	/* 
+	 * Expired deadlines are handed out by our next wait.
+	 * A slot may be set again before then, but it's only queued
+	 * once.
+	 */
+
+	if (when <= cur.tv_sec) {
+		ev->when[slot] = 0;
+		if (ev->nowmark[slot])
+			return 1;
+		assert(ev->nowsz < ev->sz);
+		ev->nowmark[slot] = 1;
+		ev->now[ev->nowsz++] = slot;
+		return 1;
+	}
+
+	/* Round up so that we never fire early. */
+
+	ms = (int64_t)(when - cur.tv_sec) * 1000 -
+		cur.tv_nsec / 1000000;
+	return change_add(ev, slot, EVFILT_TIMER, 
+		EV_ADD|EV_ONESHOT, ms, slot);
+}
+
+/*
+ * Submit our pending changes and wait for events.
+ * Descriptor events have their "revents" filled in as if by poll(2).
+ * Our signals stay blocked, so their handlers are run from here, as if
+ * they'd been delivered while waiting.
+ * Returns <0 on failure, 0 if one of our signals was caught, >0 with
+ * the ready slots.
+ * Either way (but for failure), the ready slots are filled in.
+ */
+int
+events_wait(struct events *ev, const size_t **ready, size_t *readysz)
+{
+	struct timespec	 ts;
+	struct kevent	*ke;
+	struct pollfd	*pfd;
+	struct sigaction sa;
+	size_t		 i, slot, max;
+	int		 c, sig = 0;
+	void		*pp;
+
+	ready_reset(ev);
+	wait_timeout(ev->nowsz > 0, &ts);
+
+	/* Make room for any errors from our changes. */
+
+	if (ev->evmax < ev->chsz + 2 * ev->sz + NSIG) {
+		max = ev->chsz + 2 * ev->sz + NSIG;
+		pp = reallocarray(ev->evs, max, sizeof(struct kevent));
+		if (NULL == pp)
+			return -1;
+		ev->evs = pp;
+		ev->evmax = max;
+	}
+
+	c = kevent(ev->kq, ev->chs, ev->chsz, ev->evs, ev->evmax, &ts);
+	if (-1 == c && EINTR != errno)
+		return -1;
+
+	ev->chsz = 0;
+
+	for (i = 0; i < ev->nowsz; i++) {
+		ev->nowmark[ev->now[i]] = 0;
+		ready_add(ev, ev->now[i]);
+	}
+	ev->nowsz = 0;
+
+	for (i = 0; c > 0 && i < (size_t)c; i++) {
+		ke = &ev->evs[i];
+		if (EV_ERROR & ke->flags)
+			continue;
+		if (EVFILT_SIGNAL == ke->filter) {
+			if (-1 != sigaction((int)ke->ident, NULL, &sa) &&
+			    SIG_DFL != sa.sa_handler &&
+			    SIG_IGN != sa.sa_handler)
+				sa.sa_handler((int)ke->ident);
+			sig = 1;
+			continue;
+		}
+
+		slot = (uintptr_t)ke->udata;
+		assert(slot < ev->sz);
+		pfd = &ev->pfds[slot];
+
+		if (EVFILT_TIMER == ke->filter) {
+			ev->when[slot] = 0;
+			ready_add(ev, slot);
+			continue;
+		}
+
+		/* Stale events on an old descriptor. */
+
+		if ((int)ke->ident != pfd->fd)
+			continue;
+
+		if (EVFILT_READ == ke->filter)
+			pfd->revents |= POLLIN & pfd->events;
+		else if (EVFILT_WRITE == ke->filter)
+			pfd->revents |= (POLLOUT & pfd->events) |
+				((EV_EOF & ke->flags) ? POLLHUP : 0);
+
+		if (pfd->revents)
+			ready_add(ev, slot);
+	}
+
+	*ready = ev->ready;
+	*readysz = ev->readysz;
+	return sig ? 0 : 1;
+}
+
+#else /* ! HAVE_KQUEUE */
+
+static void
+timers_swap(struct events *ev, size_t i, size_t j)
+{
+	struct timer	 tmp;
+
+	tmp = ev->ents[i];
+	ev->ents[i] = ev->ents[j];
+	ev->ents[j] = tmp;
+}
+
+/*
+ * Add a timer to our min-heap.
+ * Returns zero on memory exhaustion, non-zero on success.
+ */
+static int
+timers_push(struct events *ev, time_t when, size_t slot)
+{
+	void	*pp;
+	size_t	 i, max;
+
+	if (ev->entsz == ev->entmax) {
+		max = 0 == ev->entmax ? 64 : ev->entmax * 2;
+		pp = reallocarray(ev->ents, max, sizeof(struct timer));
+		if (NULL == pp)
+			return 0;
+		ev->ents = pp;
+		ev->entmax = max;
+	}
+
+	i = ev->entsz++;
+	ev->ents[i].when = when;
+	ev->ents[i].slot = slot;
+
+	while (i > 0 && ev->ents[(i - 1) / 2].when > ev->ents[i].when) {
+		timers_swap(ev, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	return 1;
+}
+
+/*
+ * Remove the earliest timer from the min-heap.
+ */
+static void
+timers_pop(struct events *ev)
+{
+	size_t	 i = 0, c;
+
+	assert(ev->entsz > 0);
+	ev->ents[0] = ev->ents[--ev->entsz];
+
+	for (;;) {
+		c = 2 * i + 1;
+		if (c >= ev->entsz)
+			break;
+		if (c + 1 < ev->entsz && 
+		    ev->ents[c + 1].when < ev->ents[c].when)
+			c++;
+		if (ev->ents[i].when <= ev->ents[c].when)
+			break;
+		timers_swap(ev, i, c);
+		i = c;
+	}
+}
+
+struct events *
+events_alloc(struct pollfd *pfds, size_t sz, const sigset_t *sigs)
+{
+	struct events	*ev;
+	int		 i;
+
+	if (NULL == (ev = calloc(1, sizeof(struct events))))
+		return NULL;
+
+	ev->pfds = pfds;
+	ev->sz = sz;
+	ev->sigs = *sigs;
+	ev->when = calloc(sz, sizeof(time_t));
+	ev->ready = calloc(sz, sizeof(size_t));
+	ev->mark = calloc(sz, 1);
+
+	if (NULL == ev->when || NULL == ev->ready || NULL == ev->mark)
+		goto err;
+
+	/* Our signals are unblocked only while we wait. */
+
+	if (-1 == sigprocmask(SIG_BLOCK, NULL, &ev->waitmask))
+		goto err;
+	for (i = 1; i < NSIG; i++)
+		if (sigismember(sigs, i) &&
+		    -1 == sigdelset(&ev->waitmask, i))
+			goto err;
+
+	return ev;
+err:
+	events_free(ev);
+	return NULL;
+}
+
+void
+events_free(struct events *ev)
+{
+
+	if (NULL == ev)
+		return;
+	free(ev->when);
+	free(ev->ready);
+	free(ev->mark);
+	free(ev->ents);
+	free(ev);
+}
+
+/*
+ * Set the deadline of a slot.
+ * Descriptors are passed wholesale to ppoll(2), so we needn't do
+ * anything for them.
+ * Superseded timers aren't removed from the heap: when popped, ones not
+ * matching the slot's current deadline are simply ignored.
+ * Returns zero on memory exhaustion, non-zero on success.
+ */
+int
+events_set(struct events *ev, size_t slot, time_t when)
+{
+
+	if (when == ev->when[slot])
+		return 1;
+	if (0 == (ev->when[slot] = when))
+		return 1;
+	return timers_push(ev, when, slot);
+}
+
+/*
+ * Wait for descriptor events or expired deadlines.
+ * Returns <0 on failure, 0 if one of our signals was caught, >0 with
+ * the ready slots.
+ * Either way (but for failure), the ready slots are filled in: if
+ * interrupted, there are none, and any expired deadlines are delivered
+ * by the next wait.
+ */
+int
+events_wait(struct events *ev, const size_t **ready, size_t *readysz)
+{
+	struct timespec	 ts;
+	size_t		 i;
+	time_t		 now;
+
+	ready_reset(ev);
+
+	now = time(NULL);
+	wait_timeout(ev->entsz > 0 && 
+		ev->ents[0].when <= now, &ts);
+
+	if (ppoll(ev->pfds, ev->sz, &ts, &ev->waitmask) < 0) {
+		if (EINTR != errno)
+			return -1;
+		*ready = ev->ready;
+		*readysz = 0;
+		return 0;
+	}
+
+	for (i = 0; i < ev->sz; i++)
+		if (ev->pfds[i].revents)
+			ready_add(ev, i);
+
+	now = time(NULL);
+	while (ev->entsz > 0 && ev->ents[0].when <= now) {
+		i = ev->ents[0].slot;
+		if (ev->ents[0].when == ev->when[i]) {
+			ev->when[i] = 0;
+			ready_add(ev, i);
+		}
+		timers_pop(ev);
+	}
+
+	/* Drop superseded timers if they've accumulated. */
+
+	if (ev->entsz > 4 * ev->sz) {
+		ev->entsz = 0;
+		for (i = 0; i < ev->sz; i++)
+			if (ev->when[i] && 
+			    ! timers_push(ev, ev->when[i], i))
+				return -1;
+	}
+
+	*ready = ev->ready;
+	*readysz = ev->readysz;
+	return 1;
+}
+
+#endif /* HAVE_KQUEUE */
@@ -0,0 +1,39 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef SLANT_EVENT_H
+#define SLANT_EVENT_H
+
+/*
+ * Event backend for the poller.
+ * Nodes are known by their "slot", the index of their descriptor in the
+ * poll array given at allocation.
+ * Both ppoll(2) and kqueue(2) backends exist: the former is the portable
+ * fallback, the latter is selected with HAVE_KQUEUE.
+ * Requires <signal.h> for sigset_t.
+ */
+struct	events;
+
+__BEGIN_DECLS
+
+struct events	*events_alloc(struct pollfd *, size_t, const sigset_t *);
+void		 events_free(struct events *);
+int		 events_set(struct events *, size_t, time_t);
+int		 events_wait(struct events *, const size_t **, size_t *);
+
+__END_DECLS
+
+#endif /* ! SLANT_EVENT_H */
@@ -0,0 +1,430 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * A synthetic fleet of slant-cgi(8) hosts for benchmarking slant(1)
+ * without touching production.
+ * Each host is a path on one local HTTP/1.1 server, which answers with
+ * a full JSON document shaped like that of slant-cgi(8), with the
+ * records of a host that's been collecting for a long time.
+ * Bodies are generated once, so serving them costs us very little.
+ */
+
+/*
+ * Query buffer per client: requests are small.
+ */
+#define	FLEET_RBUF 4096
+
+/*
+ * Records per interval, as in the slant-collectd(8) backlog, with the
+ * interval span and samples per record.
+ */
+static	const struct {
+	const char	*name;
+	size_t		 count;
+	time_t		 span;
+	int64_t		 entries;
+} ivals[] = {
+	{ "qmin", 40, 15, 1 },
+	{ "min", 300, 60, 4 },
+	{ "hour", 120, 60 * 60, 4 * 60 },
+	{ "day", 28, 60 * 60 * 24, 4 * 60 * 24 },
+	{ "week", 104, 60 * 60 * 24 * 7, 4 * 60 * 24 * 7 },
+	{ "year", 2, 60 * 60 * 24 * 365, 4 * 60 * 24 * 365 },
+};
+
+struct	body {
+	char		*buf; /* response body */
+	size_t		 sz; /* length of buf */
+};
+
+struct	client {
+	char		 rbuf[FLEET_RBUF]; /* unanswered requests */
+	size_t		 rbufsz; /* length of rbuf */
+	char		 head[128]; /* response header */
+	size_t		 headsz; /* length of head */
+	const struct body *body; /* response body (or NULL) */
+	size_t		 wpos; /* written of head and body */
+};
+
+static	volatile sig_atomic_t doexit;
+
+static void
+dosig(int code)
+{
+
+	doexit = 1;
+}
+
+/*
+ * Fill "b" with the document of host "host" at time "t".
+ * Values are random but plausible, and differ between hosts.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+body_gen(struct body *b, size_t host, time_t t)
+{
+	FILE	*f;
+	size_t	 i, j;
+	int64_t	 id = 1, nets;
+	char	*cp;
+
+	if (NULL == (f = open_memstream(&cp, &b->sz))) {
+		warn(NULL);
+		return 0;
+	}
+
+	fprintf(f, "{\"version\":\"" VERSION "\","
+		"\"system\":{\"boot\":%lld,\"id\":1}",
+		(long long)(t - 60 * 60 * 24 * 30 - host));
+
+	for (i = 0; i < sizeof(ivals) / sizeof(ivals[0]); i++) {
+		fprintf(f, ",\"%s\":[", ivals[i].name);
+		for (j = 0; j < ivals[i].count; j++) {
+			nets = ivals[i].entries * arc4random_uniform(50000);
+			fprintf(f, "%s{\"ctime\":%lld,"
+				"\"entries\":%" PRId64 ","
+				"\"cpu\":%g,\"mem\":%g,"
+				"\"nettx\":%" PRId64 ","
+				"\"netrx\":%" PRId64 ","
+				"\"discread\":%" PRId64 ","
+				"\"discwrite\":%" PRId64 ","
+				"\"nprocs\":%g,\"rprocs\":%g,"
+				"\"nfiles\":%g,\"interval\":%zu,"
+				"\"id\":%" PRId64 "}",
+				0 == j ? "" : ",",
+				(long long)(t - j * ivals[i].span),
+				ivals[i].entries,
+				ivals[i].entries *
+				 (arc4random_uniform(10000) / 100.0),
+				ivals[i].entries *
+				 (arc4random_uniform(10000) / 100.0),
+				nets, nets * 3,
+				ivals[i].entries *
+				 (int64_t)arc4random_uniform(100000),
+				ivals[i].entries *
+				 (int64_t)arc4random_uniform(100000),
+				ivals[i].entries *
+				 (arc4random_uniform(1000) / 100.0),
+				(double)ivals[i].entries,
+				ivals[i].entries *
+				 (arc4random_uniform(1000) / 100.0),
+				i, id);
+			id++;
+		}
+		fputc(']', f);
+	}
+
+	fputc('}', f);
+
+	if (ferror(f)) {
+		warn(NULL);
+		fclose(f);
+		free(cp);
+		return 0;
+	} else if (EOF == fclose(f)) {
+		warn(NULL);
+		free(cp);
+		return 0;
+	}
+
+	b->buf = cp;
+	return 1;
+}
+
+/*
+ * Answer the first full request in the client's buffer, if any.
+ * Hosts are requested as "/N" (any query string is ignored).
+ * Returns <0 if the request is malformed, 0 if we need more, >0 if a
+ * response has been prepared.
+ */
+static int
+client_request(struct client *c, const struct body *bodies, size_t bodysz)
+{
+	char		*end, *cp;
+	const char	*er;
+	size_t		 len;
+	long long	 host;
+
+	if (NULL == (end = memmem(c->rbuf, c->rbufsz, "\r\n\r\n", 4)))
+		return c->rbufsz == sizeof(c->rbuf) ? -1 : 0;
+
+	*end = '\0';
+	len = end - c->rbuf + 4;
+
+	if (strncmp(c->rbuf, "GET /", 5))
+		return -1;
+	cp = c->rbuf + 5;
+	cp[strcspn(cp, " ?")] = '\0';
+
+	host = strtonum(cp, 0, LLONG_MAX, &er);
+	c->body = NULL == er && (size_t)host < bodysz ?
+		&bodies[host] : NULL;
+
+	c->headsz = snprintf(c->head, sizeof(c->head),
+		"HTTP/1.1 %s\r\n"
+		"Content-Type: application/json\r\n"
+		"Content-Length: %zu\r\n"
+		"\r\n",
+		NULL == c->body ? "404 Not Found" : "200 OK",
+		NULL == c->body ? 0 : c->body->sz);
+	c->wpos = 0;
+
+	memmove(c->rbuf, c->rbuf + len, c->rbufsz - len);
+	c->rbufsz -= len;
+	return 1;
+}
+
+/*
+ * Write as much of the response as we can.
+ * Returns <0 on failure (close the connection), 0 if there's more to
+ * write, >0 when the response has been written.
+ */
+static int
+client_write(int fd, struct client *c)
+{
+	struct iovec	 iov[2];
+	size_t		 bsz = NULL == c->body ? 0 : c->body->sz;
+	ssize_t		 ssz;
+	int		 i = 0;
+
+	if (c->wpos < c->headsz) {
+		iov[i].iov_base = c->head + c->wpos;
+		iov[i++].iov_len = c->headsz - c->wpos;
+		if (bsz) {
+			iov[i].iov_base = c->body->buf;
+			iov[i++].iov_len = bsz;
+		}
+	} else {
+		iov[i].iov_base = c->body->buf + (c->wpos - c->headsz);
+		iov[i++].iov_len = bsz - (c->wpos - c->headsz);
+	}
+
+	if (-1 == (ssz = writev(fd, iov, i)))
+		return EAGAIN == errno ? 0 : -1;
+
+	c->wpos += ssz;
+	return c->wpos == c->headsz + bsz;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int		 c, fd, one = 1, rc;
+	size_t		 i, j, hosts = 100, pfdsz, pfdmax;
+	unsigned short	 port = 8080;
+	time_t		 waittime = 15, t = time(NULL);
+	const char	*er;
+	struct sockaddr_in sin;
+	struct body	*bodies;
+	struct client	*clients = NULL;
+	struct pollfd	*pfds = NULL;
+	ssize_t		 ssz;
+	void		*pp;
+
+	while (-1 != (c = getopt(argc, argv, "n:p:w:")))
+		switch (c) {
+		case 'n':
+			hosts = strtonum(optarg, 1, INT_MAX, &er);
+			if (NULL != er)
+				errx(EXIT_FAILURE, "-n: %s", er);
+			break;
+		case 'p':
+			port = strtonum(optarg, 1, USHRT_MAX, &er);
+			if (NULL != er)
+				errx(EXIT_FAILURE, "-p: %s", er);
+			break;
+		case 'w':
+			waittime = strtonum(optarg, 15, INT_MAX, &er);
+			if (NULL != er)
+				errx(EXIT_FAILURE, "-w: %s", er);
+			break;
+		default:
+			goto usage;
+		}
+
+	if (SIG_ERR == signal(SIGINT, dosig) ||
+	    SIG_ERR == signal(SIGTERM, dosig) ||
+	    SIG_ERR == signal(SIGPIPE, SIG_IGN))
+		err(EXIT_FAILURE, "signal");
+
+	if (NULL == (bodies = calloc(hosts, sizeof(struct body))))
+		err(EXIT_FAILURE, NULL);
+	for (i = 0; i < hosts; i++)
+		if ( ! body_gen(&bodies[i], i, t))
+			return EXIT_FAILURE;
+
+	if (-1 == (fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)))
+		err(EXIT_FAILURE, "socket");
+	if (-1 == setsockopt(fd, SOL_SOCKET,
+	    SO_REUSEADDR, &one, sizeof(one)))
+		err(EXIT_FAILURE, "setsockopt");
+
+	memset(&sin, 0, sizeof(struct sockaddr_in));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (-1 == bind(fd, (struct sockaddr *)&sin, sizeof(sin)))
+		err(EXIT_FAILURE, "bind");
+	if (-1 == listen(fd, SOMAXCONN))
+		err(EXIT_FAILURE, "listen");
+
+	if (-1 == pledge("stdio inet", NULL))
+		err(EXIT_FAILURE, "pledge");
+
+	/*
+	 * Tell our caller how to reach us by way of a slant(1)
+	 * configuration file.
+	 */
+
+	printf("waittime %lld ;\nservers\n", (long long)waittime);
+	for (i = 0; i < hosts; i++)
+		printf("  http://127.0.0.1:%hu/%zu\n", port, i);
+	puts("  ;");
+	if (EOF == fflush(stdout))
+		err(EXIT_FAILURE, "stdout");
+
+	/* The first descriptor is for listening. */
+
+	pfdmax = 64;
+	pfds = calloc(pfdmax, sizeof(struct pollfd));
+	clients = calloc(pfdmax, sizeof(struct client));
+	if (NULL == pfds || NULL == clients)
+		err(EXIT_FAILURE, NULL);
+
+	pfds[0].fd = fd;
+	pfds[0].events = POLLIN;
+	pfdsz = 1;
+
+	while ( ! doexit) {
+		if (-1 == poll(pfds, pfdsz, INFTIM)) {
+			if (EINTR == errno)
+				continue;
+			err(EXIT_FAILURE, "poll");
+		}
+
+		for (i = 1; i < pfdsz; i++) {
+			if (0 == pfds[i].revents)
+				continue;
+			rc = 1;
+			if (POLLIN & pfds[i].revents) {
+				ssz = read(pfds[i].fd,
+					clients[i].rbuf + clients[i].rbufsz,
+					sizeof(clients[i].rbuf) -
+					clients[i].rbufsz);
+				if (ssz <= 0)
+					rc = -1;
+				else
+					clients[i].rbufsz += ssz;
+			} else if (POLLOUT & pfds[i].revents) {
+				if ((rc = client_write
+				    (pfds[i].fd, &clients[i])) > 0)
+					pfds[i].events = POLLIN;
+			} else
+				rc = -1;
+
+			/* Answer pipelined requests as well. */
+
+			if (rc > 0 && POLLIN == pfds[i].events) {
+				rc = client_request(&clients[i],
+					bodies, hosts);
+				if (rc > 0)
+					pfds[i].events = POLLOUT;
+			}
+
+			if (rc >= 0)
+				continue;
+			close(pfds[i].fd);
+			pfds[i].fd = -1;
+		}
+
+		/* Compact out closed connections. */
+
+		for (i = j = 1; i < pfdsz; i++) {
+			if (-1 == pfds[i].fd)
+				continue;
+			if (i != j) {
+				pfds[j] = pfds[i];
+				clients[j] = clients[i];
+			}
+			j++;
+		}
+		pfdsz = j;
+
+		if ( ! (POLLIN & pfds[0].revents))
+			continue;
+
+		while (-1 != (c = accept4(fd, NULL, NULL, SOCK_NONBLOCK))) {
+			if (pfdsz == pfdmax) {
+				pp = reallocarray(pfds,
+					pfdmax * 2, sizeof(struct pollfd));
+				if (NULL == pp)
+					err(EXIT_FAILURE, NULL);
+				pfds = pp;
+				pp = reallocarray(clients,
+					pfdmax * 2, sizeof(struct client));
+				if (NULL == pp)
+					err(EXIT_FAILURE, NULL);
+				clients = pp;
+				pfdmax *= 2;
+			}
+			memset(&clients[pfdsz], 0, sizeof(struct client));
+			pfds[pfdsz].fd = c;
+			pfds[pfdsz].events = POLLIN;
+			pfds[pfdsz].revents = 0;
+			pfdsz++;
+		}
+
+		if (EAGAIN != errno && EWOULDBLOCK != errno &&
+		    ECONNABORTED != errno && EINTR != errno)
+			err(EXIT_FAILURE, "accept4");
+	}
+
+	for (i = 1; i < pfdsz; i++)
+		close(pfds[i].fd);
+	close(fd);
+	for (i = 0; i < hosts; i++)
+		free(bodies[i].buf);
+	free(bodies);
+	free(clients);
+	free(pfds);
+	return EXIT_SUCCESS;
+usage:
+	fprintf(stderr, "usage: %s "
+		"[-n hosts] "
+		"[-p port] "
+		"[-w waittime]\n", getprogname());
+	return EXIT_FAILURE;
+}
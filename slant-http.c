@@ -30,10 +30,188 @@
 #include <time.h>
 #include <tls.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "extern.h"
 #include "slant.h"
 
+/*
+ * Initial size of the read buffer, which is kept between responses.
+ */
+#define	HTTP_RBUF_INIT (1024 * 16)
+
+/*
+ * Never read into less than this many free bytes.
+ */
+#define	HTTP_READ_MIN 1024
+
+/*
+ * Largest body size we'll allocate up-front from its Content-Length.
+ */
+#define	HTTP_RBUF_PRESIZE (1024 * 1024 * 16)
+
+static	const char *const phases[PHASE__MAX] = {
+	"dns", /* PHASE_DNS */
+	"connect", /* PHASE_CONNECT */
+	"tls", /* PHASE_TLS */
+	"ttfb", /* PHASE_TTFB */
+	"body", /* PHASE_BODY */
+};
+
+/*
+ * Bucket of the latency histogram for "ms" milliseconds.
+ */
+static size_t
+latency_bucket(double ms)
+{
+	size_t	 b;
+	double	 lim;
+
+	for (b = 0, lim = 1.0; b < LATENCY_BUCKETS - 1 && ms >= lim; b++)
+		lim *= 2.0;
+	return b;
+}
+
+/*
+ * Time of phase "ph" in the last poll in milliseconds, or <0 if there
+ * are no polls or it didn't have the phase.
+ */
+double
+latency_last(const struct latency *l, enum phase ph)
+{
+
+	if (0 == l->sz)
+		return -1.0;
+	return l->ring[(l->pos + LATENCY_HIST - 1) % LATENCY_HIST][ph];
+}
+
+/*
+ * The "pct" percentile of phase "ph" over the history in milliseconds,
+ * rounded up to its histogram bucket, or <0 if no poll had the phase.
+ * Times in the last (open) bucket are given as the worst of them.
+ */
+double
+latency_pct(const struct latency *l, enum phase ph, size_t pct)
+{
+	size_t	 i, sz, want, sum;
+	double	 max;
+
+	for (sz = i = 0; i < LATENCY_BUCKETS; i++)
+		sz += l->hist[ph][i];
+	if (0 == sz)
+		return -1.0;
+
+	if (0 == (want = (sz * pct + 99) / 100))
+		want = 1;
+	for (sum = i = 0; i < LATENCY_BUCKETS - 1; i++)
+		if ((sum += l->hist[ph][i]) >= want)
+			return (double)(1U << i);
+
+	for (max = 0.0, i = 0; i < l->sz; i++)
+		if (l->ring[i][ph] > max)
+			max = l->ring[i][ph];
+	return max;
+}
+
+/*
+ * Start timing a poll at phase "ph", forgetting any times of this and
+ * later phases.
+ * Starting with PHASE_DNS forgets them all.
+ */
+void
+http_phase_start(struct node *n, enum phase ph)
+{
+	size_t	 i;
+
+	for (i = ph; i < PHASE__MAX; i++)
+		n->xfer.phases[i] = -1.0;
+	n->xfer.phase = ph;
+	bench_start(&n->xfer.mark);
+}
+
+/*
+ * Finish timing the current phase (if any) and start timing "next",
+ * which may be PHASE__MAX to stop timing.
+ */
+void
+http_phase(struct node *n, enum phase next)
+{
+
+	if (PHASE__MAX != n->xfer.phase)
+		n->xfer.phases[n->xfer.phase] =
+			bench_stop(&n->xfer.mark) / 1e3;
+	n->xfer.phase = next;
+	if (PHASE__MAX != next)
+		bench_start(&n->xfer.mark);
+}
+
+/*
+ * Stop timing, forgetting the times of this poll.
+ */
+static void
+http_phase_reset(struct node *n)
+{
+
+	http_phase_start(n, PHASE_DNS);
+	n->xfer.phase = PHASE__MAX;
+}
+
+/*
+ * A poll has succeeded: add its phases to the node's history and, if
+ * so configured, log them.
+ */
+static void
+http_phase_done(struct out *out, struct node *n)
+{
+	struct latency	*l = &n->latency;
+	double		*v;
+	size_t		 i;
+	char		 buf[32];
+	time_t		 t = time(NULL);
+
+	http_phase(n, PHASE__MAX);
+
+	/* Held requests would only show the hold time. */
+
+	if (n->xfer.longpolled) {
+		http_phase_reset(n);
+		return;
+	}
+
+	/* Evict the oldest sample from the histogram. */
+
+	v = l->ring[l->pos];
+	if (LATENCY_HIST == l->sz) {
+		for (i = 0; i < PHASE__MAX; i++)
+			if (v[i] >= 0.0)
+				l->hist[i][latency_bucket(v[i])]--;
+	} else
+		l->sz++;
+
+	for (i = 0; i < PHASE__MAX; i++) {
+		v[i] = n->xfer.phases[i];
+		if (v[i] >= 0.0)
+			l->hist[i][latency_bucket(v[i])]++;
+	}
+	l->pos = (l->pos + 1) % LATENCY_HIST;
+	n->dirty = 1;
+
+	if (out->latencylog) {
+		strftime(buf, sizeof(buf), "%F %T", localtime(&t));
+		fprintf(out->errs, "%s: Latency: %s:", buf, n->host);
+		for (i = 0; i < PHASE__MAX; i++)
+			if (v[i] < 0.0)
+				fprintf(out->errs, " %s -", phases[i]);
+			else
+				fprintf(out->errs, " %s %.1f", 
+					phases[i], v[i]);
+		fputs(" ms\n", out->errs);
+		fflush(out->errs);
+	}
+
+	http_phase_reset(n);
+}
+
 /*
  * Close out a connection (its file descriptor).
  * This is sensitive to whether we're https (tls_close) or not.
@@ -65,12 +243,47 @@ http_close_inner(WINDOW *errwin, struct node *n)
 	return 1;
 }
 
+/*
+ * Close a connection without waiting for the TLS close to complete.
+ * This is used when the server has already closed its end of a
+ * kept-alive connection, so there's nobody to wait for.
+ */
+static void
+http_close_now(struct node *n)
+{
+
+	if (n->addrs.https)
+		(void)tls_close(n->xfer.tls);
+	close(n->xfer.pfd->fd);
+	n->xfer.pfd->fd = -1;
+}
+
+/*
+ * A kept-alive connection was closed by the server before answering
+ * our request.
+ * This is expected, as servers time out idle connections as they
+ * please, so reconnect immediately instead of waiting.
+ * Returns non-zero (never fails).
+ */
+static int
+http_reconnect(struct out *out, struct node *n)
+{
+
+	xdbg(out, "keep-alive closed by server: %s", n->host);
+	http_close_now(n);
+	n->state = STATE_CONNECT_READY;
+	return 1;
+}
+
 int
 http_close_err(struct out *out, struct node *n)
 {
 	int	 c;
 
+	http_phase_reset(n);
+
 	if (0 != (c = http_close_inner(out->errwin, n))) {
+		n->addrs.fails++;
 		n->addrs.curaddr = 
 			(n->addrs.curaddr + 1) % n->addrs.addrsz;
 		n->state = STATE_CONNECT_WAITING;
@@ -82,31 +295,40 @@ http_close_err(struct out *out, struct node *n)
 	return 1;
 }
 
+/*
+ * Act upon a response that's been fully read (or the connection
+ * closed before it was): make sure it's a complete, well-formed HTTP
+ * 200 response and, if so, have the workers decode the body.
+ * A 304 response to our validator means our records are current.
+ * Returns zero on system failure, non-zero on success.
+ */
 static int
-http_close_done_ok(struct out *out, struct node *n)
+http_response(struct out *out, struct node *n)
 {
-	char	*end, *sv, *start = n->xfer.rbuf;
-	size_t	 len, sz = n->xfer.rbufsz;
-	int	 rc, httpok = 0;
-	time_t	 t = time(NULL);
+	int		 rc;
+	time_t		 t = time(NULL);
 
-	n->state = STATE_CONNECT_WAITING;
-	n->waitstart = t;
-
-	while (NULL != (end = memmem(start, sz, "\r\n", 2))) {
-		sv = start;
-		len = end - start;
-		start = end + 2;
-		sz -= len + 2;
-		if (0 == len)
-			break;
-		else if (len < 13)
-			continue;
-		if (0 == memcmp(sv, "HTTP/1.0 200 ", 13)) 
-			httpok = 1;
-	}
+	/* Any response at all means the address is good. */
+
+	if (0 != n->xfer.hdrsz)
+		n->addrs.fails = 0;
 
-	if ( ! httpok) {
+	if (n->xfer.done && n->xfer.validated &&
+	    304 == n->xfer.code) {
+		/* Our records are current. */
+		n->lastseen = time(NULL);
+		http_phase_done(out, n);
+		rc = 1;
+		/* Servers not holding requests can't be long-polled. */
+		if (n->xfer.longpolled && 
+		    t - n->xfer.start < n->longpoll / 2) {
+			xwarnx(out, "long-poll not held: %s", n->host);
+			n->longpoll = 0;
+		} else if (n->longpoll)
+			n->nowait = 1;
+	} else if (0 == n->xfer.hdrsz || ! n->xfer.done ||
+	    200 != n->xfer.code || 
+	    (n->xfer.zenc && ! n->xfer.zend)) {
 		xwarnx(out, "bad HTTP response (%lld seconds): "
 			"%s", t - n->xfer.start, n->host);
 		fprintf(out->errs, "------>------\n");
@@ -115,17 +337,49 @@ http_close_done_ok(struct out *out, struct node *n)
 		fprintf(out->errs, "------<------\n");
 		fflush(out->errs);
 		rc = 1;
-	} else if ((rc = json_parse(out, n, start, sz)) > 0) {
-		n->dirty = 1;
-		n->lastseen = time(NULL);
+	} else if (n->decoding) {
+		/* We can't merge against records not yet in place. */
+		xwarnx(out, "response while decoding the "
+			"last: %s", n->host);
+		n->etag[0] = '\0';
+		http_phase_done(out, n);
+		rc = 1;
+	} else {
+		/* 
+		 * Decoding (and the node's new records) are left to
+		 * the workers, which take the body's buffer.
+		 */
+		http_phase_done(out, n);
+		rc = work_submit(n->work, n) ? 1 : -1;
+		if (rc < 0)
+			xwarn(out, NULL);
+		if (n->longpoll)
+			n->nowait = 1;
 	}
 
-	free(n->xfer.rbuf);
-	n->xfer.rbuf = NULL;
+	/* Keep the buffers around for the next response. */
+
 	n->xfer.rbufsz = 0;
+	n->xfer.zbufsz = 0;
 	return rc >= 0;
 }
 
+static int
+http_close_done_ok(struct out *out, struct node *n)
+{
+
+	n->state = STATE_CONNECT_WAITING;
+	n->waitstart = time(NULL);
+
+	/* Read-until-close responses are complete now. */
+
+	if (0 != n->xfer.hdrsz && 
+	    FRAMING_EOF == n->xfer.framing)
+		n->xfer.done = 1;
+
+	return http_response(out, n);
+}
+
 int
 http_close_done(struct out *out, struct node *n)
 {
@@ -139,38 +393,117 @@ http_close_done(struct out *out, struct node *n)
 }
 
 /*
- * Prepare the write buffer. 
+ * Prepare the write buffer with our request and reset the response
+ * parsing state.
+ * We ask for a persistent connection: if the server agrees, the
+ * connection is re-used for subsequent requests.
  * Return zero on failure, non-zero on success.
  */
 static int
-http_write_ready(struct out *out, struct node *n)
+http_request(struct out *out, struct node *n)
 {
 	int	 c;
-
-	if (n->addrs.https) {
-		c = tls_connect_socket(n->xfer.tls, 
-			n->xfer.pfd->fd, n->host);
-		if (c < 0) {
-			xwarnx(out, "tls_connect_socket: %s: %s", 
-				n->host, tls_error(n->xfer.tls));
-		}
-	}
+	char	 qs[128], sep;
+	size_t	 len, i;
+	static const char *const ivs[INTERVALS] = { /* as RECS_QMIN, etc. */
+		"qmin", "min", "hour", "day", "week", "year" };
 
 	n->xfer.wbufsz = n->xfer.wbufpos = 0;
 	free(n->xfer.wbuf);
 	n->xfer.wbuf = NULL;
 
+	/*
+	 * If we already have records, only ask for those that have
+	 * changed since our newest quarter-minute record (unless we now
+	 * want records we don't have).
+	 */
+
+	n->xfer.since = n->refetch ? 0 :
+		recset_ctime(n->recs, INTERVAL_byqmin, 0);
+
+	qs[0] = '\0';
+	sep = NULL == strchr(n->path, '?') ? '?' : '&';
+	if (n->xfer.since) {
+		snprintf(qs, sizeof(qs), "%csince=%lld", 
+			sep, (long long)n->xfer.since);
+		sep = '&';
+	}
+
+	/* 
+	 * Send our validator, if we have one, so the server can tell
+	 * us if nothing's changed.
+	 * If we're long-polling, the server holds our request until
+	 * something has (or its hold time is up).
+	 */
+
+	n->xfer.validated = NULL != n->recs && '\0' != n->etag[0];
+	n->xfer.longpolled = n->xfer.validated && n->longpoll;
+
+	if (n->xfer.longpolled) {
+		len = strlen(qs);
+		snprintf(qs + len, sizeof(qs) - len, "%cwait=%lld",
+			sep, (long long)n->longpoll);
+		sep = '&';
+	}
+
+	/* Only ask for as many records of each interval as we keep. */
+
+	if (n->intervals) {
+		len = strlen(qs);
+		snprintf(qs + len, sizeof(qs) - len, "%cintervals=", sep);
+		for (i = 0, sep = '\0'; i < INTERVALS; i++) {
+			if ( ! ((1U << i) & n->intervals))
+				continue;
+			len = strlen(qs);
+			snprintf(qs + len, sizeof(qs) - len, "%s%s:%zu",
+				'\0' == sep ? "" : ",", ivs[i], n->depth[i]);
+			sep = ',';
+		}
+	}
+
+	/* Servers only send their timings if asked. */
+
+	if (n->timing) {
+		len = strlen(qs);
+		snprintf(qs + len, sizeof(qs) - len, "%ctiming=1", 
+			'\0' == qs[0] ? sep : '&');
+	}
+
 	c = asprintf(&n->xfer.wbuf,
-		"GET %s HTTP/1.0\r\n"
+		"GET %s%s HTTP/1.1\r\n"
 		"Host: %s\r\n"
+		"Connection: keep-alive\r\n"
+		"Accept: application/x-slant, "
+		 "application/json;q=0.5\r\n"
+		"Accept-Encoding: gzip, deflate\r\n"
+		"%s%s%s"
 		"\r\n",
-		n->path, n->host);
+		n->path, qs, n->host, 
+		n->xfer.validated ? "If-None-Match: " : "",
+		n->xfer.validated ? n->etag : "",
+		n->xfer.validated ? "\r\n" : "");
 
 	if (c < 0) {
 		xwarn(out, NULL);
 		return 0;
 	}
 
+	n->xfer.hdrsz = n->xfer.bodysz = n->xfer.rpos = 0;
+	n->xfer.bodyoff = 0;
+	n->xfer.code = 0;
+	n->xfer.framing = FRAMING_EOF;
+	n->xfer.clen = 0;
+	n->xfer.chunkst = CHUNK_SIZE;
+	n->xfer.chunksz = 0;
+	n->xfer.done = 0;
+	n->xfer.keepalive = 0;
+	n->xfer.binary = 0;
+	n->xfer.etag[0] = '\0';
+	n->xfer.zenc = n->xfer.zend = 0;
+	n->xfer.zbufsz = 0;
+	if (NULL != n->xfer.zs)
+		inflateReset(n->xfer.zs);
+
 	n->xfer.wbufsz = c;
 	n->state = STATE_WRITE;
 	if (n->addrs.https)
@@ -180,10 +513,69 @@ http_write_ready(struct out *out, struct node *n)
 	return 1;
 }
 
+/*
+ * Start TLS (if applicable) on a newly-connected socket, then prepare
+ * the write buffer.
+ * Return zero on failure, non-zero on success.
+ */
+static int
+http_write_ready(struct out *out, struct node *n)
+{
+	int	 c;
+
+	http_phase(n, n->addrs.https ? PHASE_TLS : PHASE_TTFB);
+
+	if (n->addrs.https) {
+		c = tls_connect_socket(n->xfer.tls, 
+			n->xfer.pfd->fd, n->host);
+		if (c < 0) {
+			xwarnx(out, "tls_connect_socket: %s: %s", 
+				n->host, tls_error(n->xfer.tls));
+		}
+	}
+
+	return http_request(out, n);
+}
+
+/*
+ * Wait on a kept-alive connection until it's time for the next
+ * request, which is written on the same connection.
+ * If the server closes the connection (or sends us anything at all)
+ * in the meantime, we close our end and fall back to reconnecting
+ * when the wait time expires.
+ * Returns zero on system failure, non-zero on success.
+ */
+int
+http_keepalive(struct out *out, struct node *n)
+{
+
+	assert(-1 != n->xfer.pfd->fd);
+
+	if ((POLLIN | POLLHUP | POLLERR | POLLNVAL) & 
+	    n->xfer.pfd->revents) {
+		xdbg(out, "keep-alive closed: %s", n->host);
+		http_close_now(n);
+		n->state = STATE_CONNECT_WAITING;
+		return 1;
+	}
+
+	if (node_waitend(n) >= time(NULL))
+		return 1;
+
+	n->dirty = 1;
+	n->nowait = 0;
+	n->xfer.reused = 1;
+	n->xfer.start = time(NULL);
+	http_phase_start(n, PHASE_TTFB);
+	return http_request(out, n);
+}
+
 /*
  * Initialise a socket descriptor to the current endpoint.
  * Moves into STATE_CONNECT for async connection, STATE_WRITE on
  * success, or calls http_close_err() on connection failure.
+ * Https nodes without a TLS configuration (see fleet_tls()) instead go
+ * back to waiting.
  * Returns zero on system failure, non-zero on success.
  */
 int
@@ -191,30 +583,30 @@ http_init_connect(struct out *out, struct node *n)
 {
 	int		   family, c, flags;
 	socklen_t	   sslen;
-	struct tls_config *cfg;
 
 	memset(&n->xfer.ss, 0, sizeof(struct sockaddr_storage));
 
-	if (NULL == n->xfer.tls) {
-		if (NULL == (n->xfer.tls = tls_client())) {
-			xwarn(out, "tls_client");
-			return 0;
-		}
-	} else
-		tls_reset(n->xfer.tls);
+	if (n->addrs.https && NULL == n->xfer.tlscfg) {
+		xwarnx(out, "no CA store: %s", n->host);
+		n->state = STATE_CONNECT_WAITING;
+		n->waitstart = time(NULL);
+		return 1;
+	}
 
-	if (NULL != n->xfer.tls) {
-		if (NULL == (cfg = tls_config_new())) {
-			xwarn(out, "tls_config_new");
-			return 0;
-		}
-		tls_config_set_protocols(cfg, TLS_PROTOCOLS_ALL);
-		if (-1 == tls_configure(n->xfer.tls, cfg)) {
+	if (n->addrs.https) {
+		if (NULL == n->xfer.tls) {
+			if (NULL == (n->xfer.tls = tls_client())) {
+				xwarn(out, "tls_client");
+				return 0;
+			}
+		} else
+			tls_reset(n->xfer.tls);
+
+		if (-1 == tls_configure(n->xfer.tls, n->xfer.tlscfg)) {
 			xwarnx(out, "tls_configure: %s: %s", n->host,
 				tls_error(n->xfer.tls));
 			return 0;
 		}
-		tls_config_free(cfg);
 	}
 
 	if (4 == n->addrs.addrs[n->addrs.curaddr].family) {
@@ -268,6 +660,8 @@ http_init_connect(struct out *out, struct node *n)
 
 	n->state = STATE_CONNECT;
 	n->xfer.start = time(NULL);
+	n->xfer.reused = 0;
+	http_phase_start(n, PHASE_CONNECT);
 
 	/* This is from connect(2): asynchronous connection. */
 
@@ -365,6 +759,7 @@ int
 http_write(struct out *out, struct node *n)
 {
 	ssize_t	 ssz;
+	int	 c;
 	time_t	 t = time(NULL);
 
 	assert(-1 != n->xfer.pfd->fd);
@@ -377,6 +772,8 @@ http_write(struct out *out, struct node *n)
 			n->addrs.addrs[n->addrs.curaddr].ip);
 		return 0;
 	} else if (POLLHUP & n->xfer.pfd->revents) {
+		if (n->xfer.reused)
+			return http_reconnect(out, n);
 		xwarnx(out, "poll hup (write): %lld seconds, %s: %s", 
 			t - n->xfer.start, n->host, 
 			n->addrs.addrs[n->addrs.curaddr].ip);
@@ -387,6 +784,29 @@ http_write(struct out *out, struct node *n)
 	     ! (POLLIN & n->xfer.pfd->revents))
 		return 1;
 
+	/*
+	 * Handshake explicitly (tls_write() would do so implicitly)
+	 * so that it's timed on its own.
+	 */
+
+	if (PHASE_TLS == n->xfer.phase) {
+		c = tls_handshake(n->xfer.tls);
+		if (TLS_WANT_POLLOUT == c) {
+			n->xfer.pfd->events = POLLOUT;
+			return 1;
+		} else if (TLS_WANT_POLLIN == c) {
+			n->xfer.pfd->events = POLLIN;
+			return 1;
+		} else if (c < 0) {
+			xwarnx(out, "tls_handshake: %s: %s: %s", 
+				n->host, 
+				n->addrs.addrs[n->addrs.curaddr].ip,
+				tls_error(n->xfer.tls));
+			return 0;
+		}
+		http_phase(n, PHASE_TTFB);
+	}
+
 	if (n->addrs.https) {
 		ssz = tls_write(n->xfer.tls,
 			n->xfer.wbuf + n->xfer.wbufpos, 
@@ -397,6 +817,8 @@ http_write(struct out *out, struct node *n)
 		} else if (TLS_WANT_POLLIN == ssz) {
 			n->xfer.pfd->events = POLLIN;
 			return 1;
+		} else if (ssz < 0 && n->xfer.reused) {
+			return http_reconnect(out, n);
 		} else if (ssz < 0) {
 			xwarnx(out, "tls_write: %s: %s: %s", 
 				n->host, 
@@ -407,6 +829,9 @@ http_write(struct out *out, struct node *n)
 	} else {
 		ssz = write(n->xfer.pfd->fd, n->xfer.wbuf + 
 			n->xfer.wbufpos, n->xfer.wbufsz);
+		if (ssz < 0 && n->xfer.reused &&
+		    (EPIPE == errno || ECONNRESET == errno))
+			return http_reconnect(out, n);
 		if (ssz < 0) {
 			xwarn(out, "write: %s: %s", n->host, 
 				n->addrs.addrs[n->addrs.curaddr].ip);
@@ -422,8 +847,6 @@ http_write(struct out *out, struct node *n)
 	free(n->xfer.wbuf);
 	n->xfer.wbuf = NULL;
 	n->state = STATE_READ;
-	free(n->xfer.rbuf);
-	n->xfer.rbuf = NULL;
 	n->xfer.rbufsz = 0;
 	if (n->addrs.https)
 		n->xfer.pfd->events = POLLOUT|POLLIN;
@@ -432,18 +855,373 @@ http_write(struct out *out, struct node *n)
 	return 1;
 }
 
+/*
+ * If the header line "cp" of length "sz" is named "name", return a
+ * pointer to its value with surrounding white-space stripped, setting
+ * the value's length in "valsz".
+ * Otherwise, return NULL.
+ */
+static const char *
+http_head_value(const char *cp, size_t sz, 
+	const char *name, size_t *valsz)
+{
+	size_t	 nsz = strlen(name);
+
+	if (sz <= nsz || ':' != cp[nsz] || 
+	    strncasecmp(cp, name, nsz))
+		return NULL;
+
+	cp += nsz + 1;
+	sz -= nsz + 1;
+	while (sz > 0 && (' ' == cp[0] || '\t' == cp[0])) {
+		cp++;
+		sz--;
+	}
+	while (sz > 0 && (' ' == cp[sz - 1] || '\t' == cp[sz - 1]))
+		sz--;
+
+	*valsz = sz;
+	return cp;
+}
+
+/*
+ * Parse an unsigned number in base "base" from the "sz"-long "cp",
+ * stopping at the first non-digit.
+ * Returns zero on failure (no digits, overflow), non-zero on success.
+ */
+static int
+http_parse_size(const char *cp, size_t sz, int base, size_t *res)
+{
+	size_t	 i, v, d;
+
+	for (*res = 0, i = 0; i < sz; i++) {
+		if (cp[i] >= '0' && cp[i] <= '9')
+			d = cp[i] - '0';
+		else if (16 == base && cp[i] >= 'a' && cp[i] <= 'f')
+			d = cp[i] - 'a' + 10;
+		else if (16 == base && cp[i] >= 'A' && cp[i] <= 'F')
+			d = cp[i] - 'A' + 10;
+		else
+			break;
+		v = *res * base + d;
+		if (v / base != *res)
+			return 0;
+		*res = v;
+	}
+
+	return i > 0;
+}
+
+/*
+ * Parse the response headers, if they've been fully read.
+ * This sets the response code and how we'll know when the body has
+ * been read: we can only keep the connection alive if the body has a
+ * known length.
+ * Returns <0 if the headers are not yet complete, 0 if they're
+ * malformed, >0 on success.
+ */
+static int
+http_head(struct node *n)
+{
+	struct xfer	*x = &n->xfer;
+	const char	*cp, *end, *eol, *v;
+	size_t		 vsz, code;
+
+	end = memmem(x->rbuf, x->rbufsz, "\r\n\r\n", 4);
+	if (NULL == end)
+		return -1;
+
+	x->hdrsz = x->rpos = end - x->rbuf + 4;
+
+	/* Status line: "HTTP/1.x NNN reason". */
+
+	if (x->hdrsz < 13 || 
+	    memcmp(x->rbuf, "HTTP/1.", 7) ||
+	    ('0' != x->rbuf[7] && '1' != x->rbuf[7]) ||
+	    ' ' != x->rbuf[8] ||
+	    ! http_parse_size(x->rbuf + 9, 3, 10, &code) ||
+	    ' ' != x->rbuf[12])
+		return 0;
+
+	x->code = code;
+	x->keepalive = '1' == x->rbuf[7];
+	x->framing = FRAMING_EOF;
+
+	/* Responses that never have a body. */
+
+	if (204 == x->code || 304 == x->code) {
+		x->framing = FRAMING_LENGTH;
+		x->clen = 0;
+	}
+
+	cp = memmem(x->rbuf, x->hdrsz, "\r\n", 2) + 2;
+	for ( ; cp < end + 2; cp = eol + 2) {
+		eol = memmem(cp, end + 2 - cp, "\r\n", 2);
+		assert(NULL != eol);
+		v = http_head_value(cp, eol - cp, 
+			"Transfer-Encoding", &vsz);
+		if (NULL != v) {
+			if (vsz >= 7 && 0 == strncasecmp
+			    (v + vsz - 7, "chunked", 7))
+				x->framing = FRAMING_CHUNKED;
+			continue;
+		}
+		v = http_head_value(cp, eol - cp, 
+			"Content-Length", &vsz);
+		if (NULL != v) {
+			if ( ! http_parse_size(v, vsz, 10, &x->clen))
+				return 0;
+			if (FRAMING_EOF == x->framing)
+				x->framing = FRAMING_LENGTH;
+			continue;
+		}
+		v = http_head_value(cp, eol - cp, 
+			"Content-Type", &vsz);
+		if (NULL != v) {
+			x->binary = vsz >= 19 &&
+				0 == strncasecmp(v, 
+				 "application/x-slant", 19) &&
+				(19 == vsz || ';' == v[19] || 
+				 ' ' == v[19]);
+			continue;
+		}
+		v = http_head_value(cp, eol - cp, "ETag", &vsz);
+		if (NULL != v) {
+			/* Ignore validators we can't store. */
+			if (vsz < sizeof(x->etag)) {
+				memcpy(x->etag, v, vsz);
+				x->etag[vsz] = '\0';
+			}
+			continue;
+		}
+		v = http_head_value(cp, eol - cp, 
+			"Content-Encoding", &vsz);
+		if (NULL != v) {
+			if ((4 == vsz && 0 == strncasecmp(v, "gzip", 4)) ||
+			    (6 == vsz && 0 == strncasecmp(v, "x-gzip", 6)) ||
+			    (7 == vsz && 0 == strncasecmp(v, "deflate", 7)))
+				x->zenc = 1;
+			else if ( ! (8 == vsz && 
+			         0 == strncasecmp(v, "identity", 8)))
+				return 0;
+			continue;
+		}
+		v = http_head_value(cp, eol - cp, "Connection", &vsz);
+		if (NULL == v)
+			continue;
+		if (5 == vsz && 0 == strncasecmp(v, "close", 5))
+			x->keepalive = 0;
+		else if (10 == vsz && 
+		         0 == strncasecmp(v, "keep-alive", 10))
+			x->keepalive = 1;
+	}
+
+	if (FRAMING_EOF == x->framing)
+		x->keepalive = 0;
+
+	return 1;
+}
+
+/*
+ * Account for body data newly read into the read buffer.
+ * Chunked bodies are decoded in-place, so the decoded body always
+ * directly follows the headers.
+ * Returns <0 on malformed framing, 0 if more data is expected, >0 if the
+ * body is complete.
+ */
+static int
+http_body(struct node *n)
+{
+	struct xfer	*x = &n->xfer;
+	const char	*cp, *eol;
+	size_t		 len;
+
+	if (FRAMING_EOF == x->framing) {
+		x->bodysz = x->rbufsz - x->hdrsz;
+		return 0;
+	} else if (FRAMING_LENGTH == x->framing) {
+		x->bodysz = x->rbufsz - x->hdrsz;
+		if (x->bodyoff + x->bodysz < x->clen)
+			return 0;
+		/* Trailing garbage: don't re-use connection. */
+		if (x->bodyoff + x->bodysz > x->clen)
+			x->keepalive = 0;
+		x->bodysz = x->clen - x->bodyoff;
+		return 1;
+	}
+
+	while (x->rpos < x->rbufsz && CHUNK_DONE != x->chunkst) {
+		cp = x->rbuf + x->rpos;
+		len = x->rbufsz - x->rpos;
+
+		if (CHUNK_DATA == x->chunkst) {
+			if (len > x->chunksz)
+				len = x->chunksz;
+			memmove(x->rbuf + x->hdrsz + x->bodysz, cp, len);
+			x->bodysz += len;
+			x->rpos += len;
+			x->chunksz -= len;
+			if (0 == x->chunksz)
+				x->chunkst = CHUNK_DATA_END;
+			continue;
+		}
+
+		/* Everything else is line-based. */
+
+		if (NULL == (eol = memmem(cp, len, "\r\n", 2)))
+			break;
+		len = eol - cp;
+		x->rpos += len + 2;
+
+		switch (x->chunkst) {
+		case CHUNK_SIZE:
+			/* Ignore chunk extensions. */
+			if ( ! http_parse_size(cp, len, 16, &x->chunksz))
+				return -1;
+			x->chunkst = 0 == x->chunksz ?
+				CHUNK_TRAILER : CHUNK_DATA;
+			break;
+		case CHUNK_DATA_END:
+			if (0 != len)
+				return -1;
+			x->chunkst = CHUNK_SIZE;
+			break;
+		case CHUNK_TRAILER:
+			if (0 == len)
+				x->chunkst = CHUNK_DONE;
+			break;
+		default:
+			abort();
+		}
+	}
+
+	/* Move undecoded data to directly follow the body. */
+
+	len = x->rbufsz - x->rpos;
+	memmove(x->rbuf + x->hdrsz + x->bodysz, x->rbuf + x->rpos, len);
+	x->rpos = x->hdrsz + x->bodysz;
+	x->rbufsz = x->rpos + len;
+
+	if (CHUNK_DONE != x->chunkst)
+		return 0;
+	if (x->rbufsz > x->rpos)
+		x->keepalive = 0;
+	return 1;
+}
+
+/*
+ * Inflate the decoded body in the read buffer into the inflate buffer,
+ * then remove it from the read buffer.
+ * This way we never hold both the full compressed and inflated body.
+ * Returns <0 on system failure, 0 on malformed data, >0 on success.
+ */
+static int
+http_inflate(struct out *out, struct node *n)
+{
+	struct xfer	*x = &n->xfer;
+	void		*pp;
+	size_t		 sz;
+	int		 rc;
+
+	if (NULL == x->zs) {
+		if (NULL == (x->zs = calloc(1, sizeof(z_stream)))) {
+			xwarn(out, NULL);
+			return -1;
+		}
+		/* Automatically detect gzip and zlib headers. */
+		if (Z_OK != inflateInit2(x->zs, 15 + 32)) {
+			xwarnx(out, "inflateInit2: %s", n->host);
+			free(x->zs);
+			x->zs = NULL;
+			return -1;
+		}
+	}
+
+	x->zs->next_in = (Bytef *)x->rbuf + x->hdrsz;
+	x->zs->avail_in = x->bodysz;
+
+	while (x->zs->avail_in > 0 && ! x->zend) {
+		if (x->zbufsz == x->zbufmax) {
+			sz = 0 == x->zbufmax ? 
+				1024 * 16 : x->zbufmax * 2;
+			if (NULL == (pp = realloc(x->zbuf, sz))) {
+				xwarn(out, NULL);
+				return -1;
+			}
+			x->zbuf = pp;
+			x->zbufmax = sz;
+		}
+		x->zs->next_out = (Bytef *)x->zbuf + x->zbufsz;
+		x->zs->avail_out = x->zbufmax - x->zbufsz;
+		rc = inflate(x->zs, Z_NO_FLUSH);
+		x->zbufsz = x->zbufmax - x->zs->avail_out;
+		if (Z_STREAM_END == rc)
+			x->zend = 1;
+		else if (Z_MEM_ERROR == rc) {
+			xwarnx(out, "inflate: %s", n->host);
+			return -1;
+		} else if (Z_OK != rc && Z_BUF_ERROR != rc) {
+			xwarnx(out, "inflate: %s: %s", n->host, 
+				NULL != x->zs->msg ? 
+				x->zs->msg : "corrupt data");
+			return 0;
+		}
+	}
+
+	/* Discard consumed input (and anything past stream end). */
+
+	memmove(x->rbuf + x->hdrsz, x->rbuf + x->hdrsz + x->bodysz, 
+		x->rbufsz - x->hdrsz - x->bodysz);
+	x->rbufsz -= x->bodysz;
+	x->rpos -= x->bodysz;
+	x->bodyoff += x->bodysz;
+	x->bodysz = 0;
+	return 1;
+}
+
+/*
+ * Make sure there's at least "want" bytes free at the end of the read
+ * buffer, growing it geometrically.
+ * Returns zero on memory exhaustion, non-zero on success.
+ */
+static int
+http_rbuf_reserve(struct out *out, struct node *n, size_t want)
+{
+	struct xfer	*x = &n->xfer;
+	size_t		 sz;
+	void		*pp;
+
+	if (x->rbufmax - x->rbufsz >= want)
+		return 1;
+
+	sz = 0 == x->rbufmax ? HTTP_RBUF_INIT : x->rbufmax * 2;
+	if (sz < x->rbufsz + want)
+		sz = x->rbufsz + want;
+
+	if (NULL == (pp = realloc(x->rbuf, sz))) {
+		xwarn(out, NULL);
+		return 0;
+	}
+	x->rbuf = pp;
+	x->rbufmax = sz;
+	return 1;
+}
+
 /*
  * Read from the file descriptor.
  * Returns zero on system failure, non-zero on success.
- * When the file descriptor has been read, sets state to
+ * When the response has been read, either sets state to
+ * STATE_CONNECT_KEEPALIVE (if the server allows us to reuse the
+ * connection) or closes the connection, which sets state to
  * STATE_CONNECT_WAITING.
  */
 int
 http_read(struct out *out, struct node *n)
 {
 	ssize_t	 ssz;
-	char	 buf[1024 * 5];
-	void	*pp;
+	size_t	 sz;
+	char	*buf;
+	int	 c, zc;
 	time_t	 t = time(NULL);
 
 	assert(STATE_READ == n->state);
@@ -457,6 +1235,8 @@ http_read(struct out *out, struct node *n)
 			n->addrs.addrs[n->addrs.curaddr].ip);
 		return 0;
 	} else if (POLLHUP & n->xfer.pfd->revents) {
+		if (n->xfer.reused && 0 == n->xfer.rbufsz)
+			return http_reconnect(out, n);
 		xwarnx(out, "poll hup (read): %lld seconds, %s: %s", 
 			t - n->xfer.start, n->host, 
 			n->addrs.addrs[n->addrs.curaddr].ip);
@@ -467,16 +1247,25 @@ http_read(struct out *out, struct node *n)
 	     ! (POLLIN & n->xfer.pfd->revents))
 		return 1;
 
-	/* Read into a static buffer. */
+	/* Read directly into the free tail of our buffer. */
+
+	if ( ! http_rbuf_reserve(out, n, HTTP_READ_MIN))
+		return 0;
+
+	buf = n->xfer.rbuf + n->xfer.rbufsz;
+	sz = n->xfer.rbufmax - n->xfer.rbufsz;
 
 	if (n->addrs.https) {
-		ssz = tls_read(n->xfer.tls, buf, sizeof(buf));
+		ssz = tls_read(n->xfer.tls, buf, sz);
 		if (TLS_WANT_POLLOUT == ssz) {
 			n->xfer.pfd->events = POLLOUT;
 			return 1;
 		} else if (TLS_WANT_POLLIN == ssz) {
 			n->xfer.pfd->events = POLLIN;
 			return 1;
+		} else if (ssz < 0 && n->xfer.reused && 
+		           0 == n->xfer.rbufsz) {
+			return http_reconnect(out, n);
 		} else if (ssz < 0) {
 			xwarnx(out, "tls_read: %s: %s: %s", 
 				n->host, 
@@ -485,7 +1274,10 @@ http_read(struct out *out, struct node *n)
 			return 0;
 		}
 	} else {
-		ssz = read(n->xfer.pfd->fd, buf, sizeof(buf));
+		ssz = read(n->xfer.pfd->fd, buf, sz);
+		if (ssz < 0 && n->xfer.reused && 
+		    0 == n->xfer.rbufsz && ECONNRESET == errno)
+			return http_reconnect(out, n);
 		if (ssz < 0) {
 			xwarn(out, "read: %s: %s", n->host, 
 				n->addrs.addrs[n->addrs.curaddr].ip);
@@ -493,19 +1285,77 @@ http_read(struct out *out, struct node *n)
 		}
 	}
 
+	if (0 == ssz && n->xfer.reused && 0 == n->xfer.rbufsz)
+		return http_reconnect(out, n);
 	if (0 == ssz)
 		return http_close_done(out, n);
 
-	/* Copy static into dynamic buffer. */
+	if (PHASE_TTFB == n->xfer.phase)
+		http_phase(n, PHASE_BODY);
 
-	pp = realloc(n->xfer.rbuf, n->xfer.rbufsz + ssz);
-	if (NULL == pp) {
-		xwarn(out, NULL);
-		return 0;
-	}
-	n->xfer.rbuf = pp;
-	memcpy(n->xfer.rbuf + n->xfer.rbufsz, buf, ssz);
 	n->xfer.rbufsz += ssz;
-	return 1;
+
+	/* See if we have a full response. */
+
+	if (0 == n->xfer.hdrsz) {
+		if ((c = http_head(n)) < 0)
+			return 1;
+		if (0 == c) {
+			xwarnx(out, "malformed HTTP headers: %s", n->host);
+			return http_close_err(out, n);
+		}
+
+		/* 
+		 * Allocate the whole (uncompressed) body now if we know
+		 * its size and it's reasonable.
+		 */
+
+		if (FRAMING_LENGTH == n->xfer.framing &&
+		    ! n->xfer.zenc &&
+		    n->xfer.clen <= HTTP_RBUF_PRESIZE &&
+		    n->xfer.hdrsz + n->xfer.clen > n->xfer.rbufsz &&
+		    ! http_rbuf_reserve(out, n, n->xfer.hdrsz + 
+		      n->xfer.clen - n->xfer.rbufsz + HTTP_READ_MIN))
+			return 0;
+	}
+
+	if ((c = http_body(n)) < 0) {
+		xwarnx(out, "malformed HTTP body: %s", n->host);
+		return http_close_err(out, n);
+	}
+
+	if (n->xfer.zenc) {
+		if ((zc = http_inflate(out, n)) < 0)
+			return 0;
+		else if (0 == zc)
+			return http_close_err(out, n);
+	}
+
+	if (0 == c)
+		return 1;
+
+	n->xfer.done = 1;
+	if ( ! n->xfer.keepalive)
+		return http_close_done(out, n);
+
+	/* Leave the connection open for our next request. */
+
+	n->state = STATE_CONNECT_KEEPALIVE;
+	n->waitstart = time(NULL);
+	n->xfer.pfd->events = POLLIN;
+	return http_response(out, n);
 }
 
+/*
+ * Release transfer resources not otherwise freed by the state machine.
+ */
+void
+http_free(struct node *n)
+{
+
+	if (NULL != n->xfer.zs) {
+		inflateEnd(n->xfer.zs);
+		free(n->xfer.zs);
+	}
+	free(n->xfer.zbuf);
+}
@@ -22,6 +22,7 @@
 #include <ncurses.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <kcgi.h>
 #include <kcgijson.h>
@@ -30,19 +31,86 @@
 #include "slant.h"
 #include "json.h"
 
+/*
+ * Parse the "cgi" object of server timings at "t" into "rs".
+ * Timings we don't know are ignored.
+ * Returns the tokens consumed or 0 if malformed.
+ */
+static int
+json_parse_cgi(const char *str, const jsmntok_t *t, 
+	int toks, struct recset *rs)
+{
+	int		 i, j;
+	char		*ep;
+	long long	 lval;
+	int64_t		*v;
+
+	if (JSMN_OBJECT != t[0].type)
+		return 0;
+
+	for (i = 0, j = 1; i < t[0].size; i++, j += 2) {
+		if (j + 1 >= toks ||
+		    JSMN_STRING != t[j].type ||
+		    JSMN_PRIMITIVE != t[j + 1].type)
+			return 0;
+		lval = strtoll(str + t[j + 1].start, &ep, 10);
+		if (ep != str + t[j + 1].end)
+			return 0;
+		if (jsmn_eq(str, &t[j], "open"))
+			v = &rs->cgiopen;
+		else if (jsmn_eq(str, &t[j], "list"))
+			v = &rs->cgilist;
+		else if (jsmn_eq(str, &t[j], "send"))
+			v = &rs->cgisend;
+		else
+			continue;
+		*v = lval;
+	}
+
+	rs->has_cgi = 1;
+	return j;
+}
+
+/*
+ * Number of tokens in the value at "t", including those within it.
+ * Returns 0 if it's cut short.
+ */
+static int
+json_skip(const jsmntok_t *t, int toks)
+{
+	int	 i, j, rc;
+
+	if (toks < 1)
+		return 0;
+	for (i = 0, j = 1; i < t[0].size; i++, j += rc)
+		if (0 == (rc = json_skip(&t[j], toks - j)))
+			return 0;
+	return j;
+}
+
 /*
  * Parse the top-level objects of our JSON body.
+ * Record arrays already seen are marked in "seenp" by interval bit, as
+ * with RECS_QMIN and so on.
  * Returns >1 on success, 0 on transient failure (malformatted), <0 on
  * system error (the system should halt).
  */
 static int
-json_parse_obj(struct out *out, const char *str, 
-	const jsmntok_t *t, size_t pos, struct node *n, int toks)
+json_parse_obj(struct out *out, const char *str, const jsmntok_t *t, 
+	size_t pos, const struct node *n, struct recset *rs, int toks,
+	unsigned int *seenp)
 {
-	int	 rc = 0;
+	int		 rc = 0;
+	char		*ep;
+	long long	 lval;
+	struct record	*p = NULL;
+	size_t		 psz = 0, iv;
+	unsigned int	 seen = *seenp;
+	static const char *const names[INTERVALS] = {
+		"qmin", "min", "hour", "day", "week", "year" };
 
 	if (jsmn_eq(str, &t[pos], "version")) {
-		if (n->recs->has_version) {
+		if (rs->has_version) {
 			xwarnx(out, "JSON \"version\" "
 				"duplicated: %s", n->host);
 			return 0;
@@ -51,23 +119,23 @@ json_parse_obj(struct out *out, const char *str,
 				"not a string: %s", n->host);
 			return 0;
 		}
-		n->recs->version = strndup
+		rs->version = strndup
 			(str + t[pos].start,
 			 t[pos].end - t[pos].start);
-		if (NULL == n->recs->version) {
+		if (NULL == rs->version) {
 			xwarn(out, NULL);
 			return -1;
 		}
-		n->recs->has_version = 1;
+		rs->has_version = 1;
 		return 1;
 	} else if (jsmn_eq(str, &t[pos], "system")) {
-		if (n->recs->has_system) {
+		if (rs->has_system) {
 			xwarnx(out, "JSON \"system\" "
 				"duplicated: %s", n->host);
 			return 0;
 		}
 		pos++;
-		rc = jsmn_system(&n->recs->system,
+		rc = jsmn_system(&rs->system,
 			 str, &t[pos], toks - pos);
 		if (0 == rc) 
 			xwarnx(out, "malformed JSON "
@@ -75,88 +143,81 @@ json_parse_obj(struct out *out, const char *str,
 		else if (rc < 0)
 			xwarn(out, NULL);
 		else
-			n->recs->has_system = 1;
+			rs->has_system = 1;
 		return rc;
-	}
-
-	/* Now we do the qmin, min, hour, day, week, and year arrays. */
-
-	if (jsmn_eq(str, &t[pos], "qmin")) {
-		if (n->recs->byqminsz) {
-			xwarnx(out, "JSON \"qmin\" "
-				"duplicated: %s", n->host);
-			return 0;
-		}
-		pos++;
-		rc = jsmn_record_array
-			(&n->recs->byqmin,
-			 &n->recs->byqminsz,
-			 str, &t[pos], toks - pos);
-	} else if (jsmn_eq(str, &t[pos], "min")) {
-		if (n->recs->byminsz) {
-			xwarnx(out, "JSON \"min\" "
+	} else if (jsmn_eq(str, &t[pos], "since")) {
+		if (rs->has_since) {
+			xwarnx(out, "JSON \"since\" "
 				"duplicated: %s", n->host);
 			return 0;
-		}
-		pos++;
-		rc = jsmn_record_array
-			(&n->recs->bymin,
-			 &n->recs->byminsz,
-			 str, &t[pos], toks - pos);
-	} else if (jsmn_eq(str, &t[pos], "hour")) {
-		if (n->recs->byhoursz) {
-			xwarnx(out, "JSON \"hour\" "
-				"duplicated: %s", n->host);
+		} else if (JSMN_PRIMITIVE != t[++pos].type) {
+			xwarnx(out, "JSON \"since\" node "
+				"not a number: %s", n->host);
 			return 0;
 		}
-		pos++;
-		rc = jsmn_record_array
-			(&n->recs->byhour,
-			 &n->recs->byhoursz,
-			 str, &t[pos], toks - pos);
-	} else if (jsmn_eq(str, &t[pos], "day")) {
-		if (n->recs->bydaysz) {
-			xwarnx(out, "JSON \"day\" "
-				"duplicated: %s", n->host);
+		lval = strtoll(str + t[pos].start, &ep, 10);
+		if (ep != str + t[pos].end || lval <= 0) {
+			xwarnx(out, "JSON \"since\" node "
+				"malformed: %s", n->host);
 			return 0;
 		}
-		pos++;
-		rc = jsmn_record_array
-			(&n->recs->byday,
-			 &n->recs->bydaysz,
-			 str, &t[pos], toks - pos);
-	} else if (jsmn_eq(str, &t[pos], "week")) {
-		if (n->recs->byweeksz) {
-			xwarnx(out, "JSON \"week\" "
+		rs->since = lval;
+		rs->has_since = 1;
+		return 1;
+	} else if (jsmn_eq(str, &t[pos], "cgi")) {
+		if (rs->has_cgi) {
+			xwarnx(out, "JSON \"cgi\" "
 				"duplicated: %s", n->host);
 			return 0;
 		}
 		pos++;
-		rc = jsmn_record_array
-			(&n->recs->byweek,
-			 &n->recs->byweeksz,
-			 str, &t[pos], toks - pos);
-	} else if (jsmn_eq(str, &t[pos], "year")) {
-		if (n->recs->byyearsz) {
-			xwarnx(out, "JSON \"year\" "
-				"duplicated: %s", n->host);
-			return 0;
-		}
+		rc = json_parse_cgi(str, &t[pos], toks - pos, rs);
+		if (0 == rc)
+			xwarnx(out, "malformed JSON "
+				"\"cgi\" node: %s", n->host);
+		return rc;
+	}
+
+	/* Now we do the qmin, min, hour, day, week, and year arrays. */
+
+	for (iv = 0; iv < INTERVALS; iv++)
+		if (jsmn_eq(str, &t[pos], names[iv]))
+			break;
+
+	/* Keys we don't know are from newer servers: skip them. */
+
+	if (INTERVALS == iv) {
 		pos++;
-		rc = jsmn_record_array
-			(&n->recs->byyear,
-			 &n->recs->byyearsz,
-			 str, &t[pos], toks - pos);
-	} else {
-		xwarnx(out, "unknown JSON node: %s", n->host);
+		if (0 == (rc = json_skip(&t[pos], toks - pos)))
+			xwarnx(out, "malformed JSON node: %s", n->host);
+		return rc;
+	} else if (seen & (1U << iv)) {
+		xwarnx(out, "JSON \"%s\" duplicated: %s", 
+			names[iv], n->host);
 		return 0;
 	}
 
-	if (0 == rc) 
+	pos++;
+	rc = jsmn_record_array(&p, &psz, str, &t[pos], toks - pos);
+
+	if (0 == rc) {
 		xwarnx(out, "JSON record array node failed: %s", n->host);
-	else if (rc < 0)
+		return 0;
+	} else if (rc < 0) {
 		xwarn(out, NULL);
+		return rc;
+	}
+
+	/* Keep the records in our compact form. */
 
+	if ( ! recarray_records(&rs->ivs[iv], p, psz)) {
+		jsmn_record_free_array(p, psz);
+		xwarn(out, NULL);
+		return -1;
+	}
+
+	jsmn_record_free_array(p, psz);
+	*seenp = seen | (1U << iv);
 	return rc;
 }
 
@@ -164,51 +225,41 @@ json_parse_obj(struct out *out, const char *str,
  * Parse the full JSON response for a given node.
  * We use the JSMN interface produced by kwebapp.
  * This is a somewhat... abstruse interface, but simple and robust.
+ * Tokens are parsed into the node's token array, which is kept between
+ * responses and only grown (and the parse re-run) when too small.
+ * Records are parsed into "rs", which must be zeroed, and which is
+ * freed on failure.
  * Returns >0 on success, 0 on transient failure (malformed JSON or
  * other recoverable error), <0 on fatal error (system should halt).
  */
 int
-json_parse(struct out *out, struct node *n, const char *str, size_t sz)
+json_parse(struct out *out, struct node *n, 
+	const char *str, size_t sz, struct recset *rs)
 {
-	int	 	 i, toks, ntoks, rc;
-	size_t		 j;
+	int	 	 i, toks, rc;
+	size_t		 j, tsz;
+	unsigned int	 seen = 0;
 	jsmn_parser	 jp;
-	jsmntok_t	*t = NULL;
-
-	/* Allocate results, if necessary, and free existing. */
+	jsmntok_t	*t;
+	void		*pp;
 
-	if (NULL == n->recs &&
-	    NULL == (n->recs = calloc(1, sizeof(struct recset))))
-		goto syserr;
-
-	recset_free(n->recs);
-	memset(n->recs, 0, sizeof(struct recset));
-
-	/* Parse to get token length. */
-
-	jsmn_init(&jp);
-	if (-1 == (toks = jsmn_parse(&jp, str, sz, NULL, 0)))
-		goto syserr;
-	else if (toks <= 0)
-		goto err;
-
-	/* Allocate tokens and re-parse. */
-
-	if (NULL == (t = calloc(toks, sizeof(jsmntok_t))))
-		goto syserr;
-
-	jsmn_init(&jp);
-	ntoks = jsmn_parse(&jp, str, sz, t, toks);
+	for (;;) {
+		jsmn_init(&jp);
+		toks = jsmn_parse(&jp, str, sz, n->toks, n->toksz);
+		if (JSMN_ERROR_NOMEM != toks)
+			break;
+		tsz = 0 == n->toksz ? 256 : n->toksz * 2;
+		pp = reallocarray(n->toks, tsz, sizeof(jsmntok_t));
+		if (NULL == pp)
+			goto syserr;
+		n->toks = pp;
+		n->toksz = tsz;
+	}
 
-	/* 
-	 * I'm not sure why this happens, but jsmn_parse() can return a
-	 * different result if "toks" is set.
-	 * Catch that here.
-	 */
+	t = n->toks;
 
-	if (ntoks != toks) {
-		xwarnx(out, "token count: %d != %d: %s", 
-			ntoks, toks, n->host);
+	if (toks <= 0) {
+		xwarnx(out, "JSON tokenise: %s", n->host);
 		goto err;
 	} else if (t[0].type != JSMN_OBJECT) {
 		xwarnx(out, "top-level JSON "
@@ -220,7 +271,7 @@ json_parse(struct out *out, struct node *n, const char *str, size_t sz)
 
 	for (i = 0, j = 1; i < t[0].size; i++) {
 		rc = json_parse_obj
-			(out, str, &t[j], 0, n, toks - j);
+			(out, str, &t[j], 0, n, rs, toks - j, &seen);
 		if (rc < 0)
 			goto syserr;
 		else if (0 == rc)
@@ -228,11 +279,10 @@ json_parse(struct out *out, struct node *n, const char *str, size_t sz)
 		j += 1 + rc;
 	}
 
-	free(t);
 	return 1;
 syserr:
 	xwarn(out, NULL);
-	free(t);
+	recset_free(rs);
 	return -1;
 err:
 	xwarnx(out, "JSON parse: %s", n->host);
@@ -240,7 +290,7 @@ err:
 	fprintf(out->errs, "%.*s\n", (int)sz, str);
 	fprintf(out->errs, "------<------\n");
 	fflush(out->errs);
-	free(t);
+	recset_free(rs);
 	return 0;
 }
 
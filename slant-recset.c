@@ -0,0 +1,442 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <ncurses.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <kcgi.h>
+#include <kcgijson.h>
+
+#include "extern.h"
+#include "slant.h"
+#include "json.h"
+
+/*
+ * Allocate "a" to hold "sz" records, all of whose field arrays are
+ * carved from a single allocation: the 64-bit fields first, so each
+ * array is aligned.
+ * The records are uninitialised.
+ * Returns zero on memory exhaustion, non-zero on success.
+ */
+int
+recarray_alloc(struct recarray *a, size_t sz)
+{
+	char	*p;
+
+	memset(a, 0, sizeof(struct recarray));
+	if (0 == sz)
+		return 1;
+	if (NULL == (p = reallocarray(NULL, sz, RECARRAY_ROW)))
+		return 0;
+
+	a->sz = sz;
+	a->ctime = (int64_t *)p;
+	a->id = a->ctime + sz;
+	a->nettx = a->id + sz;
+	a->netrx = a->nettx + sz;
+	a->discread = a->netrx + sz;
+	a->discwrite = a->discread + sz;
+	a->cpu = (float *)(a->discwrite + sz);
+	a->mem = a->cpu + sz;
+	a->nprocs = a->mem + sz;
+	a->rprocs = a->nprocs + sz;
+	a->nfiles = a->rprocs + sz;
+	a->entries = (uint32_t *)(a->nfiles + sz);
+	return 1;
+}
+
+/*
+ * The single allocation holding the field arrays of "a" and, in "sz",
+ * its size; or NULL if there are no records.
+ */
+const void *
+recarray_buf(const struct recarray *a, size_t *sz)
+{
+
+	*sz = a->sz * RECARRAY_ROW;
+	return a->ctime;
+}
+
+/*
+ * Allocate "a" to hold the "sz" records in "buf", as given by
+ * recarray_buf() for an array of the same size.
+ * Returns zero on memory exhaustion, non-zero on success.
+ */
+int
+recarray_load(struct recarray *a, size_t sz, const void *buf)
+{
+
+	if ( ! recarray_alloc(a, sz))
+		return 0;
+	if (sz)
+		memcpy(a->ctime, buf, sz * RECARRAY_ROW);
+	return 1;
+}
+
+void
+recarray_free(struct recarray *a)
+{
+
+	free(a->ctime);
+	memset(a, 0, sizeof(struct recarray));
+}
+
+/*
+ * Copy record "si" of "src" into record "di" of "dst".
+ */
+static void
+recarray_copy(struct recarray *dst, size_t di,
+	const struct recarray *src, size_t si)
+{
+
+	dst->ctime[di] = src->ctime[si];
+	dst->id[di] = src->id[si];
+	dst->nettx[di] = src->nettx[si];
+	dst->netrx[di] = src->netrx[si];
+	dst->discread[di] = src->discread[si];
+	dst->discwrite[di] = src->discwrite[si];
+	dst->cpu[di] = src->cpu[si];
+	dst->mem[di] = src->mem[si];
+	dst->nprocs[di] = src->nprocs[si];
+	dst->rprocs[di] = src->rprocs[si];
+	dst->nfiles[di] = src->nfiles[si];
+	dst->entries[di] = src->entries[si];
+}
+
+/*
+ * Fill "a" with the "sz" records "p" as parsed by jsmn_record_array().
+ * Returns zero on memory exhaustion, non-zero on success.
+ */
+int
+recarray_records(struct recarray *a, const struct record *p, size_t sz)
+{
+	size_t	 i;
+
+	if ( ! recarray_alloc(a, sz))
+		return 0;
+
+	for (i = 0; i < sz; i++) {
+		a->ctime[i] = p[i].ctime;
+		a->id[i] = p[i].id;
+		a->nettx[i] = p[i].nettx;
+		a->netrx[i] = p[i].netrx;
+		a->discread[i] = p[i].discread;
+		a->discwrite[i] = p[i].discwrite;
+		a->cpu[i] = p[i].cpu;
+		a->mem[i] = p[i].mem;
+		a->nprocs[i] = p[i].nprocs;
+		a->rprocs[i] = p[i].rprocs;
+		a->nfiles[i] = p[i].nfiles;
+		a->entries[i] = p[i].entries < 0 ? 0 :
+			p[i].entries > UINT32_MAX ? UINT32_MAX :
+			p[i].entries;
+	}
+
+	return 1;
+}
+
+/*
+ * Whether "a" has a record with identifier "id".
+ */
+static int
+recarray_find(const struct recarray *a, int64_t id)
+{
+	size_t	 i;
+
+	for (i = 0; i < a->sz; i++)
+		if (a->id[i] == id)
+			return 1;
+	return 0;
+}
+
+/*
+ * Keep only the newest "depth" records of "a".
+ * The remaining records are moved into a smaller allocation.
+ * Returns zero on memory exhaustion (with "a" untouched), non-zero on
+ * success.
+ */
+static int
+recarray_keep(struct recarray *a, size_t depth)
+{
+	struct recarray	 r;
+	size_t		 i;
+
+	if (a->sz <= depth)
+		return 1;
+	if ( ! recarray_alloc(&r, depth))
+		return 0;
+	for (i = 0; i < depth; i++)
+		recarray_copy(&r, i, a, i);
+	recarray_free(a);
+	*a = r;
+	return 1;
+}
+
+/*
+ * Merge the partial records "delta", which are ordered by descending
+ * ctime, into "old" (same ordering), allocating the result into "res".
+ * The delta records come first.
+ * They're followed by old records that started before the oldest delta
+ * record and which weren't re-used (by identifier) for a delta record,
+ * as the server recycles its oldest records as new ones.
+ * Only the newest "depth" records are kept.
+ * Returns zero on memory exhaustion, non-zero on success.
+ * On success, "res" is set; otherwise, it's untouched.
+ */
+static int
+recarray_merge(struct recarray *res, const struct recarray *old,
+	const struct recarray *delta, size_t depth)
+{
+	struct recarray	 r;
+	size_t		 i, j, sz;
+
+	/* First see how many old records we keep. */
+
+	for (sz = delta->sz, i = 0; i < old->sz; i++)
+		if (0 == delta->sz ||
+		    (old->ctime[i] < delta->ctime[delta->sz - 1] &&
+		     ! recarray_find(delta, old->id[i])))
+			sz++;
+
+	if (sz > depth)
+		sz = depth;
+	if ( ! recarray_alloc(&r, sz))
+		return 0;
+
+	for (i = 0; i < delta->sz && i < sz; i++)
+		recarray_copy(&r, i, delta, i);
+
+	for (j = 0; i < sz && j < old->sz; j++)
+		if (0 == delta->sz ||
+		    (old->ctime[j] < delta->ctime[delta->sz - 1] &&
+		     ! recarray_find(delta, old->id[j])))
+			recarray_copy(&r, i++, old, j);
+
+	*res = r;
+	return 1;
+}
+
+void
+recset_free(struct recset *r)
+{
+	size_t	 i;
+
+	if (NULL == r)
+		return;
+
+	free(r->version);
+	jsmn_system_clear(&r->system);
+	for (i = 0; i < INTERVALS; i++)
+		recarray_free(&r->ivs[i]);
+}
+
+/*
+ * Merge a partial record set "delta", which has only the records that
+ * have been changed or added, with "old" into "r", which is zeroed.
+ * The version, system information, and server timings are taken from
+ * "delta".
+ * Only the newest "depth" records of each interval are kept.
+ * As "old" isn't modified, it may be read (e.g., drawn) meanwhile.
+ * On success, "delta" is consumed and zeroed.
+ * Returns zero on memory exhaustion (neither "r" nor "delta" is
+ * modified), non-zero on success. 
+ */
+static int
+recset_merge(struct recset *r, const struct recset *old, 
+	struct recset *delta, const size_t *depth)
+{
+	size_t	 i;
+
+	for (i = 0; i < INTERVALS; i++)
+		if ( ! recarray_merge(&r->ivs[i], 
+		    &old->ivs[i], &delta->ivs[i], depth[i]))
+			break;
+
+	if (i < INTERVALS) {
+		while (i-- > 0)
+			recarray_free(&r->ivs[i]);
+		return 0;
+	}
+
+	for (i = 0; i < INTERVALS; i++)
+		recarray_free(&delta->ivs[i]);
+
+	r->version = delta->version;
+	r->system = delta->system;
+	r->has_version = delta->has_version;
+	r->has_system = delta->has_system;
+	r->since = delta->since;
+	r->has_since = delta->has_since;
+	r->cgiopen = delta->cgiopen;
+	r->cgilist = delta->cgilist;
+	r->cgisend = delta->cgisend;
+	r->has_cgi = delta->has_cgi;
+
+	memset(delta, 0, sizeof(struct recset));
+	return 1;
+}
+
+/*
+ * Keep only the newest "depth" records of each interval of "r".
+ * Returns zero on memory exhaustion (some intervals may have been cut),
+ * non-zero on success.
+ */
+int
+recset_keep(struct recset *r, const size_t *depth)
+{
+	size_t	 i;
+
+	for (i = 0; i < INTERVALS; i++)
+		if ( ! recarray_keep(&r->ivs[i], depth[i]))
+			return 0;
+	return 1;
+}
+
+/*
+ * Build the records that will replace the node's records "old" (or
+ * NULL) given the freshly-parsed records "rs" of a request for records
+ * since "since".
+ * A partial set is merged with "old", which must be those against
+ * which we made the request.
+ * Otherwise, "rs" becomes the new records.
+ * Either way, only the newest "depth" records of each interval are
+ * kept.
+ * Neither "old" nor the node's records are modified, so this may run
+ * on a worker thread.
+ * Returns <0 on system failure, 0 if the records are not what we asked
+ * for, >0 on success (in which case "rs" has been consumed and "res"
+ * is set to the allocated records).
+ */
+int
+recset_build(struct out *out, const struct node *n, time_t since,
+	const size_t *depth, const struct recset *old, 
+	struct recset *rs, struct recset **res)
+{
+	struct recset	*r;
+
+	if (rs->has_since && (NULL == old || rs->since != since)) {
+		xwarnx(out, "\"since\" not requested: %s", n->host);
+		return 0;
+	}
+
+	if (NULL == (r = calloc(1, sizeof(struct recset))))
+		return -1;
+
+	if (rs->has_since) {
+		if ( ! recset_merge(r, old, rs, depth)) {
+			free(r);
+			return -1;
+		}
+	} else {
+		*r = *rs;
+		memset(rs, 0, sizeof(struct recset));
+		if ( ! recset_keep(r, depth)) {
+			recset_free(r);
+			free(r);
+			return -1;
+		}
+	}
+
+	*res = r;
+	return 1;
+}
+
+/*
+ * Number of records of interval "iv" in "r" (which may be NULL).
+ */
+size_t
+recset_size(const struct recset *r, enum interval iv)
+{
+
+	return NULL == r ? 0 : r->ivs[iv].sz;
+}
+
+/*
+ * When record "i" of interval "iv" in "r" started, or zero if there's
+ * no such record.
+ */
+time_t
+recset_ctime(const struct recset *r, enum interval iv, size_t i)
+{
+
+	return i < recset_size(r, iv) ? r->ivs[iv].ctime[i] : 0;
+}
+
+/*
+ * The value of field "f" of record "i" of interval "iv" in "r", or
+ * zero if there's no such record.
+ * This is the sum over the record's entries for accumulated fields.
+ */
+double
+recset_get(const struct recset *r, enum interval iv, 
+	size_t i, enum recfield f)
+{
+	const struct recarray *a;
+
+	if (i >= recset_size(r, iv))
+		return 0.0;
+
+	a = &r->ivs[iv];
+	switch (f) {
+	case RECF_ENTRIES:
+		return a->entries[i];
+	case RECF_CPU:
+		return a->cpu[i];
+	case RECF_MEM:
+		return a->mem[i];
+	case RECF_NETTX:
+		return a->nettx[i];
+	case RECF_NETRX:
+		return a->netrx[i];
+	case RECF_DISCREAD:
+		return a->discread[i];
+	case RECF_DISCWRITE:
+		return a->discwrite[i];
+	case RECF_NPROCS:
+		return a->nprocs[i];
+	case RECF_RPROCS:
+		return a->rprocs[i];
+	case RECF_NFILES:
+		return a->nfiles[i];
+	default:
+		abort();
+	}
+}
+
+/*
+ * Put into "v" the value of field "f" of record "i" of interval "iv" in
+ * "r" averaged over the record's entries.
+ * Returns zero if there's no such record or it has no entries.
+ */
+int
+recset_avg(const struct recset *r, enum interval iv, 
+	size_t i, enum recfield f, double *v)
+{
+	double	 entries;
+
+	if (0.0 == (entries = recset_get(r, iv, i, RECF_ENTRIES)))
+		return 0;
+	*v = recset_get(r, iv, i, f) / entries;
+	return 1;
+}
@@ -0,0 +1,880 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/queue.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <ncurses.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "extern.h"
+#include "slant.h"
+#include "slant-event.h"
+
+/*
+ * A relay serves the records we've polled from our hosts to other
+ * slant(1) clients and relays, so that however many are watching, each
+ * host is only polled by us.
+ * Each host is a path "/N", N being its index in our configuration,
+ * which is answered with a document as if by slant-cgi(8).
+ * The path "/" has all hosts in one document.
+ * Host documents are generated (and compressed) once per update, so
+ * serving them costs us very little.
+ */
+
+/*
+ * Query buffer per client: requests are small.
+ */
+#define	RELAY_RBUF 4096
+
+/*
+ * Seconds an idle client may hold its connection.
+ */
+#define	RELAY_IDLE 300
+
+/*
+ * Host documents are answered with 503 once the host hasn't given us
+ * data for this many of its wait periods.
+ */
+#define	RELAY_STALE 3
+
+/*
+ * Most seconds a client may ask us to hold its request until a host's
+ * records change, as with slant-cgi(8).
+ */
+#define	RELAY_WAIT_MAX 60
+
+/*
+ * Document of a host, shared by all clients being sent it.
+ * It's freed when the host has a new one and no clients remain.
+ */
+struct	rbody {
+	char		*buf; /* document */
+	size_t		 sz; /* length of buf */
+	char		*zbuf; /* deflated document (or NULL) */
+	size_t		 zsz; /* length of zbuf */
+	char		 etag[48]; /* validator */
+	size_t		 refs; /* host and clients */
+};
+
+struct	rclient {
+	char		 rbuf[RELAY_RBUF]; /* unanswered requests */
+	size_t		 rbufsz; /* length of rbuf */
+	char		 head[256]; /* response header */
+	size_t		 headsz; /* length of head */
+	struct rbody	*body; /* shared response body (or NULL) */
+	char		*own; /* unshared response body (or NULL) */
+	const char	*data; /* response body */
+	size_t		 datasz; /* length of data */
+	size_t		 wpos; /* written of head and data */
+	int		 close; /* close once written */
+	int		 zok; /* request accepts deflate */
+	time_t		 since; /* request since (or zero) */
+	int		 timing; /* request wants server timings */
+	size_t		 held; /* host held for plus one (or zero) */
+	time_t		 holdend; /* when held request times out */
+};
+
+/*
+ * Our listening descriptor and clients occupy RELAY_SLOTS consecutive
+ * slots of the event loop, starting at "base": first the listener,
+ * then the clients.
+ */
+struct	relay {
+	struct pollfd	*pfds; /* our descriptors */
+	size_t		 base; /* event slot of pfds[0] */
+	struct rclient	 clients[RELAY_CLIENTS];
+	size_t		 active; /* connected clients */
+	int		 paused; /* not accepting: no free slots */
+	const struct node *nodes; /* hosts */
+	struct rbody	**bodies; /* documents by host (or NULL) */
+	size_t		 bodysz; /* number of hosts */
+	uint64_t	 gen; /* last document generation */
+	time_t		 start; /* for unique validators */
+};
+
+static void
+rbody_put(struct rbody *b)
+{
+
+	if (NULL == b)
+		return;
+	assert(b->refs > 0);
+	if (--b->refs)
+		return;
+	free(b->buf);
+	free(b->zbuf);
+	free(b);
+}
+
+/*
+ * Forget the response of client "c" (if any).
+ */
+static void
+rclient_done(struct rclient *c)
+{
+
+	rbody_put(c->body);
+	free(c->own);
+	c->body = NULL;
+	c->own = NULL;
+	c->data = NULL;
+	c->datasz = c->headsz = c->wpos = 0;
+}
+
+static void
+rclient_close(struct relay *r, size_t i)
+{
+
+	rclient_done(&r->clients[i - 1]);
+	r->clients[i - 1].rbufsz = 0;
+	r->clients[i - 1].close = 0;
+	r->clients[i - 1].held = 0;
+	close(r->pfds[i].fd);
+	r->pfds[i].fd = -1;
+	r->pfds[i].events = 0;
+	r->active--;
+}
+
+static void
+putstr(FILE *f, const char *cp)
+{
+
+	fputc('"', f);
+	for ( ; '\0' != *cp; cp++)
+		if ('"' == *cp || '\\' == *cp)
+			fprintf(f, "\\%c", *cp);
+		else if ((unsigned char)*cp < 0x20)
+			fprintf(f, "\\u%.4x", (unsigned char)*cp);
+		else
+			fputc(*cp, f);
+	fputc('"', f);
+}
+
+/*
+ * Emit an interval's records.
+ * These are selected as in slant-cgi(8): given "since", only those
+ * started at or after it, along with the newest started before it.
+ * Records are ordered by descending ctime.
+ */
+static void
+relay_interval(FILE *f, const char *name,
+	const struct recarray *a, enum interval iv, time_t since)
+{
+	size_t	 i;
+
+	fprintf(f, ",\"%s\":[", name);
+	for (i = 0; i < a->sz; i++) {
+		fprintf(f, "%s{\"ctime\":%" PRId64 ","
+			"\"entries\":%" PRIu32 ","
+			"\"cpu\":%.9g,\"mem\":%.9g,"
+			"\"nettx\":%" PRId64 ","
+			"\"netrx\":%" PRId64 ","
+			"\"discread\":%" PRId64 ","
+			"\"discwrite\":%" PRId64 ","
+			"\"nprocs\":%.9g,\"rprocs\":%.9g,"
+			"\"nfiles\":%.9g,\"interval\":%d,"
+			"\"id\":%" PRId64 "}",
+			0 == i ? "" : ",",
+			a->ctime[i], a->entries[i],
+			a->cpu[i], a->mem[i], a->nettx[i], a->netrx[i],
+			a->discread[i], a->discwrite[i],
+			a->nprocs[i], a->rprocs[i], a->nfiles[i],
+			(int)iv, a->id[i]);
+		if (since && a->ctime[i] < since)
+			break;
+	}
+	fputc(']', f);
+}
+
+/*
+ * Emit the records "rs" as a document of slant-cgi(8), only those
+ * changed since "since" if it's non-zero, and with the server's
+ * timings (if we have them) only if "timing".
+ */
+static void
+relay_doc(FILE *f, const struct recset *rs, time_t since, int timing)
+{
+	const struct system *s = &rs->system;
+	enum interval	 iv;
+	static const char *const names[INTERVALS] = {
+		"qmin", "min", "hour", "day", "week", "year" };
+
+	fputs("{\"version\":", f);
+	putstr(f, rs->has_version ? rs->version : VERSION);
+	if (since)
+		fprintf(f, ",\"since\":%lld", (long long)since);
+	if (rs->has_system)
+		fprintf(f, ",\"system\":{\"boot\":%lld,"
+			"\"id\":%" PRId64 ","
+			"\"nprocstime\":%" PRId64 ","
+			"\"nfilestime\":%" PRId64 ","
+			"\"cputime\":%" PRId64 ","
+			"\"memtime\":%" PRId64 ","
+			"\"nettime\":%" PRId64 ","
+			"\"disctime\":%" PRId64 ","
+			"\"dbtime\":%" PRId64 "}",
+			(long long)s->boot, s->id,
+			s->nprocstime, s->nfilestime, s->cputime,
+			s->memtime, s->nettime, s->disctime, s->dbtime);
+
+	for (iv = INTERVAL_byqmin; iv <= INTERVAL_byyear; iv++)
+		relay_interval(f, names[iv], &rs->ivs[iv], iv, since);
+
+	if (timing && rs->has_cgi)
+		fprintf(f, ",\"cgi\":{\"open\":%" PRId64 ","
+			"\"list\":%" PRId64 ",\"send\":%" PRId64 "}",
+			rs->cgiopen, rs->cgilist, rs->cgisend);
+
+	fputc('}', f);
+}
+
+/*
+ * Finish a document written to "f", an open_memstream(3) of "buf".
+ * Returns zero on failure (the document is freed), non-zero on
+ * success.
+ */
+static int
+relay_close(FILE *f, char **buf)
+{
+
+	if (ferror(f)) {
+		fclose(f);
+		free(*buf);
+		*buf = NULL;
+		return 0;
+	} else if (EOF == fclose(f)) {
+		free(*buf);
+		*buf = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+static int
+relay_render(const struct recset *rs, time_t since, int timing,
+	char **buf, size_t *sz)
+{
+	FILE	*f;
+
+	if (NULL == (f = open_memstream(buf, sz)))
+		return 0;
+	relay_doc(f, rs, since, timing);
+	return relay_close(f, buf);
+}
+
+/*
+ * Everything in one document: the hosts in configuration order, each
+ * with its current document (or null).
+ * Returns zero on memory exhaustion, non-zero on success.
+ */
+static int
+relay_all(const struct relay *r, char **buf, size_t *sz)
+{
+	FILE	*f;
+	size_t	 i;
+
+	if (NULL == (f = open_memstream(buf, sz)))
+		return 0;
+
+	fputs("{\"version\":\"" VERSION "\",\"hosts\":[", f);
+	for (i = 0; i < r->bodysz; i++) {
+		fprintf(f, "%s{\"url\":", 0 == i ? "" : ",");
+		putstr(f, r->nodes[i].url);
+		fprintf(f, ",\"path\":\"/%zu\",\"lastseen\":%lld,"
+			"\"data\":", i, (long long)r->nodes[i].lastseen);
+		if (NULL != r->bodies[i])
+			fwrite(r->bodies[i]->buf, 1, r->bodies[i]->sz, f);
+		else
+			fputs("null", f);
+		fputc('}', f);
+	}
+	fputs("]}", f);
+
+	return relay_close(f, buf);
+}
+
+/*
+ * Value of header "name" if it's the header "line", else NULL.
+ */
+static const char *
+head_value(const char *line, const char *name)
+{
+	size_t	 sz = strlen(name);
+
+	if (strncasecmp(line, name, sz) || ':' != line[sz])
+		return NULL;
+	for (line += sz + 1; ' ' == *line || '\t' == *line; line++)
+		continue;
+	return line;
+}
+
+/*
+ * Prepare the response header.
+ */
+static void
+relay_head(struct rclient *c, const char *status,
+	const char *etag, int zenc)
+{
+
+	c->headsz = snprintf(c->head, sizeof(c->head),
+		"HTTP/1.1 %s\r\n"
+		"Content-Type: application/json\r\n"
+		"Content-Length: %zu\r\n"
+		"%s%s%s"
+		"%s"
+		"Connection: %s\r\n"
+		"\r\n",
+		status, c->datasz,
+		NULL != etag ? "ETag: " : "",
+		NULL != etag ? etag : "",
+		NULL != etag ? "\r\n" : "",
+		zenc ? "Content-Encoding: deflate\r\n" : "",
+		c->close ? "close" : "keep-alive");
+	assert(c->headsz < sizeof(c->head));
+	c->wpos = 0;
+}
+
+/*
+ * Answer a client with the document of host "host", as much of it as
+ * c->since asks for.
+ * Shared documents have no server timings, so clients asking for them
+ * get their own.
+ * Returns zero on memory exhaustion, non-zero on success.
+ */
+static int
+relay_host(struct out *out, struct relay *r,
+	struct rclient *c, size_t host)
+{
+	const struct node *n = &r->nodes[host];
+	struct rbody	*b = r->bodies[host];
+
+	if (c->since || c->timing) {
+		/*
+		 * Our records are those of the document, as we only
+		 * generate them when records change.
+		 */
+		assert(NULL != n->recs);
+		if ( ! relay_render(n->recs, c->since, 
+		    c->timing, &c->own, &c->datasz)) {
+			xwarn(out, NULL);
+			return 0;
+		}
+		c->data = c->own;
+		relay_head(c, "200 OK", b->etag, 0);
+		return 1;
+	}
+
+	b->refs++;
+	c->body = b;
+	if (c->zok && NULL != b->zbuf) {
+		c->data = b->zbuf;
+		c->datasz = b->zsz;
+	} else {
+		c->data = b->buf;
+		c->datasz = b->sz;
+	}
+	relay_head(c, "200 OK", b->etag, c->data == b->zbuf);
+	return 1;
+}
+
+/*
+ * Answer the first full request in the client's buffer, if any.
+ * Clients asking to "wait" for a host's records to change are held
+ * (see relay_release()).
+ * Returns <0 if the request is malformed or on memory exhaustion (close
+ * the connection), 0 if we need more or are holding the client, >0 if a
+ * response has been prepared.
+ */
+static int
+relay_request(struct out *out, struct relay *r, struct rclient *c)
+{
+	char		*end, *cp, *line, *eol, *query;
+	const char	*v, *er, *inm = NULL;
+	char		 etag[48];
+	size_t		 len, host;
+	long long	 lval;
+	time_t		 wait = 0, t = time(NULL);
+	struct rbody	*b;
+	const struct node *n;
+	int		 rc = 1;
+
+	if (NULL == (end = memmem(c->rbuf, c->rbufsz, "\r\n\r\n", 4)))
+		return c->rbufsz == sizeof(c->rbuf) ? -1 : 0;
+
+	*end = '\0';
+	len = end - c->rbuf + 4;
+
+	if (strncmp(c->rbuf, "GET /", 5) ||
+	    NULL == (cp = strchr(c->rbuf + 4, ' ')))
+		return -1;
+	*cp++ = '\0';
+
+	/* HTTP/1.0 clients don't get persistent connections. */
+
+	if (NULL != (eol = strstr(cp, "\r\n")))
+		*eol = '\0';
+	c->close = strcmp(cp, "HTTP/1.1");
+	c->zok = 0;
+	c->since = 0;
+	c->timing = 0;
+
+	for (line = NULL == eol ? NULL : eol + 2;
+	     NULL != line; line = NULL == eol ? NULL : eol + 2) {
+		if (NULL != (eol = strstr(line, "\r\n")))
+			*eol = '\0';
+		if (NULL != (v = head_value(line, "If-None-Match")))
+			inm = v;
+		else if (NULL != (v = head_value(line, "Accept-Encoding")))
+			c->zok = NULL != strcasestr(v, "deflate");
+		else if (NULL != (v = head_value(line, "Connection")))
+			c->close = 0 == strcasecmp(v, "close");
+	}
+
+	/* The query string is only for "since", "wait", and "timing". */
+
+	cp = c->rbuf + 5;
+	if (NULL != (query = strchr(cp, '?')))
+		*query++ = '\0';
+	while (NULL != query) {
+		v = strsep(&query, "&");
+		if (0 == strncmp(v, "since=", 6)) {
+			lval = strtonum(v + 6, 1, LLONG_MAX, &er);
+			if (NULL == er)
+				c->since = lval;
+		} else if (0 == strncmp(v, "wait=", 5)) {
+			lval = strtonum(v + 5, 1, RELAY_WAIT_MAX, &er);
+			if (NULL == er)
+				wait = lval;
+		} else if (0 == strncmp(v, "timing=", 7))
+			c->timing = strtonum(v + 7, 0, 1, &er);
+	}
+
+	if ('\0' == *cp) {
+		snprintf(etag, sizeof(etag), "\"%lld-%" PRIu64 "\"",
+			(long long)r->start, r->gen);
+		if (NULL != inm && 0 == strcmp(inm, etag)) {
+			relay_head(c, "304 Not Modified", etag, 0);
+		} else if ( ! relay_all(r, &c->own, &c->datasz)) {
+			xwarn(out, NULL);
+			return -1;
+		} else {
+			c->data = c->own;
+			relay_head(c, "200 OK", etag, 0);
+		}
+		goto out;
+	}
+
+	host = strtonum(cp, 0, LLONG_MAX, &er);
+	if (NULL != er || host >= r->bodysz) {
+		relay_head(c, "404 Not Found", NULL, 0);
+		goto out;
+	}
+
+	n = &r->nodes[host];
+	b = r->bodies[host];
+
+	if (NULL == b || n->lastseen + RELAY_STALE * n->waittime < t) {
+		relay_head(c, "503 Service Unavailable", NULL, 0);
+	} else if (NULL != inm && 0 == strcmp(inm, b->etag) && wait) {
+		c->held = host + 1;
+		c->holdend = t + wait;
+		rc = 0;
+	} else if (NULL != inm && 0 == strcmp(inm, b->etag)) {
+		relay_head(c, "304 Not Modified", b->etag, 0);
+	} else if ( ! relay_host(out, r, c, host))
+		return -1;
+out:
+	memmove(c->rbuf, c->rbuf + len, c->rbufsz - len);
+	c->rbufsz -= len;
+	return rc;
+}
+
+/*
+ * Write as much of the response as we can.
+ * Returns <0 on failure (close the connection), 0 if there's more to
+ * write, >0 when the response has been written.
+ */
+static int
+relay_write(int fd, struct rclient *c)
+{
+	struct iovec	 iov[2];
+	ssize_t		 ssz;
+	int		 i = 0;
+
+	if (c->wpos < c->headsz) {
+		iov[i].iov_base = c->head + c->wpos;
+		iov[i++].iov_len = c->headsz - c->wpos;
+		if (c->datasz) {
+			iov[i].iov_base = (void *)c->data;
+			iov[i++].iov_len = c->datasz;
+		}
+	} else {
+		iov[i].iov_base = (void *)(c->data + (c->wpos - c->headsz));
+		iov[i++].iov_len = c->datasz - (c->wpos - c->headsz);
+	}
+
+	if (-1 == (ssz = writev(fd, iov, i)))
+		return EAGAIN == errno ? 0 : -1;
+
+	c->wpos += ssz;
+	return c->wpos == c->headsz + c->datasz;
+}
+
+/*
+ * Accept as many clients as we have room for.
+ * If we run out, we stop listening until a client leaves.
+ * Returns <0 on memory exhaustion, >=0 otherwise.
+ */
+static int
+relay_accept(struct out *out, struct relay *r, struct events *ev)
+{
+	size_t	 i = 1;
+	int	 fd;
+
+	for (;;) {
+		while (i <= RELAY_CLIENTS && -1 != r->pfds[i].fd)
+			i++;
+		if (i > RELAY_CLIENTS) {
+			r->paused = 1;
+			return 1;
+		}
+		fd = accept4(r->pfds[0].fd, NULL, NULL,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (-1 == fd) {
+			if (EAGAIN != errno && EWOULDBLOCK != errno &&
+			    ECONNABORTED != errno && EINTR != errno)
+				xwarn(out, "accept4");
+			break;
+		}
+		r->pfds[i].fd = fd;
+		r->pfds[i].events = POLLIN;
+		r->pfds[i].revents = 0;
+		r->active++;
+		if ( ! events_set(ev, r->base + i, time(NULL) + RELAY_IDLE))
+			return -1;
+	}
+
+	return events_set(ev, r->base, 0) ? 1 : -1;
+}
+
+/*
+ * Handle our ready event slot "slot".
+ * Clients are closed when they err, hang up, or idle for too long.
+ * Returns <0 on fatal error (system should halt), >=0 otherwise.
+ */
+int
+relay_ready(struct out *out, struct relay *r,
+	struct events *ev, size_t slot)
+{
+	size_t		 i = slot - r->base;
+	struct pollfd	*pfd = &r->pfds[i];
+	struct rclient	*c;
+	short		 revents = pfd->revents;
+	ssize_t		 ssz;
+	int		 rc = 1;
+
+	assert(slot >= r->base && i <= RELAY_CLIENTS);
+	pfd->revents = 0;
+
+	if (0 == i) {
+		if (relay_accept(out, r, ev) < 0) {
+			xwarn(out, NULL);
+			return -1;
+		}
+		return 1;
+	} else if (-1 == pfd->fd)
+		return 1;
+
+	c = &r->clients[i - 1];
+
+	/*
+	 * A deadline with no events is either the end of a held
+	 * request, which we answer as if we hadn't held it, or our idle
+	 * timeout.
+	 */
+
+	if (0 == revents && c->held) {
+		relay_head(c, "304 Not Modified",
+			r->bodies[c->held - 1]->etag, 0);
+		c->held = 0;
+		pfd->events = POLLOUT;
+		rc = 0;
+	} else if (0 == revents)
+		rc = -1;
+	else if (POLLOUT & pfd->events) {
+		if (POLLOUT & revents)
+			rc = relay_write(pfd->fd, c);
+		else
+			rc = -1;
+		if (rc > 0) {
+			rclient_done(c);
+			if (c->close)
+				rc = -1;
+			else
+				pfd->events = POLLIN;
+		}
+	} else if (POLLIN & revents) {
+		ssz = read(pfd->fd, c->rbuf + c->rbufsz,
+			sizeof(c->rbuf) - c->rbufsz);
+		if (-1 == ssz && EAGAIN == errno)
+			rc = 0;
+		else if (ssz <= 0)
+			rc = -1;
+		else
+			c->rbufsz += ssz;
+	} else
+		rc = -1;
+
+	/* Answer pipelined requests as well. */
+
+	if (rc > 0 && POLLIN == pfd->events && ! c->held) {
+		rc = relay_request(out, r, c);
+		if (rc > 0)
+			pfd->events = POLLOUT;
+	}
+
+	if (rc < 0) {
+		rclient_close(r, i);
+		if ( ! events_set(ev, slot, 0)) {
+			xwarn(out, NULL);
+			return -1;
+		}
+		if (r->paused) {
+			r->paused = 0;
+			if ( ! events_set(ev, r->base, 0)) {
+				xwarn(out, NULL);
+				return -1;
+			}
+		}
+		return 1;
+	}
+
+	if ( ! events_set(ev, slot, 
+	    c->held ? c->holdend : time(NULL) + RELAY_IDLE)) {
+		xwarn(out, NULL);
+		return -1;
+	}
+	return 1;
+}
+
+/*
+ * Answer the clients held for host "host", which has a new document.
+ * Returns zero on memory exhaustion, non-zero on success.
+ */
+static int
+relay_release(struct out *out, struct relay *r,
+	struct events *ev, size_t host)
+{
+	size_t		 i;
+	struct rclient	*c;
+
+	for (i = 1; i <= RELAY_CLIENTS; i++) {
+		c = &r->clients[i - 1];
+		if (host + 1 != c->held)
+			continue;
+		c->held = 0;
+		if ( ! relay_host(out, r, c, host))
+			return 0;
+		r->pfds[i].events = POLLOUT;
+		if ( ! events_set(ev, r->base + i, 
+		    time(NULL) + RELAY_IDLE)) {
+			xwarn(out, NULL);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Regenerate the document of host "host", whose records have changed,
+ * and answer any clients waiting for it.
+ * Clients being sent the old one keep it until they're done.
+ * Returns zero on memory exhaustion, non-zero on success.
+ */
+int
+relay_update(struct out *out, struct relay *r,
+	struct events *ev, size_t host)
+{
+	const struct node *n = &r->nodes[host];
+	struct rbody	*b;
+	uLongf		 zsz;
+
+	assert(host < r->bodysz);
+	if (NULL == n->recs)
+		return 1;
+
+	if (NULL == (b = calloc(1, sizeof(struct rbody)))) {
+		xwarn(out, NULL);
+		return 0;
+	} else if ( ! relay_render(n->recs, 0, 0, &b->buf, &b->sz)) {
+		xwarn(out, NULL);
+		free(b);
+		return 0;
+	}
+
+	/* Not being able to compress isn't fatal. */
+
+	zsz = compressBound(b->sz);
+	if (NULL != (b->zbuf = malloc(zsz))) {
+		if (Z_OK == compress2((Bytef *)b->zbuf, &zsz,
+		    (const Bytef *)b->buf, b->sz, Z_BEST_SPEED) &&
+		    zsz < b->sz)
+			b->zsz = zsz;
+		else {
+			free(b->zbuf);
+			b->zbuf = NULL;
+		}
+	}
+
+	r->gen++;
+	snprintf(b->etag, sizeof(b->etag), "\"%lld-%" PRIu64 "\"",
+		(long long)r->start, r->gen);
+	b->refs = 1;
+
+	rbody_put(r->bodies[host]);
+	r->bodies[host] = b;
+	return relay_release(out, r, ev, host);
+}
+
+/*
+ * Listen on "addr", which is "[host:]port", for clients of the "sz"
+ * hosts "nodes".
+ * Our descriptors are the RELAY_SLOTS starting at "pfds", which are
+ * those of event slot "base" onward.
+ * This is called before the screen is set up, so it warns to the
+ * standard error.
+ * Returns NULL on failure.
+ */
+struct relay *
+relay_alloc(const char *addr, struct pollfd *pfds, size_t base,
+	const struct node *nodes, size_t sz)
+{
+	struct relay	*r;
+	struct addrinfo	 hints, *res = NULL, *ai;
+	char		*host, *port;
+	int		 fd = -1, one = 1, c;
+	size_t		 i;
+
+	if (NULL == (host = strdup(addr))) {
+		warn(NULL);
+		return NULL;
+	}
+
+	if (NULL != (port = strrchr(host, ':'))) {
+		*port++ = '\0';
+		if ('[' == host[0] && ']' == host[strlen(host) - 1]) {
+			host[strlen(host) - 1] = '\0';
+			memmove(host, host + 1, strlen(host));
+		}
+	} else {
+		port = host;
+		host = NULL;
+	}
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	c = getaddrinfo(NULL == host || '\0' == *host ? 
+		NULL : host, port, &hints, &res);
+	if (0 != c) {
+		warnx("%s: %s", addr, gai_strerror(c));
+		free(NULL == host ? port : host);
+		return NULL;
+	}
+	free(NULL == host ? port : host);
+
+	for (ai = res; NULL != ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype |
+			SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+		if (-1 == fd)
+			continue;
+		if (-1 != setsockopt(fd, SOL_SOCKET,
+		     SO_REUSEADDR, &one, sizeof(one)) &&
+		    -1 != bind(fd, ai->ai_addr, ai->ai_addrlen) &&
+		    -1 != listen(fd, SOMAXCONN))
+			break;
+		close(fd);
+		fd = -1;
+	}
+
+	if (-1 == fd) {
+		warn("%s", addr);
+		freeaddrinfo(res);
+		return NULL;
+	}
+	freeaddrinfo(res);
+
+	r = calloc(1, sizeof(struct relay));
+	if (NULL == r ||
+	    NULL == (r->bodies = calloc(sz, sizeof(struct rbody *)))) {
+		warn(NULL);
+		free(r);
+		close(fd);
+		return NULL;
+	}
+
+	r->pfds = pfds;
+	r->base = base;
+	r->nodes = nodes;
+	r->bodysz = sz;
+	r->start = time(NULL);
+
+	pfds[0].fd = fd;
+	pfds[0].events = POLLIN;
+	for (i = 1; i < RELAY_SLOTS; i++) {
+		pfds[i].fd = -1;
+		pfds[i].events = 0;
+	}
+
+	return r;
+}
+
+void
+relay_free(struct relay *r)
+{
+	size_t	 i;
+
+	if (NULL == r)
+		return;
+	for (i = 1; i < RELAY_SLOTS; i++)
+		if (-1 != r->pfds[i].fd)
+			rclient_close(r, i);
+	close(r->pfds[0].fd);
+	r->pfds[0].fd = -1;
+	for (i = 0; i < r->bodysz; i++)
+		rbody_put(r->bodies[i]);
+	free(r->bodies);
+	free(r);
+}
@@ -0,0 +1,295 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <ncurses.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "extern.h"
+#include "slant.h"
+
+/*
+ * A log of response bodies is a sequence of entries, each a line
+ *
+ *   secs.nsecs binary since size url
+ *
+ * giving when the body was received, whether it's binary (1) or JSON
+ * (0), the time its records were requested since (or zero), its size,
+ * and its node's URL.
+ * The line is followed by the body itself and a newline.
+ */
+
+/*
+ * The entry we're replaying.
+ */
+struct	replayent {
+	double		 when; /* when received */
+	int		 binary; /* body is binary */
+	time_t		 since; /* requested records since */
+	size_t		 sz; /* size of body */
+	size_t		 node; /* its node (or nodes if unknown) */
+};
+
+struct	replay {
+	FILE		*f; /* log being replayed */
+	size_t		 speed; /* times faster (or 0, no waiting) */
+	struct timespec	 start; /* when the first entry was replayed */
+	double		 first; /* when the first entry was received */
+	struct replayent ent; /* if pending, next entry */
+	int		 pending; /* have read entry line */
+	int		 started; /* have replayed first entry */
+	int		 eof; /* end of log */
+	time_t		 clock; /* when last entry was received */
+	char		*line; /* entry line buffer */
+	size_t		 linemax; /* allocated size of line */
+	char		*name; /* log file name */
+};
+
+/*
+ * Append the response body "buf" of size "sz" for "n" to the log "f".
+ * The entry is flushed, so a log is whole up to the last entry.
+ * Returns zero on failure, non-zero on success.
+ */
+int
+replay_write(FILE *f, const struct node *n, const char *buf, size_t sz)
+{
+	struct timespec	 ts;
+
+	if (-1 == clock_gettime(CLOCK_REALTIME, &ts))
+		return 0;
+
+	fprintf(f, "%lld.%09ld %d %lld %zu %s\n",
+		(long long)ts.tv_sec, ts.tv_nsec, n->xfer.binary,
+		(long long)n->xfer.since, sz, n->url);
+	fwrite(buf, 1, sz, f);
+	fputc('\n', f);
+	return 0 == fflush(f) && ! ferror(f);
+}
+
+/*
+ * Open the log "file" to replay "speed" times faster than it was
+ * recorded, or as fast as we can if zero.
+ * Returns the replay or NULL on failure (with errno set).
+ */
+struct replay *
+replay_alloc(const char *file, size_t speed)
+{
+	struct replay	*r;
+
+	if (NULL == (r = calloc(1, sizeof(struct replay))))
+		return NULL;
+	r->speed = speed;
+	if (NULL == (r->name = strdup(file)) ||
+	    NULL == (r->f = fopen(file, "r"))) {
+		free(r->name);
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+void
+replay_free(struct replay *r)
+{
+
+	if (NULL == r)
+		return;
+	fclose(r->f);
+	free(r->line);
+	free(r->name);
+	free(r);
+}
+
+/*
+ * When the body last given to a node was received, which acts as the
+ * current time of the replay; or our time if none has been given yet.
+ */
+time_t
+replay_time(const struct replay *r)
+{
+
+	return 0 == r->clock ? time(NULL) : r->clock;
+}
+
+/*
+ * Read the line of the next entry of "r" for one of the nodes "n".
+ * Returns <0 on a malformed log, 0 at its end, >0 on success.
+ */
+static int
+replay_next(struct out *out, struct replay *r,
+	const struct node *n, size_t nsz)
+{
+	struct replayent *e = &r->ent;
+	ssize_t		 len;
+	long long	 secs, since;
+	long		 nsecs;
+	int		 pos;
+	const char	*url;
+
+	if ((len = getline(&r->line, &r->linemax, r->f)) <= 0) {
+		if (ferror(r->f)) {
+			xwarn(out, "%s", r->name);
+			return -1;
+		}
+		return 0;
+	}
+	if ('\n' == r->line[len - 1])
+		r->line[--len] = '\0';
+
+	if (5 != sscanf(r->line, "%lld.%ld %d %lld %zu %n",
+	    &secs, &nsecs, &e->binary, &since, &e->sz, &pos) ||
+	    pos >= len) {
+		xwarnx(out, "%s: malformed entry", r->name);
+		return -1;
+	}
+
+	e->when = secs + nsecs / 1e9;
+	e->since = since;
+	url = r->line + pos;
+
+	for (e->node = 0; e->node < nsz; e->node++)
+		if (0 == strcmp(n[e->node].url, url))
+			break;
+
+	return 1;
+}
+
+/*
+ * Read the body of the current entry of "r" into the read buffer of
+ * node "n", setting up its transfer as if it had just arrived.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+replay_body(struct out *out, struct replay *r, struct node *n)
+{
+	const struct replayent *e = &r->ent;
+	void		*pp;
+
+	if (NULL == n->xfer.rbuf || n->xfer.rbufmax < e->sz) {
+		if (NULL == (pp = realloc(n->xfer.rbuf, e->sz + 1))) {
+			xwarn(out, NULL);
+			return 0;
+		}
+		n->xfer.rbuf = pp;
+		n->xfer.rbufmax = e->sz + 1;
+	}
+
+	if (e->sz != fread(n->xfer.rbuf, 1, e->sz, r->f) ||
+	    '\n' != fgetc(r->f)) {
+		if (ferror(r->f))
+			xwarn(out, "%s", r->name);
+		else
+			xwarnx(out, "%s: truncated entry", r->name);
+		return 0;
+	}
+
+	n->xfer.rbufsz = n->xfer.bodysz = e->sz;
+	n->xfer.hdrsz = 0;
+	n->xfer.zenc = 0;
+	n->xfer.binary = e->binary;
+	n->xfer.since = e->since;
+	n->xfer.etag[0] = '\0';
+	return 1;
+}
+
+/*
+ * Give the nodes "n" the bodies in the log whose time has come.
+ * We stop at an entry for a node whose last body is still being
+ * decoded, which keeps the order of each node's bodies.
+ * Entries for nodes we don't have are skipped.
+ * The time by which we should next be called is put into "next", or
+ * zero if we're to be called when the workers' pipe next wakes us.
+ * Returns <0 on failure, 0 at the end of the log, >0 otherwise.
+ */
+int
+replay_feed(struct out *out, struct replay *r,
+	struct node *n, size_t nsz, time_t *next)
+{
+	struct node	*nd;
+	double		 due;
+	off_t		 off;
+	int		 c;
+
+	while ( ! r->eof) {
+		if ( ! r->pending) {
+			if ((c = replay_next(out, r, n, nsz)) < 0)
+				return -1;
+			else if (0 == c)
+				r->eof = 1;
+			else
+				r->pending = 1;
+			continue;
+		}
+
+		if ( ! r->started) {
+			bench_start(&r->start);
+			r->first = r->ent.when;
+			r->started = 1;
+		}
+
+		/* Seconds until the entry is due. */
+
+		due = 0 == r->speed ? 0.0 :
+			(r->ent.when - r->first) / r->speed -
+			bench_stop(&r->start) / 1e6;
+		if (due > 0.0) {
+			*next = time(NULL) + (time_t)due + 1;
+			return 1;
+		}
+
+		if (r->ent.node == nsz) {
+			off = r->ent.sz + 1;
+			if (-1 == fseeko(r->f, off, SEEK_CUR)) {
+				xwarn(out, "%s", r->name);
+				return -1;
+			}
+			r->pending = 0;
+			continue;
+		}
+
+		/*
+		 * The node's last body is picked up with the workers'
+		 * pipe, which wakes us to go on without a timer.
+		 */
+
+		nd = &n[r->ent.node];
+		if (nd->decoding) {
+			*next = 0;
+			return 1;
+		}
+
+		if ( ! replay_body(out, r, nd))
+			return -1;
+		if ( ! work_submit(nd->work, nd)) {
+			xwarn(out, NULL);
+			return -1;
+		}
+
+		r->clock = r->ent.when;
+		r->pending = 0;
+	}
+
+	*next = 0;
+	return 0;
+}
@@ -0,0 +1,425 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ncurses.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "slant.h"
+
+/*
+ * A response body being decoded into records.
+ * The job owns the buffer holding the body, which was taken from the
+ * node's transfer (it will be given back if the node hasn't since
+ * allocated another).
+ * While a node has a job, its records and tokens belong to the job:
+ * the records may be read but not modified.
+ */
+struct	job {
+	struct node	*n; /* node of the response */
+	char		*buf; /* read or inflate buffer */
+	size_t		 bufmax; /* allocated size of buf */
+	int		 zbuf; /* buf is the inflate buffer */
+	size_t		 off; /* offset of body in buf */
+	size_t		 sz; /* length of body */
+	int		 binary; /* body is binary (not JSON) */
+	time_t		 since; /* requested records since (or zero) */
+	size_t		 depth[INTERVALS]; /* records kept */
+	const struct recset *old; /* node's records when submitted */
+	char		 etag[64]; /* response ETag (or empty) */
+	struct recset	*recs; /* new records (if rc > 0) */
+	int		 rc; /* as with json_parse() */
+	double		 usec; /* time taken to decode */
+	char		*msgs; /* warnings while decoding */
+	size_t		 msgsz; /* length of msgs */
+	TAILQ_ENTRY(job) entries;
+};
+
+TAILQ_HEAD(jobq, job);
+
+/*
+ * Worker threads decoding response bodies.
+ * Jobs are taken from "todo" and put on "done", each time writing to a
+ * pipe the main loop polls so that it wakes up to collect them.
+ */
+struct	work {
+	pthread_mutex_t	 mtx; /* protects following three */
+	pthread_cond_t	 cond; /* signalled with todo or quit */
+	struct jobq	 todo; /* jobs not yet decoded */
+	struct jobq	 done; /* jobs decoded */
+	int		 quit; /* threads should exit */
+	pthread_t	*threads; /* worker threads */
+	size_t		 threadsz; /* number of threads started */
+	int		 fds[2]; /* done notification pipe */
+	struct node	**nodes; /* nodes given new records */
+	size_t		 nodemax; /* allocated nodes */
+	FILE		*record; /* log of bodies (or NULL) */
+};
+
+static void
+job_free(struct job *j)
+{
+
+	if (NULL == j)
+		return;
+	free(j->buf);
+	free(j->msgs);
+	recset_free(j->recs);
+	free(j->recs);
+	free(j);
+}
+
+/*
+ * Decode a response body into a fresh set of records.
+ * This runs on a worker thread, so warnings are collected (and later
+ * emitted by the main loop) instead of being shown.
+ */
+static void
+job_decode(struct job *j)
+{
+	struct out	 out;
+	struct recset	 rs;
+	struct timespec	 ts;
+	const char	*body = j->buf + j->off;
+
+	bench_start(&ts);
+	memset(&out, 0, sizeof(struct out));
+	memset(&rs, 0, sizeof(struct recset));
+
+	if (NULL == (out.errs = open_memstream(&j->msgs, &j->msgsz))) {
+		j->rc = -1;
+		return;
+	}
+
+	if (j->binary)
+		j->rc = binary_parse(&out, j->n, body, j->sz, &rs);
+	else
+		j->rc = json_parse(&out, j->n, body, j->sz, &rs);
+
+	if (j->rc > 0) {
+		j->rc = recset_build(&out, j->n,
+			j->since, j->depth, j->old, &rs, &j->recs);
+		if (j->rc < 0)
+			xwarn(&out, NULL);
+		recset_free(&rs);
+	}
+
+	fclose(out.errs);
+	j->usec = bench_stop(&ts);
+}
+
+static void *
+work_run(void *arg)
+{
+	struct work	*w = arg;
+	struct job	*j;
+
+	pthread_mutex_lock(&w->mtx);
+	for (;;) {
+		while ( ! w->quit && TAILQ_EMPTY(&w->todo))
+			pthread_cond_wait(&w->cond, &w->mtx);
+		if (w->quit)
+			break;
+		j = TAILQ_FIRST(&w->todo);
+		TAILQ_REMOVE(&w->todo, j, entries);
+		pthread_mutex_unlock(&w->mtx);
+
+		job_decode(j);
+
+		pthread_mutex_lock(&w->mtx);
+		TAILQ_INSERT_TAIL(&w->done, j, entries);
+
+		/* If the pipe is full, the main loop is already due. */
+
+		(void)write(w->fds[1], "", 1);
+	}
+	pthread_mutex_unlock(&w->mtx);
+	return NULL;
+}
+
+/*
+ * Start "threads" workers for at most "nodes" nodes, which can each
+ * only have one response being decoded at a time.
+ * Returns the workers or NULL on failure (with errno set).
+ */
+struct work *
+work_alloc(size_t threads, size_t nodes)
+{
+	struct work	*w;
+	int		 er;
+	size_t		 i;
+
+	if (NULL == (w = calloc(1, sizeof(struct work))))
+		return NULL;
+
+	TAILQ_INIT(&w->todo);
+	TAILQ_INIT(&w->done);
+	w->fds[0] = w->fds[1] = -1;
+
+	if (0 != (er = pthread_mutex_init(&w->mtx, NULL))) {
+		free(w);
+		errno = er;
+		return NULL;
+	} else if (0 != (er = pthread_cond_init(&w->cond, NULL))) {
+		pthread_mutex_destroy(&w->mtx);
+		free(w);
+		errno = er;
+		return NULL;
+	}
+
+	if (-1 == pipe2(w->fds, O_NONBLOCK | O_CLOEXEC))
+		goto err;
+
+	w->nodemax = nodes;
+	w->nodes = calloc(nodes, sizeof(struct node *));
+	w->threads = calloc(threads, sizeof(pthread_t));
+	if (NULL == w->nodes || NULL == w->threads)
+		goto err;
+
+	for (i = 0; i < threads; i++) {
+		er = pthread_create(&w->threads[i], NULL, work_run, w);
+		if (0 != er) {
+			errno = er;
+			goto err;
+		}
+		w->threadsz++;
+	}
+
+	return w;
+err:
+	er = errno;
+	work_free(w);
+	errno = er;
+	return NULL;
+}
+
+/*
+ * Stop the workers, waiting for any jobs in progress, and free
+ * everything.
+ * This must be called before the nodes are freed.
+ */
+void
+work_free(struct work *w)
+{
+	struct job	*j;
+	size_t		 i;
+
+	if (NULL == w)
+		return;
+
+	pthread_mutex_lock(&w->mtx);
+	w->quit = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->mtx);
+
+	for (i = 0; i < w->threadsz; i++)
+		pthread_join(w->threads[i], NULL);
+
+	while (NULL != (j = TAILQ_FIRST(&w->todo))) {
+		TAILQ_REMOVE(&w->todo, j, entries);
+		job_free(j);
+	}
+	while (NULL != (j = TAILQ_FIRST(&w->done))) {
+		TAILQ_REMOVE(&w->done, j, entries);
+		job_free(j);
+	}
+
+	if (-1 != w->fds[0])
+		close(w->fds[0]);
+	if (-1 != w->fds[1])
+		close(w->fds[1]);
+
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->mtx);
+	free(w->threads);
+	free(w->nodes);
+	free(w);
+}
+
+/*
+ * Make room for up to "nodes" nodes, which may be more than at
+ * allocation.
+ * Returns zero on memory exhaustion, non-zero on success.
+ */
+int
+work_nodes(struct work *w, size_t nodes)
+{
+	void	*pp;
+
+	if (nodes <= w->nodemax)
+		return 1;
+	pp = reallocarray(w->nodes, nodes, sizeof(struct node *));
+	if (NULL == pp)
+		return 0;
+	w->nodes = pp;
+	w->nodemax = nodes;
+	return 1;
+}
+
+/*
+ * Descriptor readable when jobs are ready to be collected.
+ */
+int
+work_fd(const struct work *w)
+{
+
+	return w->fds[0];
+}
+
+/*
+ * Log the bodies handed to us into "f" (or not, if NULL).
+ * Check the log for errors once done with it.
+ */
+void
+work_record(struct work *w, FILE *f)
+{
+
+	w->record = f;
+}
+
+/*
+ * Hand the complete response body of "n" to the workers.
+ * The buffer holding the body is taken from the node's transfer.
+ * Returns zero on memory exhaustion, non-zero on success.
+ */
+int
+work_submit(struct work *w, struct node *n)
+{
+	struct job	*j;
+
+	if (NULL == (j = calloc(1, sizeof(struct job))))
+		return 0;
+
+	j->n = n;
+	j->binary = n->xfer.binary;
+	j->since = n->xfer.since;
+	memcpy(j->depth, n->depth, sizeof(j->depth));
+	j->old = n->recs;
+	memcpy(j->etag, n->xfer.etag, sizeof(j->etag));
+
+	if (n->xfer.zenc) {
+		j->buf = n->xfer.zbuf;
+		j->bufmax = n->xfer.zbufmax;
+		j->zbuf = 1;
+		j->sz = n->xfer.zbufsz;
+		n->xfer.zbuf = NULL;
+		n->xfer.zbufmax = n->xfer.zbufsz = 0;
+	} else {
+		j->buf = n->xfer.rbuf;
+		j->bufmax = n->xfer.rbufmax;
+		j->off = n->xfer.hdrsz;
+		j->sz = n->xfer.bodysz;
+		n->xfer.rbuf = NULL;
+		n->xfer.rbufmax = n->xfer.rbufsz = 0;
+	}
+
+	if (NULL != w->record)
+		(void)replay_write(w->record, n, j->buf + j->off, j->sz);
+
+	n->decoding = 1;
+
+	pthread_mutex_lock(&w->mtx);
+	TAILQ_INSERT_TAIL(&w->todo, j, entries);
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mtx);
+	return 1;
+}
+
+/*
+ * Install the records of all decoded jobs into their nodes, emitting
+ * their warnings along the way.
+ * The nodes given new records are put into "nodes" and "nodesz".
+ * Returns <0 on fatal error (system should halt), >=0 otherwise.
+ */
+int
+work_collect(struct work *w, struct out *out,
+	struct node *const **nodes, size_t *nodesz)
+{
+	struct jobq	 done;
+	struct job	*j;
+	struct node	*n;
+	char		 buf[64];
+	size_t		 sz = 0;
+	int		 rc = 1;
+
+	while (read(w->fds[0], buf, sizeof(buf)) > 0)
+		continue;
+
+	TAILQ_INIT(&done);
+	pthread_mutex_lock(&w->mtx);
+	TAILQ_CONCAT(&done, &w->done, entries);
+	pthread_mutex_unlock(&w->mtx);
+
+	while (NULL != (j = TAILQ_FIRST(&done))) {
+		TAILQ_REMOVE(&done, j, entries);
+		n = j->n;
+		n->decoding = 0;
+
+		if (NULL != out->bench)
+			bench_add(out->bench, BENCH_DECODE, j->usec);
+
+		if (j->msgsz)
+			xwarnbuf(out, j->msgs, j->msgsz);
+
+		if (j->rc < 0) {
+			xwarnx(out, "response not decoded: %s", n->host);
+			rc = -1;
+		} else if (j->rc > 0) {
+			/* Swap in the new records. */
+			recset_free(n->recs);
+			free(n->recs);
+			n->recs = j->recs;
+			j->recs = NULL;
+			memcpy(n->etag, j->etag, sizeof(n->etag));
+			n->dirty = 1;
+			n->stale = 0;
+			if (0 == j->since)
+				n->refetch = 0;
+			n->lastseen = time(NULL);
+			w->nodes[sz++] = n;
+		} else
+			n->etag[0] = '\0';
+
+		/* Give back the buffer if it hasn't been replaced. */
+
+		if (j->zbuf && NULL == n->xfer.zbuf) {
+			n->xfer.zbuf = j->buf;
+			n->xfer.zbufmax = j->bufmax;
+			j->buf = NULL;
+		} else if ( ! j->zbuf && NULL == n->xfer.rbuf) {
+			n->xfer.rbuf = j->buf;
+			n->xfer.rbufmax = j->bufmax;
+			j->buf = NULL;
+		}
+
+		job_free(j);
+	}
+
+	*nodes = w->nodes;
+	*nodesz = sz;
+	return rc;
+}
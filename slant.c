@@ -14,6 +14,8 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
+#include <sys/file.h>
+#include <sys/ioctl.h>
 #include <sys/queue.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
@@ -23,10 +25,12 @@
 #include <curses.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <locale.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,37 +38,73 @@
 #include <tls.h>
 #include <unistd.h>
 
-#include <kcgi.h>
-#include <kcgijson.h>
-
 #include "extern.h"
 #include "slant.h"
-#include "json.h"
+#include "slant-event.h"
+
+/*
+ * Most worker threads decoding responses.
+ */
+#define	WORK_MAX 4
 
-static	volatile sig_atomic_t sigged;
+/*
+ * Limits on connections in flight.
+ * Nodes ready to connect while we're at the limit are queued, in order,
+ * until others finish.
+ */
+struct	conns {
+	size_t		 max; /* maximum in flight (or zero) */
+	size_t		 active; /* currently in flight */
+	size_t		*queue; /* ring of queued slots */
+	size_t		 qpos; /* head of queue */
+	size_t		 qsz; /* number queued */
+	size_t		 qmax; /* size of ring */
+	size_t		 jitter; /* waittime jitter (percent) */
+};
+
+static	volatile sig_atomic_t sigged; /* exit */
+static	volatile sig_atomic_t sighup; /* reload configuration */
+static	volatile sig_atomic_t sigwinch; /* terminal resized */
 
 static void
 dosig(int code)
 {
 
-	sigged = 1;
+	switch (code) {
+	case SIGHUP:
+		sighup = 1;
+		break;
+	case SIGWINCH:
+		sigwinch = 1;
+		break;
+	default:
+		sigged = 1;
+		break;
+	}
 }
 
-void
-recset_free(struct recset *r)
+/*
+ * Close the connection of a node, if it has one, and free its
+ * resources (but not the node itself).
+ */
+static void
+node_free(struct node *n)
 {
 
-	if (NULL == r)
-		return;
-
-	free(r->version);
-	jsmn_system_clear(&r->system);
-	jsmn_record_free_array(r->byqmin, r->byqminsz);
-	jsmn_record_free_array(r->bymin, r->byminsz);
-	jsmn_record_free_array(r->byhour, r->byhoursz);
-	jsmn_record_free_array(r->byday, r->bydaysz);
-	jsmn_record_free_array(r->byweek, r->byweeksz);
-	jsmn_record_free_array(r->byyear, r->byyearsz);
+	if (NULL != n->xfer.tls)
+		tls_close(n->xfer.tls);
+	if (-1 != n->xfer.pfd->fd)
+		close(n->xfer.pfd->fd);
+	tls_free(n->xfer.tls);
+	free(n->host);
+	free(n->path);
+	free(n->xfer.wbuf);
+	free(n->xfer.rbuf);
+	http_free(n);
+	dns_free(&n->addrs);
+	free(n->toks);
+	recset_free(n->recs);
+	free(n->recs);
 }
 
 static void
@@ -72,140 +112,364 @@ nodes_free(struct node *n, size_t sz)
 {
 	size_t	 i;
 
-	for (i = 0; i < sz; i++) {
-		if (NULL != n[i].xfer.tls)
-			tls_close(n[i].xfer.tls);
-		if (-1 != n[i].xfer.pfd->fd)
-			close(n[i].xfer.pfd->fd);
-		tls_free(n[i].xfer.tls);
-		free(n[i].host);
-		free(n[i].xfer.wbuf);
-		free(n[i].xfer.rbuf);
-		recset_free(n[i].recs);
-		free(n[i].recs);
+	for (i = 0; i < sz; i++)
+		node_free(&n[i]);
+	free(n);
+}
+
+/*
+ * Give node "n" its URL and wait times from the entry "i" of "cfg".
+ */
+static void
+node_config(struct node *n, const struct config *cfg, size_t i)
+{
+
+	n->url = cfg->urls[i].url;
+	if (cfg->urls[i].waittime)
+		n->waittime = cfg->urls[i].waittime;
+	else
+		n->waittime = cfg->waittime;
+	n->hidewait = cfg->hidewait;
+	n->longpoll = cfg->longpoll;
+}
+
+/*
+ * When a node's current wait period ends.
+ * Nodes not shown on screen may wait longer.
+ */
+time_t
+node_waitend(const struct node *n)
+{
+
+	if (n->hidden && n->hidewait > n->waittime)
+		return n->waitstart + n->hidewait + n->waitjitter;
+	if (n->nowait)
+		return n->waitstart;
+	return n->waitstart + n->waittime + n->waitjitter;
+}
+
+/*
+ * Run a single step of the state machine for a node.
+ * We examine the current state (n->state) and perform some task based
+ * upon that.
+ * Return zero on some sort of error condition, non-zero on success.
+ */
+static int
+node_update(struct out *out, struct node *n, time_t t)
+{
+
+	switch (n->state) {
+	case STATE_STARTUP:
+		if (n->waitstart > t)
+			break;
+		n->state = STATE_RESOLVING;
+		n->dirty = 1;
+		return dns_resolve(out, n);
+	case STATE_CONNECT_WAITING:
+		if (node_waitend(n) >= t) 
+			break;
+		n->state = dns_stale(n, t) ?
+			STATE_RESOLVING : STATE_CONNECT_READY;
+		n->nowait = 0;
+		n->dirty = 1;
+		break;
+	case STATE_RESOLVING:
+		return dns_resolve(out, n);
+	case STATE_CONNECT_READY:
+		return http_init_connect(out, n);
+	case STATE_CONNECT:
+		return http_connect(out, n);
+	case STATE_WRITE:
+		return http_write(out, n);
+	case STATE_CLOSE_ERR:
+		return http_close_err(out, n);
+	case STATE_CLOSE_DONE:
+		return http_close_done(out, n);
+	case STATE_READ:
+		return http_read(out, n);
+	case STATE_CONNECT_KEEPALIVE:
+		return http_keepalive(out, n);
+	default:
+		abort();
 	}
 
-	free(n);
+	return 1;
+}
+
+/*
+ * When we next need to visit a node regardless of its descriptor, or
+ * zero if never.
+ * Waiting nodes are visited when their wait time has elapsed; nodes
+ * ready to connect, immediately.
+ * Nodes yet to start are visited when scheduled by node_start(), if
+ * ever.
+ * Nodes waiting on their descriptor are also visited every second, as
+ * before (TLS may have buffered data without the descriptor firing).
+ */
+static time_t
+node_deadline(const struct node *n, time_t t)
+{
+
+	switch (n->state) {
+	case STATE_STARTUP:
+		return n->waitstart;
+	case STATE_CONNECT_WAITING:
+	case STATE_CONNECT_KEEPALIVE:
+		return node_waitend(n) + 1;
+	case STATE_CONNECT_READY:
+		return t;
+	case STATE_RESOLVING:
+	case STATE_CONNECT:
+	case STATE_WRITE:
+	case STATE_CLOSE_ERR:
+	case STATE_CLOSE_DONE:
+	case STATE_READ:
+		return t + 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Whether a node has a connection in flight.
+ * Kept-alive connections waiting for their next request don't count.
+ */
+static int
+node_inflight(const struct node *n)
+{
+
+	switch (n->state) {
+	case STATE_CONNECT:
+	case STATE_WRITE:
+	case STATE_CLOSE_ERR:
+	case STATE_CLOSE_DONE:
+	case STATE_READ:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Give a node that's starting to wait a random offset to its wait
+ * time, so nodes sharing a wait time don't all connect at once.
+ * A node not already phased by node_start() has its first wait offset
+ * by up to a whole wait time, spreading the nodes evenly over the
+ * period; then by the configured percentage.
+ */
+static void
+node_jitter(const struct conns *c, struct node *n)
+{
+	time_t	 j;
+
+	n->waitjitter = 0;
+	if (0 == c->jitter)
+		return;
+
+	if (0 == n->phased) {
+		n->phased = 1;
+		n->waitjitter = arc4random_uniform(n->waittime);
+		return;
+	}
+
+	j = n->waittime * c->jitter / 100;
+	if (j > 0)
+		n->waitjitter = 
+			(time_t)arc4random_uniform(2 * j + 1) - j;
 }
 
 /*
- * Run a single step of the state machine.
- * For each node, we examine the current state (n->state) and perform
- * some task based upon that.
+ * Schedule a new node to start at "t".
+ * If we're jittering, its start is instead offset by up to a whole wait
+ * time, so that the nodes don't all connect at once.
+ * Returns the node's deadline.
+ */
+static time_t
+node_start(const struct conns *c, struct node *n, time_t t)
+{
+
+	n->waitstart = t;
+	if (0 == c->jitter)
+		return t;
+	n->phased = 1;
+	n->waitstart += arc4random_uniform(n->waittime);
+	return n->waitstart;
+}
+
+/*
+ * Run a single step of the state machine, visiting only those nodes
+ * whose descriptors have had an event or whose deadlines have passed,
+ * then giving each its next deadline.
+ * Nodes ready to connect beyond our connection limit are queued, and
+ * the queue is released as connections finish.
  * Return <0 on some sort of error condition or the number of nodes that
  * have changed, which means some sort of window update event should
  * occur to reflect the change.
  */
 static int
-nodes_update(struct out *out, struct node *n, size_t sz)
+nodes_update(struct out *out, struct events *ev, struct conns *c,
+	struct node *nodes, size_t nsz, const size_t *ready, size_t readysz)
 {
-	size_t	 i;
-	time_t	 t = time(NULL);
-	int	 dirty = 0;
-
-	for (i = 0; i < sz; i++) {
-		switch (n[i].state) {
-		case STATE_CONNECT_WAITING:
-			if (n[i].waitstart + n[i].waittime >= t) 
-				break;
-			n[i].state = STATE_CONNECT_READY;
-			n[i].dirty = 1;
-			break;
-		case STATE_CONNECT_READY:
-			if ( ! http_init_connect(out, &n[i]))
-				return -1;
-			break;
-		case STATE_CONNECT:
-			if ( ! http_connect(out, &n[i]))
-				return -1;
-			break;
-		case STATE_WRITE:
-			if ( ! http_write(out, &n[i]))
-				return -1;
-			break;
-		case STATE_CLOSE_ERR:
-			if ( ! http_close_err(out, &n[i]))
-				return -1;
-			break;
-		case STATE_CLOSE_DONE:
-			if ( ! http_close_done(out, &n[i]))
-				return -1;
-			break;
-		case STATE_READ:
-			if ( ! http_read(out, &n[i]))
+	size_t		 i, slot;
+	struct node	*n;
+	enum state	 st;
+	time_t		 t = time(NULL);
+	int		 dirty = 0, was;
+
+	for (i = 0; i < readysz; i++) {
+		if (ready[i] >= nsz)
+			continue;
+		n = &nodes[ready[i]];
+		n->xfer.pfd->revents = 0;
+
+		if (STATE_CONNECT_READY == n->state && 
+		    c->max > 0 && c->active >= c->max) {
+			if ( ! n->queued) {
+				assert(c->qsz < c->qmax);
+				c->queue[(c->qpos + c->qsz++) % 
+					c->qmax] = ready[i];
+				n->queued = 1;
+			}
+			if ( ! events_set(ev, ready[i], 0)) {
+				xwarn(out, NULL);
 				return -1;
-			break;
-		default:
-			abort();
+			}
+			continue;
 		}
 
-		if (n[i].dirty)
+		st = n->state;
+		was = node_inflight(n);
+		if ( ! node_update(out, n, t))
+			return -1;
+
+		if (was && ! node_inflight(n))
+			c->active--;
+		else if ( ! was && node_inflight(n))
+			c->active++;
+
+		if (st != n->state &&
+		    (STATE_CONNECT_WAITING == n->state ||
+		     STATE_CONNECT_KEEPALIVE == n->state))
+			node_jitter(c, n);
+
+		if ( ! events_set(ev, ready[i], node_deadline(n, t))) {
+			xwarn(out, NULL);
+			return -1;
+		}
+		if (n->dirty)
 			dirty++;
 	}
 
+	/* 
+	 * Let queued nodes into any free connections.
+	 * They're counted when they connect on their next visit.
+	 */
+
+	for (i = c->active; c->qsz > 0 && 
+	     (0 == c->max || i < c->max); i++) {
+		slot = c->queue[c->qpos];
+		c->qpos = (c->qpos + 1) % c->qmax;
+		c->qsz--;
+		nodes[slot].queued = 0;
+		if ( ! events_set(ev, slot, t)) {
+			xwarn(out, NULL);
+			return -1;
+		}
+	}
+
 	return dirty;
 }
 
 /*
- * Sort comparator for memory usage.
- * Needs to be run once per iteration.
+ * Compare the newest quarter-minute records' field "f" of two nodes,
+ * larger first.
+ * Nodes without data are sorted last.
  */
 static int
-cmp_mem(const void *p1, const void *p2)
+cmp_field(const struct node *n1, const struct node *n2, enum recfield f)
 {
-	const struct node *n1 = p1, *n2 = p2;
-
-	if (NULL == n1->recs ||
-	    0 == n1->recs->byqminsz)
-		return 1;
-	if (NULL == n2->recs ||
-	    0 == n2->recs->byqminsz)
-		return -1;
-	if (n1->recs->byqmin[0].mem <
-	    n2->recs->byqmin[0].mem)
+	int	 e1, e2;
+	double	 v1, v2;
+
+	e1 = 0 == recset_size(n1->recs, INTERVAL_byqmin);
+	e2 = 0 == recset_size(n2->recs, INTERVAL_byqmin);
+	if (e1 || e2)
+		return e1 - e2;
+	v1 = recset_get(n1->recs, INTERVAL_byqmin, 0, f);
+	v2 = recset_get(n2->recs, INTERVAL_byqmin, 0, f);
+	if (v1 < v2)
 		return 1;
-	if (n1->recs->byqmin[0].mem >
-	    n2->recs->byqmin[0].mem)
+	if (v1 > v2)
 		return -1;
 	return 0;
 }
 
 /*
- * Sort comparator for CPU time.
- * Needs to be run once per iteration.
+ * Sort comparator (on the display order) for memory usage.
+ */
+static int
+cmp_mem(const void *p1, const void *p2)
+{
+
+	return cmp_field(*(struct node *const *)p1, 
+		*(struct node *const *)p2, RECF_MEM);
+}
+
+/*
+ * Sort comparator (on the display order) for CPU time.
  */
 static int
 cmp_cpu(const void *p1, const void *p2)
 {
-	const struct node *n1 = p1, *n2 = p2;
 
-	if (NULL == n1->recs ||
-	    0 == n1->recs->byqminsz)
-		return 1;
-	if (NULL == n2->recs ||
-	    0 == n2->recs->byqminsz)
-		return -1;
-	if (n1->recs->byqmin[0].cpu <
-	    n2->recs->byqmin[0].cpu)
-		return 1;
-	if (n1->recs->byqmin[0].cpu >
-	    n2->recs->byqmin[0].cpu)
-		return -1;
-	return 0;
+	return cmp_field(*(struct node *const *)p1, 
+		*(struct node *const *)p2, RECF_CPU);
 }
 
 /*
- * Sort comparator for hostnames.
+ * Sort comparator (on the display order) for hostnames.
  * Needs to only be run once for the list.
  */
 static int
 cmp_host(const void *p1, const void *p2)
 {
-	const struct node *n1 = p1, *n2 = p2;
+	const struct node *n1 = *(struct node *const *)p1, 
+	      		  *n2 = *(struct node *const *)p2;
 
 	return strcmp(n1->host, n2->host);
 }
 
+/*
+ * Move the node at position "p" of the display order "order" into its
+ * sorted position by stepping it over its neighbours, keeping the
+ * order stable.
+ * This is much cheaper than re-sorting when one node has changed.
+ */
+static void
+order_fix(struct node **order, size_t sz, size_t p,
+	int (*cmp)(const void *, const void *))
+{
+	struct node	*tmp;
+
+	while (p > 0 && cmp(&order[p - 1], &order[p]) > 0) {
+		tmp = order[p - 1];
+		order[p - 1] = order[p];
+		order[p] = tmp;
+		order[p]->row = p;
+		p--;
+		order[p]->row = p;
+	}
+
+	while (p + 1 < sz && cmp(&order[p], &order[p + 1]) > 0) {
+		tmp = order[p + 1];
+		order[p + 1] = order[p];
+		order[p] = tmp;
+		order[p]->row = p;
+		p++;
+		order[p]->row = p;
+	}
+}
+
 /*
  * Common leading material for all logging messages.
  */
@@ -242,7 +506,7 @@ xwarn(struct out *out, const char *fmt, ...)
 		}
 		wprintw(out->errwin, "%s%s\n", 
 			NULL == fmt ? "" : ": ", strerror(er));
-		wrefresh(out->errwin);
+		wnoutrefresh(out->errwin);
 	}
 
 	if (NULL != fmt) {
@@ -275,7 +539,7 @@ xwarnx(struct out *out, const char *fmt, ...)
 			va_end(ap);
 		}
 		waddch(out->errwin, '\n');
-		wrefresh(out->errwin);
+		wnoutrefresh(out->errwin);
 	}
 
 	fprintf(out->errs, "Warning: ");
@@ -286,6 +550,37 @@ xwarnx(struct out *out, const char *fmt, ...)
 	fflush(out->errs);
 }
 
+/*
+ * Emit the messages "buf" of length "sz" collected by another thread,
+ * which may not touch the screen, into an "out" without a window.
+ * Everything is passed to the error file; warnings (but not, e.g., the
+ * dumps of bad responses) are also shown in the window.
+ */
+void
+xwarnbuf(struct out *out, const char *buf, size_t sz)
+{
+	const char	*end, *cp;
+	size_t		 len;
+
+	for (end = buf + sz; buf < end; buf += len) {
+		cp = memchr(buf, '\n', end - buf);
+		len = NULL == cp ? (size_t)(end - buf) : 
+			(size_t)(cp - buf) + 1;
+		if (NULL != out->errwin && len > 9 &&
+		    0 == strncmp(buf, "Warning: ", 9)) {
+			xloghead(out);
+			wattron(out->errwin, A_BOLD);
+			waddstr(out->errwin, "Warning");
+			wattroff(out->errwin, A_BOLD);
+			waddnstr(out->errwin, buf + 7, len - 7);
+			wnoutrefresh(out->errwin);
+		}
+		fwrite(buf, 1, len, out->errs);
+	}
+
+	fflush(out->errs);
+}
+
 /*
  * Emit debugging message if "out->debug" has been set.
  */
@@ -305,7 +600,7 @@ xdbg(struct out *out, const char *fmt, ...)
 			va_end(ap);
 		}
 		waddch(out->errwin, '\n');
-		wrefresh(out->errwin);
+		wnoutrefresh(out->errwin);
 	}
 
 	if (NULL != fmt) {
@@ -332,11 +627,15 @@ layout(struct config *cfg, struct out *out, size_t maxx,
 
 	if (NULL != cfg->draw) {
 		d->header = cfg->draw->header;
+		d->summary = cfg->draw->summary;
+		memcpy(d->thresh, cfg->draw->thresh, sizeof(d->thresh));
 		d->errlog = cfg->draw->errlog;
-		if (d->errlog >= maxy - d->header) 
+		if (d->errlog >= maxy - d->header - d->summary) 
 			return 0;
 	} else {
 		d->header = 1;
+		d->summary = 0;
+		memset(d->thresh, 0, sizeof(d->thresh));
 		if (maxy > 60)
 			d->errlog = 10;
 		else if (maxy > 40)
@@ -412,17 +711,392 @@ layout(struct config *cfg, struct out *out, size_t maxx,
 	return maxx > compute_width(n, nsz, d);
 }
 
+/*
+ * Set which intervals node "n" asks for (and how many of each it keeps)
+ * from what "d" draws.
+ * If that's more than it has, its next request is for all records, as
+ * asking only for what's changed wouldn't fill in the rest.
+ */
+static void
+node_intervals(struct node *n, const struct draw *d)
+{
+	size_t		 depth[INTERVALS], i;
+	unsigned int	 ivs;
+
+	ivs = draw_intervals(d, depth);
+
+	if (NULL != n->recs) {
+		if (n->intervals && (0 == ivs || (ivs & ~n->intervals)))
+			n->refetch = 1;
+		for (i = 0; i < INTERVALS; i++)
+			if (depth[i] > n->depth[i])
+				n->refetch = 1;
+		if (n->refetch)
+			n->etag[0] = '\0';
+	}
+
+	n->intervals = ivs;
+	n->timing = draw_timings(d);
+	memcpy(n->depth, depth, sizeof(n->depth));
+}
+
+/*
+ * Lay out the screen for the nodes "n" from "cfg", (re-)creating our
+ * windows to fit, and have the nodes ask for what's drawn (unless we're
+ * a relay, which asks for everything).
+ * If the screen's too small, the main window is all of it (there's no
+ * error window) and should only say so.
+ * Returns <0 on memory exhaustion, 0 if the screen's too small, >0 on
+ * success.
+ */
+static int
+screen_layout(struct config *cfg, struct out *out, struct draw *d,
+	struct node *n, size_t nsz, int relay)
+{
+	int	 c, maxy, maxx;
+	size_t	 i;
+
+	getmaxyx(stdscr, maxy, maxx);
+
+	free(d->box);
+	d->box = NULL;
+	d->boxsz = d->errlog = 0;
+
+	if ((c = layout(cfg, out, maxx, maxy, n, nsz, d)) < 0)
+		return c;
+	if (0 == c)
+		d->errlog = 0;
+
+	if (NULL != out->errwin)
+		delwin(out->errwin);
+	if (NULL != out->mainwin)
+		delwin(out->mainwin);
+	out->errwin = out->mainwin = NULL;
+
+	assert((size_t)maxy > d->errlog);
+	out->mainwin = subwin(stdscr, maxy - d->errlog, maxx, 0, 0);
+	if (NULL == out->mainwin)
+		return -1;
+	if (d->errlog) {
+		out->errwin = subwin(stdscr, 0, maxx, maxy - d->errlog, 0);
+		if (NULL == out->errwin)
+			return -1;
+		scrollok(out->errwin, 1);
+	}
+
+	keypad(out->mainwin, TRUE);
+	nodelay(out->mainwin, TRUE);
+
+	if (0 == c) {
+		waddstr(out->mainwin, "insufficient screen dimensions");
+		wnoutrefresh(out->mainwin);
+		return 0;
+	}
+
+	if ( ! relay)
+		for (i = 0; i < nsz; i++)
+			node_intervals(&n[i], d);
+
+	return 1;
+}
+
+/*
+ * Set up the display order "order" of the nodes "n", sorting it with
+ * "cmp" if not NULL.
+ */
+static void
+order_init(struct node **order, struct node *n, size_t nsz,
+	int (*cmp)(const void *, const void *))
+{
+	size_t	 i;
+
+	for (i = 0; i < nsz; i++)
+		order[i] = &n[i];
+	if (NULL != cmp)
+		qsort(order, nsz, sizeof(struct node *), cmp);
+	for (i = 0; i < nsz; i++)
+		order[i]->row = i;
+}
+
+/*
+ * Re-allocate the display order "orderp" for the nodes "n".
+ * The order is set up as with order_init().
+ * The rows and summary of "d" are re-allocated to match.
+ * Returns zero on memory exhaustion, non-zero on success.
+ */
+static int
+fleet_display(struct draw *d, struct node ***orderp,
+	struct node *n, size_t nsz, int (*cmp)(const void *, const void *))
+{
+	void	*pp;
+
+	pp = reallocarray(*orderp, nsz, sizeof(struct node *));
+	if (NULL == pp)
+		return 0;
+	*orderp = pp;
+
+	pp = reallocarray(d->rows, nsz, sizeof(struct drawrow));
+	if (NULL == pp)
+		return 0;
+	d->rows = pp;
+	d->rowsz = nsz;
+	memset(d->rows, 0, nsz * sizeof(struct drawrow));
+
+	if ( ! draw_sum_alloc(&d->sum, nsz))
+		return 0;
+
+	order_init(*orderp, n, nsz, cmp);
+	return 1;
+}
+
+/*
+ * Give the https nodes "n" the TLS configuration "cfgp" shared by all
+ * connections, creating it if we haven't already.
+ * Its CA store is loaded into memory just once, so connections needn't
+ * read it from disk as we run, and http-only fleets never read it.
+ * Failing to load the CA store is only warned of: the https nodes are
+ * left without a configuration and fail as they connect, and we try
+ * again when next called.
+ * Returns zero on memory exhaustion, non-zero otherwise.
+ */
+static int
+fleet_tls(struct out *out, struct tls_config **cfgp,
+	struct node *n, size_t nsz)
+{
+	struct tls_config *cfg;
+	uint8_t		*ca;
+	size_t		 i, casz;
+
+	for (i = 0; i < nsz; i++)
+		if (n[i].addrs.https)
+			break;
+	if (i == nsz)
+		return 1;
+
+	if (NULL == *cfgp) {
+		if (NULL == (cfg = tls_config_new())) {
+			xwarn(out, "tls_config_new");
+			return 0;
+		}
+		if (-1 == tls_config_set_protocols(cfg, TLS_PROTOCOLS_ALL)) {
+			xwarnx(out, "tls_config_set_protocols: %s",
+				tls_config_error(cfg));
+			tls_config_free(cfg);
+			return 0;
+		}
+		ca = tls_load_file(tls_default_ca_cert_file(), &casz, NULL);
+		if (NULL == ca) {
+			xwarn(out, "%s", tls_default_ca_cert_file());
+			tls_config_free(cfg);
+			return 1;
+		}
+		if (-1 == tls_config_set_ca_mem(cfg, ca, casz)) {
+			xwarnx(out, "tls_config_set_ca_mem: %s",
+				tls_config_error(cfg));
+			tls_unload_file(ca, casz);
+			tls_config_free(cfg);
+			return 1;
+		}
+		tls_unload_file(ca, casz);
+		*cfgp = cfg;
+	}
+
+	for (i = 0; i < nsz; i++)
+		if (n[i].addrs.https)
+			n[i].xfer.tlscfg = *cfgp;
+	return 1;
+}
+
+/*
+ * Re-read the configuration "cfgfile" (with "argc" and "argv" as at
+ * start-up) into "cfg", making the nodes "np" (with "pfdsp" and their
+ * events "evp") those of its URLs.
+ * Nodes whose URLs we already had are kept as they are, connections
+ * and records and all, but for their wait times: the rest are freed or
+ * created afresh.
+ * The descriptors and events are re-allocated, their slots being laid
+ * out as at start-up (without a replay or relay).
+ * New https nodes share the TLS configuration "tlscfgp" (see
+ * fleet_tls()).
+ * No node may be decoding, as the nodes are moved.
+ * Returns <0 on fatal error, 0 if the configuration wasn't usable (so
+ * nothing has changed), >0 on success.
+ */
+static int
+fleet_reload(struct out *out, const char *cfgfile, int argc, 
+	char *argv[], struct config *cfg, struct node **np, 
+	struct pollfd **pfdsp, struct events **evp, const sigset_t *mask,
+	struct conns *conns, struct work *work, struct tls_config **tlscfgp)
+{
+	struct config	 nc;
+	struct node	*n = *np, *nn = NULL;
+	struct pollfd	*pfds = NULL;
+	struct events	*ev;
+	char		*kept = NULL;
+	size_t		 i, j, sz, *queue = NULL;
+	time_t		 t;
+
+	if ( ! config_parse(cfgfile, &nc, argc, argv)) {
+		config_free(&nc);
+		xwarnx(out, "%s: not reloaded", cfgfile);
+		return 0;
+	} else if (0 == nc.urlsz) {
+		config_free(&nc);
+		xwarnx(out, "%s: no urls: not reloaded", cfgfile);
+		return 0;
+	}
+
+	sz = nc.urlsz;
+	nn = calloc(sz, sizeof(struct node));
+	pfds = calloc(sz + 2, sizeof(struct pollfd));
+	queue = calloc(sz, sizeof(size_t));
+	kept = calloc(cfg->urlsz, 1);
+	if (NULL == nn || NULL == pfds || NULL == queue || 
+	    NULL == kept || ! work_nodes(work, sz)) {
+		xwarn(out, NULL);
+		free(nn);
+		free(pfds);
+		free(queue);
+		free(kept);
+		config_free(&nc);
+		return -1;
+	}
+
+	/* 
+	 * Move over the nodes we keep along with their descriptors.
+	 * New nodes are those yet to start that aren't scheduled.
+	 */
+
+	for (i = 0; i < sz; i++) {
+		for (j = 0; j < cfg->urlsz; j++)
+			if ( ! kept[j] && 
+			    0 == strcmp(n[j].url, nc.urls[i].url))
+				break;
+		if (j < cfg->urlsz) {
+			kept[j] = 1;
+			nn[i] = n[j];
+			pfds[i] = *n[j].xfer.pfd;
+			pfds[i].revents = 0;
+			node_config(&nn[i], &nc, i);
+		} else {
+			pfds[i].fd = -1;
+			nn[i].state = STATE_STARTUP;
+			node_config(&nn[i], &nc, i);
+			for (j = 0; j < INTERVALS; j++)
+				nn[i].depth[j] = SIZE_MAX;
+			nn[i].timing = 1;
+			nn[i].work = work;
+			dns_parse_url(out, &nn[i]);
+		}
+		nn[i].xfer.pfd = &pfds[i];
+		nn[i].queued = 0;
+	}
+
+	pfds[sz] = (*pfdsp)[cfg->urlsz];
+	pfds[sz + 1] = (*pfdsp)[cfg->urlsz + 1];
+	pfds[sz].revents = pfds[sz + 1].revents = 0;
+
+	if ( ! fleet_tls(out, tlscfgp, nn, sz) ||
+	    NULL == (ev = events_alloc(pfds, sz + 2, mask))) {
+		xwarn(out, NULL);
+		for (i = 0; i < sz; i++)
+			if (STATE_STARTUP == nn[i].state &&
+			    0 == nn[i].waitstart)
+				node_free(&nn[i]);
+		free(nn);
+		free(pfds);
+		free(queue);
+		free(kept);
+		config_free(&nc);
+		return -1;
+	}
+
+	for (j = 0; j < cfg->urlsz; j++)
+		if ( ! kept[j])
+			node_free(&n[j]);
+
+	free(kept);
+	free(n);
+	free(*pfdsp);
+	events_free(*evp);
+	config_free(cfg);
+
+	*cfg = nc;
+	*np = nn;
+	*pfdsp = pfds;
+	*evp = ev;
+
+	out->latencylog = cfg->latencylog;
+
+	/* 
+	 * Count what's in flight anew: those that were queued simply
+	 * queue again when they're next visited, which is now.
+	 */
+
+	free(conns->queue);
+	conns->queue = queue;
+	conns->qmax = sz;
+	conns->qpos = conns->qsz = conns->active = 0;
+	conns->max = cfg->maxconns;
+	conns->jitter = cfg->jitter;
+
+	for (i = 0; i < sz; i++) {
+		if (node_inflight(&nn[i]))
+			conns->active++;
+		if (STATE_STARTUP == nn[i].state &&
+		    0 == nn[i].waitstart)
+			t = node_start(conns, &nn[i], time(NULL));
+		else
+			t = node_deadline(&nn[i], time(NULL));
+		if ( ! events_set(ev, i, t)) {
+			xwarn(out, NULL);
+			return -1;
+		}
+	}
+
+	if ( ! events_set(ev, sz, 0) || ! events_set(ev, sz + 1, 0)) {
+		xwarn(out, NULL);
+		return -1;
+	}
+
+	return 1;
+}
+
 int
 main(int argc, char *argv[])
 {
-	int	 	 c, first = 1, maxy, maxx;
-	size_t		 i, sz;
-	const char	*cfgfile = NULL;
+	int	 	 c, first = 1, scrolled = 0, toosmall = 0;
+	size_t		 i, j;
+	char		*cfgfile = NULL;
 	struct node	*n = NULL;
+	struct node	**order = NULL;
+	int		(*cmp)(const void *, const void *) = NULL;
+	const size_t	*ready;
+	size_t		 readysz;
 	struct pollfd	*pfds = NULL;
-	struct timespec	 ts;
+	struct events	*ev = NULL;
+	struct work	*work = NULL;
+	struct node *const *decoded;
+	size_t		 decodedsz, slot, pfdsz;
+	long		 ncpu;
+	int		 benchsecs = 0, headless;
+	const char	*relayaddr = NULL;
+	struct relay	*relay = NULL;
+	size_t		 relayslot, replayslot;
+	const char	*recfile = NULL, *replayfile = NULL;
+	FILE		*recf = NULL;
+	struct replay	*replay = NULL;
+	size_t		 speed = 1;
+	int		 usecache = 0, cachefd = -1, replaydone = 0;
+	FILE		*nullf = NULL;
+	SCREEN		*scr = NULL;
+	struct timespec	 cycle, ts;
+	const char	*er;
+	struct conns	 conns;
+	struct tls_config *tlscfg = NULL;
 	sigset_t	 mask, oldmask;
-	time_t		 last, now;
+	struct winsize	 ws;
+	time_t		 last, now, next;
 	char		*cp;
 	struct draw	 d;
 	struct config	 cfg;
@@ -435,7 +1109,7 @@ main(int argc, char *argv[])
 
 	/* Initial pledge. */
 
-	if (-1 == pledge("cpath wpath tty rpath dns inet stdio", NULL))
+	if (-1 == pledge("cpath wpath flock tty rpath dns inet stdio", NULL))
 		err(EXIT_FAILURE, NULL);
 
 	memset(&out, 0, sizeof(struct out));
@@ -458,11 +1132,6 @@ main(int argc, char *argv[])
 		err(EXIT_FAILURE, "%s", cp);
 	free(cp);
 
-	/* Repledge by dropping the error log pledges. */
-
-	if (-1 == pledge("tty rpath dns inet stdio", NULL))
-		err(EXIT_FAILURE, NULL);
-
 	/* Start up TLS handling really early. */
 
 	if (tls_init() < 0)
@@ -470,9 +1139,11 @@ main(int argc, char *argv[])
 
 	/* 
 	 * Establish our signal handling: have TERM, QUIT, and INT
-	 * interrupt the poll and cause us to exit.
+	 * interrupt our event wait and cause us to exit, HUP to reload
+	 * our configuration, and WINCH to lay out the screen anew.
 	 * Otherwise, we block the signal.
-	 * TODO: handle SINGWINCH.
+	 * Ignore PIPE: a server may close an idle keep-alive connection
+	 * just as we write to it.
 	 */
 
 	if (sigemptyset(&mask) < 0)
@@ -483,19 +1154,37 @@ main(int argc, char *argv[])
 		err(EXIT_FAILURE, NULL);
 	if (SIG_ERR == signal(SIGINT, dosig))
 		err(EXIT_FAILURE, NULL);
+	if (SIG_ERR == signal(SIGHUP, dosig))
+		err(EXIT_FAILURE, NULL);
+	if (SIG_ERR == signal(SIGWINCH, dosig))
+		err(EXIT_FAILURE, NULL);
+	if (SIG_ERR == signal(SIGPIPE, SIG_IGN))
+		err(EXIT_FAILURE, NULL);
 	if (sigaddset(&mask, SIGTERM) < 0)
 		err(EXIT_FAILURE, NULL);
 	if (sigaddset(&mask, SIGQUIT) < 0)
 		err(EXIT_FAILURE, NULL);
 	if (sigaddset(&mask, SIGINT) < 0)
 		err(EXIT_FAILURE, NULL);
+	if (sigaddset(&mask, SIGHUP) < 0)
+		err(EXIT_FAILURE, NULL);
+	if (sigaddset(&mask, SIGWINCH) < 0)
+		err(EXIT_FAILURE, NULL);
 	if (sigprocmask(SIG_BLOCK, &mask, &oldmask) < 0)
 		err(EXIT_FAILURE, NULL);
 
 	/* Parse arguments. */
 
-	while (-1 != (c = getopt(argc, argv, "f:o:w:"))) 
+	while (-1 != (c = getopt(argc, argv, "B:Cf:o:r:R:s:w:"))) 
 		switch (c) {
+		case 'B':
+			benchsecs = strtonum(optarg, 1, INT_MAX, &er);
+			if (NULL != er)
+				errx(EXIT_FAILURE, "-B: %s", er);
+			break;
+		case 'C':
+			usecache = 1;
+			break;
 		case 'f':
 			cfgfile = strdup(optarg);
 			break;
@@ -511,6 +1200,20 @@ main(int argc, char *argv[])
 			else
 				goto usage;
 			break;
+		case 'r':
+			replayfile = optarg;
+			break;
+		case 'R':
+			relayaddr = optarg;
+			break;
+		case 's':
+			speed = strtonum(optarg, 0, INT_MAX, &er);
+			if (NULL != er)
+				errx(EXIT_FAILURE, "-s: %s", er);
+			break;
+		case 'w':
+			recfile = optarg;
+			break;
 		default:
 			goto usage;
 		}
@@ -518,26 +1221,58 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	/* Replays neither record nor touch the cache. */
+
+	if (NULL != replayfile && (NULL != recfile || usecache))
+		goto usage;
+
 	/*
-	 * Parse our configuration file.
-	 * This will tell us all we need to know about our runtime.
-	 * Use "cp" as a temporary variable in case we need to create
-	 * the configuration file name on-demand.
+	 * Open what we record into, replay from, or cache in, which for
+	 * the first and last might mean creating them.
+	 * The cache is locked so that we don't trample another's.
 	 */
 
-	cp = NULL;
-	if (NULL == cfgfile) {
-		c = asprintf(&cp, "%s/.slantrc", getenv("HOME"));
+	if (NULL != recfile && NULL == (recf = fopen(recfile, "a")))
+		err(EXIT_FAILURE, "%s", recfile);
+
+	if (NULL != replayfile &&
+	    NULL == (replay = replay_alloc(replayfile, speed)))
+		err(EXIT_FAILURE, "%s", replayfile);
+
+	if (usecache) {
+		c = asprintf(&cp, "%s/.slant-cache", getenv("HOME"));
 		if (c < 0)
 			err(EXIT_FAILURE, NULL);
-		cfgfile = cp;
-	} 
+		cachefd = open(cp, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if (-1 == cachefd)
+			err(EXIT_FAILURE, "%s", cp);
+		if (-1 == flock(cachefd, LOCK_EX | LOCK_NB)) {
+			warn("%s", cp);
+			close(cachefd);
+			cachefd = -1;
+		}
+		free(cp);
+	}
 
-	c = config_parse(cfgfile, &cfg, argc, argv);
-	free(cp);
-	if ( ! c)
+	/* Repledge by dropping the file creation pledges. */
+
+	if (-1 == pledge("tty rpath dns inet stdio", NULL))
+		err(EXIT_FAILURE, NULL);
+
+	/*
+	 * Parse our configuration file.
+	 * This will tell us all we need to know about our runtime.
+	 * Its name is kept, as it's parsed again when reloading.
+	 */
+
+	if (NULL == cfgfile &&
+	    asprintf(&cfgfile, "%s/.slantrc", getenv("HOME")) < 0)
+		err(EXIT_FAILURE, NULL);
+	if ( ! config_parse(cfgfile, &cfg, argc, argv))
 		return EXIT_FAILURE;
 
+	out.latencylog = cfg.latencylog;
+
 	/* 
 	 * Initialise data.
 	 * On any failure---which in this block will be memory
@@ -548,36 +1283,118 @@ main(int argc, char *argv[])
 	if (0 == cfg.urlsz)
 		errx(EXIT_FAILURE, "no urls given");
 
+	if (benchsecs && NULL == (out.bench = bench_alloc()))
+		err(EXIT_FAILURE, NULL);
+
+	headless = NULL != out.bench || NULL != relayaddr;
+
 	n = calloc(cfg.urlsz, sizeof(struct node));
 	if (NULL == n)
 		err(EXIT_FAILURE, NULL);
 
-	pfds = calloc(cfg.urlsz, sizeof(struct pollfd));
+	/* 
+	 * The last descriptors are for keyboard input and for our
+	 * workers having decoded responses, then a timer (without a
+	 * descriptor) for our replay, if replaying, and then for our
+	 * relay's listener and clients, if we're a relay.
+	 */
+
+	replayslot = cfg.urlsz + 2;
+	relayslot = replayslot + (NULL != replay ? 1 : 0);
+	pfdsz = relayslot + (NULL != relayaddr ? RELAY_SLOTS : 0);
+	pfds = calloc(pfdsz, sizeof(struct pollfd));
 	if (NULL == pfds)
 		err(EXIT_FAILURE, NULL);
 
+	order = calloc(cfg.urlsz, sizeof(struct node *));
+	if (NULL == order)
+		err(EXIT_FAILURE, NULL);
+
+	/*
+	 * Decode responses on a few worker threads (started after we've
+	 * blocked our signals, so they're only seen by the event loop).
+	 * Parsing big responses thus doesn't hold up input or drawing.
+	 */
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)
+		ncpu = 1;
+	else if (ncpu > WORK_MAX)
+		ncpu = WORK_MAX;
+	if ((size_t)ncpu > cfg.urlsz)
+		ncpu = cfg.urlsz;
+
+	if (NULL == (work = work_alloc(ncpu, cfg.urlsz)))
+		err(EXIT_FAILURE, NULL);
+	work_record(work, recf);
+
+	pfds[cfg.urlsz].fd = headless ? -1 : STDIN_FILENO;
+	pfds[cfg.urlsz].events = POLLIN;
+	pfds[cfg.urlsz + 1].fd = work_fd(work);
+	pfds[cfg.urlsz + 1].events = POLLIN;
+	if (NULL != replay)
+		pfds[replayslot].fd = -1;
+
+	if (NULL != relayaddr) {
+		relay = relay_alloc(relayaddr, &pfds[relayslot],
+			relayslot, n, cfg.urlsz);
+		if (NULL == relay)
+			exit(EXIT_FAILURE);
+	}
+
+	ev = events_alloc(pfds, pfdsz, &mask);
+	if (NULL == ev)
+		err(EXIT_FAILURE, NULL);
+
+	memset(&conns, 0, sizeof(struct conns));
+	conns.max = cfg.maxconns;
+	conns.jitter = cfg.jitter;
+	conns.qmax = cfg.urlsz;
+	conns.queue = calloc(cfg.urlsz, sizeof(size_t));
+	if (NULL == conns.queue)
+		err(EXIT_FAILURE, NULL);
+
 	for (i = 0; i < cfg.urlsz; i++) {
 		pfds[i].fd = -1;
 		n[i].xfer.pfd = &pfds[i];
 		n[i].state = STATE_STARTUP;
-		n[i].url = cfg.urls[i].url;
-		if (cfg.urls[i].waittime)
-			n[i].waittime = cfg.urls[i].waittime;
-		else
-			n[i].waittime = cfg.waittime;
+		node_config(&n[i], &cfg, i);
+		for (j = 0; j < INTERVALS; j++)
+			n[i].depth[j] = SIZE_MAX;
+		n[i].timing = 1;
+		n[i].work = work;
 		dns_parse_url(&out, &n[i]);
 	}
 
+	/*
+	 * All https connections share one TLS configuration, with the
+	 * CA store loaded into memory just once.
+	 */
+
+	if ( ! fleet_tls(&out, &tlscfg, n, cfg.urlsz))
+		errx(EXIT_FAILURE, "TLS configuration failed");
+
 	/* 
 	 * All data initialised.
 	 * Get our window system ready to roll.
 	 * Once we initialise the screen, we're going to need to use our
 	 * "errs" and "errwin" to report errors, as stderr will just
 	 * munge on the screen.
+	 * Benchmarks and relays draw into a screen of all hosts that's
+	 * written to /dev/null, so they don't need a terminal (or
+	 * colours), and leave standard output for the results.
 	 */
 
-	if (NULL == initscr() ||
-	    ERR == start_color() ||
+	if (headless) {
+		if (NULL == (nullf = fopen("/dev/null", "r+")))
+			err(EXIT_FAILURE, "/dev/null");
+		if (NULL == (scr = newterm(NULL, nullf, nullf)))
+			errx(EXIT_FAILURE, "newterm");
+		resizeterm(cfg.urlsz + 24, 160);
+	} else if (NULL == initscr())
+		exit(EXIT_FAILURE);
+
+	if ((ERR == start_color() && ! headless) ||
 	    ERR == cbreak() ||
 	    ERR == noecho() ||
 	    ERR == nonl())
@@ -586,11 +1403,14 @@ main(int argc, char *argv[])
 	curs_set(0);
 	init_pair(1, COLOR_YELLOW, COLOR_BLACK);
 	init_pair(2, COLOR_RED, COLOR_BLACK);
-	getmaxyx(stdscr, maxy, maxx);
 
-	/* Configure what we see, bailing if it's not possible. */
+	/* 
+	 * Configure what we see, bailing if it's not possible.
+	 * We only fetch (and keep) the newest records of what we draw,
+	 * unless we're relaying, which serves all of them.
+	 */
 
-	c = layout(&cfg, &out, maxx, maxy, n, cfg.urlsz, &d);
+	c = screen_layout(&cfg, &out, &d, n, cfg.urlsz, NULL != relay);
 	if (c < 0) {
 		endwin();
 		warn(NULL);
@@ -601,101 +1421,340 @@ main(int argc, char *argv[])
 		goto out;
 	}
 
-	assert((size_t)maxy > d.errlog);
-	out.mainwin = subwin(stdscr, maxy - d.errlog, maxx, 0, 0);
-	if (d.errlog) {
-		out.errwin = subwin(stdscr, 0, maxx, maxy - d.errlog, 0);
-		scrollok(out.errwin, 1);
+	/* Show what we last saw until we're up to date. */
+
+	if (-1 != cachefd && ! cache_load(&out, cachefd, n, cfg.urlsz)) {
+		endwin();
+		warn(NULL);
+		goto out;
 	}
 
-	for (i = 0; i < cfg.urlsz; i++) {
-		n[i].state = STATE_RESOLVING;
-		if ( ! dns_resolve(&out, n[i].host, &n[i].addrs))
+	d.rowsz = cfg.urlsz;
+	d.rows = calloc(d.rowsz, sizeof(struct drawrow));
+	if (NULL == d.rows || ! draw_sum_alloc(&d.sum, cfg.urlsz)) {
+		endwin();
+		warn(NULL);
+		goto out;
+	}
+
+	/*
+	 * Set up our display order.
+	 * Hostnames needn't be sorted more than once.
+	 * Cached records are ordered as if they'd just arrived.
+	 */
+
+	switch (d.order) {
+	case DRAWORD_CPU:
+		cmp = cmp_cpu;
+		break;
+	case DRAWORD_MEM:
+		cmp = cmp_mem;
+		break;
+	default:
+		break;
+	}
+
+	order_init(order, n, cfg.urlsz, DRAWORD_HOST == d.order ? 
+		cmp_host : -1 != cachefd ? cmp : NULL);
+
+	/* 
+	 * Schedule all nodes now (or spread over their wait times, if
+	 * we're jittering).
+	 * They start by resolving their hosts, which all run at once
+	 * within our event loop.
+	 * If we're replaying, they're instead given what's in the log
+	 * (as driven by its timer), so they never connect.
+	 */
+
+	for (i = 0; NULL == replay && i < cfg.urlsz; i++) {
+		if ( ! events_set(ev, i, 
+		    node_start(&conns, &n[i], time(NULL)))) {
+			xwarn(&out, NULL);
 			goto out;
-		n[i].state = STATE_CONNECT_READY;
+		}
+	}
+
+	if ( ! events_set(ev, cfg.urlsz, 0) ||
+	    ! events_set(ev, cfg.urlsz + 1, 0) ||
+	    (NULL != replay && ! events_set(ev, replayslot, time(NULL))) ||
+	    (NULL != relay && ! events_set(ev, relayslot, 0))) {
+		xwarn(&out, NULL);
+		goto out;
 	}
 
 	/* 
-	 * FIXME: rpath needed by libressl.
-	 * We can relieve this by pre-loading our certs.
+	 * We've pre-loaded our certs, so we needn't rpath, unless we
+	 * might reload our configuration (relays and replays don't).
+	 * We keep dns as hosts are (re-)resolved as we run.
 	 */
 
-	if (-1 == pledge("tty rpath inet stdio", NULL))
+	if (-1 == pledge(NULL == relay && NULL == replay ? 
+	    "tty rpath dns inet stdio" : "tty dns inet stdio", NULL))
 		err(EXIT_FAILURE, NULL);
 
 	/* Main loop. */
 
-	ts.tv_sec = 1;
-	ts.tv_nsec = 0;
 	last = 0;
 
 	while ( ! sigged) {
-		if ((c = nodes_update(&out, n, cfg.urlsz)) < 0)
+		if ((c = events_wait(ev, &ready, &readysz)) < 0) {
+			xwarn(&out, "events_wait");
+			break;
+		} else if (0 == c && sigged)
 			break;
 
-		/* Re-sort, if applicable. */
+		if (NULL != out.bench) {
+			if (bench_elapsed(out.bench) >= benchsecs)
+				break;
+			bench_start(&cycle);
+			bench_start(&ts);
+		}
 
-		sz = sizeof(struct node);
-		switch (d.order) {
-		case DRAWORD_CMDLINE:
-			break;
-		case DRAWORD_CPU:
-			qsort(n, cfg.urlsz, sz, cmp_cpu);
+		c = nodes_update(&out, ev, &conns, 
+			n, cfg.urlsz, ready, readysz);
+		if (c < 0)
 			break;
-		case DRAWORD_HOST:
-			/* Only do this once. */
-			if (0 == first)
+
+		if (NULL != out.bench)
+			bench_add(out.bench, 
+				BENCH_UPDATE, bench_stop(&ts));
+
+		/* 
+		 * Scroll on keyboard input.
+		 * Nodes moving on or off screen are re-scheduled, as
+		 * they may have a different wait time.
+		 * Then collect the responses our workers have decoded.
+		 * Our replay's timer (if any) is handled below, and our
+		 * relay's slots (if any) are its own to handle.
+		 */
+
+		decodedsz = 0;
+		for (i = 0; i < readysz; i++) {
+			if ((slot = ready[i]) < cfg.urlsz)
+				continue;
+			if (NULL != replay && replayslot == slot)
+				continue;
+			if (NULL != relay && slot >= relayslot) {
+				if (relay_ready(&out, relay, ev, slot) < 0)
+					break;
+				continue;
+			}
+			pfds[slot].revents = 0;
+			if (cfg.urlsz == slot)
+				while (ERR != (c = wgetch(out.mainwin)))
+					scrolled |= draw_scroll
+						(&d, c, cfg.urlsz);
+			else if (work_collect(work, &out,
+			         &decoded, &decodedsz) < 0)
 				break;
-			qsort(n, cfg.urlsz, sz, cmp_host);
-			break;
-		case DRAWORD_MEM:
-			qsort(n, cfg.urlsz, sz, cmp_mem);
+			if ( ! events_set(ev, slot, 0)) {
+				xwarn(&out, NULL);
+				break;
+			}
+		}
+		if (i < readysz)
 			break;
+
+		/*
+		 * Replays give the nodes what the log has for them when
+		 * its time comes (or as soon as they're ready for more).
+		 * Nodes are last seen by the time of the log, not ours.
+		 * Benchmarks end once the log has been decoded.
+		 */
+
+		if (NULL != replay && ! replaydone) {
+			for (i = 0; i < decodedsz; i++)
+				decoded[i]->lastseen = replay_time(replay);
+			c = replay_feed(&out, replay, n, cfg.urlsz, &next);
+			if (c < 0)
+				break;
+			replaydone = 0 == c;
+			if ( ! events_set(ev, replayslot, next)) {
+				xwarn(&out, NULL);
+				break;
+			}
 		}
 
+		if (replaydone && NULL != out.bench) {
+			for (i = 0; i < cfg.urlsz; i++)
+				if (n[i].decoding)
+					break;
+			if (i == cfg.urlsz)
+				break;
+		}
+
+		/* Relays regenerate the documents of new records. */
+
+		if (NULL != relay) {
+			for (i = 0; i < decodedsz; i++)
+				if ( ! relay_update(&out, relay,
+				    ev, decoded[i] - n))
+					break;
+			if (i < decodedsz)
+				break;
+		}
+
+		/* 
+		 * Re-position nodes with new data, if applicable.
+		 * Only the display order changes: nodes stay put.
+		 */
+
+		if (NULL != cmp)
+			for (i = 0; i < decodedsz; i++)
+				order_fix(order, cfg.urlsz,
+					decoded[i]->row, cmp);
+
 		/*
-		 * Update if our data is dirty (c > 0) or if we're on
-		 * the first iteration, just to show something.
-		 * If we've nothing to show but more than one second has
-		 * passed, then simply update the time displays.
+		 * Lay out the screen anew if the terminal's been resized.
+		 * Reload our configuration if asked, once no node is
+		 * being decoded (as the nodes are moved), then lay out
+		 * the screen anew for it.
+		 * Either way, everything is then repainted.
+		 */
+
+		if (sigwinch && ! headless) {
+			if (-1 != ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws))
+				resizeterm(ws.ws_row, ws.ws_col);
+			c = screen_layout(&cfg, &out, 
+				&d, n, cfg.urlsz, NULL != relay);
+			if (c < 0) {
+				xwarn(&out, NULL);
+				break;
+			}
+			toosmall = 0 == c;
+			first = 1;
+		}
+		sigwinch = 0;
+
+		if (sighup && (NULL != relay || NULL != replay)) {
+			xwarnx(&out, "relays and replays don't reload");
+			sighup = 0;
+		} else if (sighup) {
+			for (i = 0; i < cfg.urlsz; i++)
+				if (n[i].decoding)
+					break;
+			if (i == cfg.urlsz) {
+				sighup = 0;
+				c = fleet_reload(&out, cfgfile, argc, argv,
+					&cfg, &n, &pfds, &ev, &mask, 
+					&conns, work, &tlscfg);
+				if (c < 0)
+					break;
+				if (c > 0 && ! fleet_display(&d, 
+				    &order, n, cfg.urlsz, 
+				    DRAWORD_HOST == d.order ? 
+				    cmp_host : cmp)) {
+					xwarn(&out, NULL);
+					break;
+				}
+				c = screen_layout(&cfg, &out, 
+					&d, n, cfg.urlsz, 0);
+				if (c < 0) {
+					xwarn(&out, NULL);
+					break;
+				}
+				toosmall = 0 == c;
+				clearok(curscr, TRUE);
+				first = 1;
+			}
+		}
+
+		if (toosmall && first) {
+			doupdate();
+			first = 0;
+		}
+
+		/*
+		 * Update once per second: this repaints the rows whose
+		 * nodes have changed (or all of them, on the first
+		 * iteration) and the time displays of the rest.
+		 * Window updates, including the error log's, are
+		 * batched into one terminal update.
 		 */
 
 		now = time(NULL);
-		if ((c || first) && now > last) {
-			draw(&out, &d, first, n, cfg.urlsz, now);
-			for (i = 0; i < cfg.urlsz; i++) 
+		if (NULL == relay && ! toosmall && 
+		    (now > last || scrolled || first)) {
+			if (NULL != out.bench)
+				bench_start(&ts);
+			draw(&out, &d, first, order, cfg.urlsz, 
+				NULL != replay ? replay_time(replay) : now);
+			for (i = 0; i < cfg.urlsz; i++) {
 				n[i].dirty = 0;
-			wrefresh(out.mainwin);
-			first = 0;
-		} else if (now > last) {
-			drawtimes(&out, &d, n, cfg.urlsz, now);
-			wrefresh(out.mainwin);
+				c = n[i].row < d.top || 
+				    n[i].row >= d.top + d.visible;
+				if (c == n[i].hidden)
+					continue;
+				n[i].hidden = c;
+				if ( ! events_set(ev, i, 
+				    node_deadline(&n[i], now))) {
+					xwarn(&out, NULL);
+					break;
+				}
+			}
+			if (i < cfg.urlsz)
+				break;
+			wnoutrefresh(out.mainwin);
+			doupdate();
+			first = scrolled = 0;
+			if (NULL != out.bench)
+				bench_add(out.bench, 
+					BENCH_DRAW, bench_stop(&ts));
 		}
 
 		last = now;
-		if (ppoll(pfds, cfg.urlsz, &ts, &oldmask) < 0 && 
-		    EINTR != errno) {
-			xwarn(&out, "poll");
-			break;
-		}
+		if (NULL != out.bench)
+			bench_add(out.bench, 
+				BENCH_CYCLE, bench_stop(&cycle));
 	}
 
 out:
+	if (-1 != cachefd)
+		cache_save(&out, cachefd, n, cfg.urlsz);
 	if ( ! isendwin()) {
 		if (NULL != out.errwin)
 			delwin(out.errwin);
 		delwin(out.mainwin);
 		endwin();
 	}
+	if (NULL != scr)
+		delscreen(scr);
+	if (NULL != nullf)
+		fclose(nullf);
+	if (NULL != out.bench)
+		bench_print(stdout, out.bench, cfg.urlsz, ncpu);
+	bench_free(out.bench);
+	if (NULL != recf) {
+		c = ferror(recf);
+		if (EOF == fclose(recf) || c)
+			warnx("%s: write error", recfile);
+	}
+	if (-1 != cachefd)
+		close(cachefd);
+	replay_free(replay);
+	relay_free(relay);
+	work_free(work);
 	nodes_free(n, cfg.urlsz);
 	config_free(&cfg);
+	free(cfgfile);
 	free(d.box);
+	free(d.rows);
+	draw_sum_free(&d.sum);
+	events_free(ev);
+	free(conns.queue);
+	tls_config_free(tlscfg);
+	free(order);
 	free(pfds);
 	return EXIT_SUCCESS;
 usage:
 	fprintf(stderr, "usage: %s "
+		"[-C] "
+		"[-B secs] "
 		"[-f conf] "
 		"[-o order] "
+		"[-R [addr:]port] "
+		"[-r log [-s speed]] "
+		"[-w log] "
 		"[url...]\n",
 		getprogname());
 	return EXIT_FAILURE;
@@ -24,12 +24,22 @@ struct	source {
 
 #define MAX_SERVERS_DNS 8
 
+/*
+ * How long (seconds) before we re-resolve a host's addresses.
+ */
+#define DNS_REFRESH 600
+
+struct	asr_query;
+
 struct	dns {
 	size_t	 	 addrsz; /* num addrs (<= MAX_SERVERS_DNS) */
 	struct source	 addrs[MAX_SERVERS_DNS]; /* ip addresses */
 	short	 	 port; /* port */
 	int		 https; /* non-zero if https, else zero */
 	size_t		 curaddr; /* current working address */
+	struct asr_query *query; /* resolution in progress (or NULL) */
+	time_t		 resolved; /* last resolution (or zero) */
+	size_t		 fails; /* consecutive connect failures */
 };
 
 enum	draword {
@@ -48,7 +58,8 @@ enum	drawcat {
 	DRAWCAT_HOST,
 	DRAWCAT_PROCS,
 	DRAWCAT_FILES,
-	DRAWCAT_RPROCS
+	DRAWCAT_RPROCS,
+	DRAWCAT_LATENCY
 };
 
 /*
@@ -87,6 +98,9 @@ struct	drawbox {
 #define LINK_STATE	 0x0002
 #define LINK_ACCESS	 0x0004
 #define	HOST_ACCESS	 0x0001
+#define	HOST_COLLECT	 0x0002
+#define	HOST_DB		 0x0004
+#define	HOST_CGI	 0x0008
 #define	PROCS_QMIN	 0x0001
 #define	PROCS_MIN	 0x0002
 #define	PROCS_HOUR 	 0x0004
@@ -108,6 +122,35 @@ struct	drawbox {
 #define	RPROCS_WEEK	 0x0010
 #define	RPROCS_YEAR	 0x0020
 #define	RPROCS_QMIN_BARS 0x0040
+#define	LATENCY_DNS	 0x0001
+#define	LATENCY_CONNECT	 0x0002
+#define	LATENCY_TLS	 0x0004
+#define	LATENCY_TTFB	 0x0008
+#define	LATENCY_BODY	 0x0010
+#define	LATENCY_P90	 0x0020
+};
+
+/*
+ * Fields summarised over the fleet and checked against thresholds.
+ */
+enum	sumfield {
+	SUMF_CPU = 0,
+	SUMF_MEM,
+	SUMF__MAX
+};
+
+/*
+ * Fleet summary of the nodes' newest quarter-minute records.
+ * Values are hundredths of a percent, gathered by field.
+ */
+struct	drawsum {
+	uint32_t	*vals[SUMF__MAX]; /* values by field */
+	uint32_t	*scratch; /* for selecting percentiles */
+	size_t		 valsz; /* nodes with values */
+	uint32_t	 avg[SUMF__MAX]; /* mean */
+	uint32_t	 p95[SUMF__MAX]; /* 95th percentile */
+	uint32_t	 max[SUMF__MAX]; /* maximum */
+	size_t		 over[SUMF__MAX]; /* nodes over threshold */
 };
 
 /*
@@ -121,31 +164,85 @@ struct	draw {
 	size_t		 lastseenpos; /* location of last seen stamp */
 	size_t		 intervalpos; /* location of interval stamp */
 	int		 header; /* boolean for header */
+	int		 summary; /* boolean for summary row */
+	size_t		 thresh[SUMF__MAX]; /* alert percent (or 0) */
+	struct drawsum	 sum; /* fleet summary */
 	size_t		 errlog; /* lines in errlog */
 	enum draword	 order;
+	struct drawrow	*rows; /* what's on each row */
+	size_t		 rowsz; /* number of rows */
+	size_t		 maxhostsz; /* width of host column */
+	size_t		 maxipsz; /* width of address column */
+	size_t		 top; /* first shown in display order */
+	size_t		 visible; /* number of rows shown */
 };
 
+/*
+ * Number of record intervals (qmin through year).
+ */
+#define	INTERVALS (INTERVAL_byyear + 1)
+
+/*
+ * Fields of a record, as read with recset_get().
+ */
+enum	recfield {
+	RECF_ENTRIES,
+	RECF_CPU,
+	RECF_MEM,
+	RECF_NETTX,
+	RECF_NETRX,
+	RECF_DISCREAD,
+	RECF_DISCWRITE,
+	RECF_NPROCS,
+	RECF_RPROCS,
+	RECF_NFILES
+};
+
+/*
+ * The records of one interval, newest first, stored by field in arrays
+ * carved from one allocation (at "ctime").
+ * The accumulated percentages are kept as floats, which are more than
+ * precise enough to show; counters and times keep their full width.
+ */
+struct	recarray {
+	size_t		 sz; /* number of records */
+	int64_t		*ctime;
+	int64_t		*id;
+	int64_t		*nettx;
+	int64_t		*netrx;
+	int64_t		*discread;
+	int64_t		*discwrite;
+	float		*cpu;
+	float		*mem;
+	float		*nprocs;
+	float		*rprocs;
+	float		*nfiles;
+	uint32_t	*entries;
+};
+
+/*
+ * Bytes of a single record across all field arrays.
+ */
+#define	RECARRAY_ROW (6 * sizeof(int64_t) + \
+	5 * sizeof(float) + sizeof(uint32_t))
+
 /*
  * The full set of records of a particular host.
  * This can be totally empty: we have no constraints.
+ * Records should be read with recset_get() and friends.
  */
 struct	recset {
 	char		*version;
 	struct system	 system;
-	struct record	*byqmin;
-	size_t		 byqminsz;
-	struct record	*bymin;
-	size_t		 byminsz;
-	struct record	*byhour;
-	size_t		 byhoursz;
-	struct record	*byday;
-	size_t		 bydaysz;
-	struct record	*byweek;
-	size_t		 byweeksz;
-	struct record	*byyear;
-	size_t		 byyearsz;
+	struct recarray	 ivs[INTERVALS]; /* by enum interval */
+	time_t		 since; /* if has_since, partial since */
+	int64_t		 cgiopen; /* if has_cgi, server timings (usec) */
+	int64_t		 cgilist;
+	int64_t		 cgisend;
 	int		 has_system;
 	int		 has_version;
+	int		 has_since;
+	int		 has_cgi;
 };
 
 enum	state {
@@ -157,11 +254,71 @@ enum	state {
 	STATE_CLOSE_DONE,
 	STATE_CLOSE_ERR,
 	STATE_WRITE,
-	STATE_READ
+	STATE_READ,
+	STATE_CONNECT_KEEPALIVE
+};
+
+/*
+ * What we last drew on a row of the display.
+ * If the node (by its url), or its state or address, change, the row
+ * is repainted.
+ */
+struct	drawrow {
+	const char	*url; /* node on row (or NULL) */
+	enum state	 state; /* its last drawn state */
+	size_t		 curaddr; /* its last drawn address */
+};
+
+/*
+ * Phases of a poll, each timed as the state machine moves through it.
+ * A poll on a kept-alive connection has no DNS, connect or TLS phase,
+ * nor does a poll not preceded by resolving its host have DNS.
+ */
+enum	phase {
+	PHASE_DNS = 0, /* resolving the host */
+	PHASE_CONNECT, /* until connect(2) finishes */
+	PHASE_TLS, /* TLS handshake (https only) */
+	PHASE_TTFB, /* request until first response byte */
+	PHASE_BODY, /* first byte until response complete */
+	PHASE__MAX /* not timing */
+};
+
+/*
+ * Successful polls kept in each node's latency history.
+ */
+#define	LATENCY_HIST 32
+
+/*
+ * Power-of-two millisecond buckets in a latency histogram.
+ */
+#define	LATENCY_BUCKETS 16
+
+/*
+ * How the end of an HTTP response body is known.
+ */
+enum	framing {
+	FRAMING_EOF = 0, /* read until connection closes */
+	FRAMING_LENGTH, /* content-length header */
+	FRAMING_CHUNKED /* chunked transfer encoding */
+};
+
+/*
+ * Where we are in decoding a chunked response body.
+ */
+enum	chunk {
+	CHUNK_SIZE = 0, /* reading chunk size line */
+	CHUNK_DATA, /* reading chunk data */
+	CHUNK_DATA_END, /* reading CRLF after chunk data */
+	CHUNK_TRAILER, /* reading trailers after last chunk */
+	CHUNK_DONE /* body complete */
 };
 
 /*
  * Data on a current transfer (read/write).
+ * The read buffer consists of the response headers (hdrsz) followed by
+ * the decoded body (bodysz), followed by any data not yet decoded.
+ * If the body is compressed, the decoded body is inflated into zbuf as
+ * it arrives and removed from the read buffer (bodyoff).
  */
 struct	xfer {
 	char		*wbuf; /* write buffer for http */
@@ -169,10 +326,51 @@ struct	xfer {
 	size_t		 wbufpos; /* write position in wbuf */
 	char		*rbuf; /* read buffer for http */
 	size_t		 rbufsz; /* amount read over http */
+	size_t		 rbufmax; /* allocated size of rbuf */
+	size_t		 hdrsz; /* header size (zero if not parsed) */
+	size_t		 bodysz; /* decoded body size */
+	size_t		 bodyoff; /* decoded body already consumed */
+	size_t		 rpos; /* start of undecoded data */
+	int		 code; /* http response code */
+	enum framing	 framing; /* how body is delimited */
+	size_t		 clen; /* content length if FRAMING_LENGTH */
+	enum chunk	 chunkst; /* state if FRAMING_CHUNKED */
+	size_t		 chunksz; /* bytes left in current chunk */
+	int		 done; /* response completely read */
+	int		 keepalive; /* server allows connection reuse */
+	int		 reused; /* request on kept-alive connection */
+	time_t		 since; /* requested records since (or zero) */
+	int		 validated; /* sent If-None-Match */
+	int		 longpolled; /* asked server to hold request */
+	char		 etag[64]; /* response ETag (or empty) */
+	struct z_stream_s *zs; /* inflate state (or NULL) */
+	int		 binary; /* body is binary (not JSON) */
+	int		 zenc; /* body is compressed */
+	int		 zend; /* end of compressed stream */
+	char		*zbuf; /* inflated body */
+	size_t		 zbufsz; /* length of inflated body */
+	size_t		 zbufmax; /* allocated size of zbuf */
 	struct sockaddr_storage ss; /* socket */
 	struct pollfd	*pfd; /* pollfd descriptor */
 	struct tls	*tls; /* tls context, if needed */
+	struct tls_config *tlscfg; /* shared tls configuration */
 	time_t		 start; /* connection start time */
+	enum phase	 phase; /* phase being timed */
+	struct timespec	 mark; /* start of phase */
+	double		 phases[PHASE__MAX]; /* this poll (ms) */
+};
+
+/*
+ * Transfer phases of recent successful polls.
+ * Alongside the samples themselves, we keep a histogram of each phase
+ * in power-of-two millisecond buckets: bucket zero is under one
+ * millisecond, bucket "b" under 2^b milliseconds, and the last open.
+ */
+struct	latency {
+	double		 ring[LATENCY_HIST][PHASE__MAX]; /* samples (ms) */
+	size_t		 pos; /* next sample in ring */
+	size_t		 sz; /* samples in ring */
+	unsigned char	 hist[PHASE__MAX][LATENCY_BUCKETS];
 };
 
 /*
@@ -187,9 +385,34 @@ struct	node {
 	struct xfer	 xfer; /* transfer information */
 	struct dns	 addrs; /* all possible IP addresses */
 	time_t		 waitstart; /* wait period start */
+	time_t		 waitjitter; /* offset to this waittime */
+	int		 phased; /* first wait has been jittered */
+	int		 queued; /* waiting for a free connection */
 	time_t		 lastseen; /* last data received */
 	struct recset	*recs; /* results */
+	char		 etag[64]; /* ETag of recs (or empty) */
+	void		*toks; /* jsmntok_t for parsing (by worker) */
+	size_t		 toksz; /* allocated tokens */
+	struct work	*work; /* shared decoding workers */
+	int		 decoding; /* response is with workers */
+	size_t		 row; /* position in display order */
+	int		 hidden; /* not shown on screen */
+	time_t		 hidewait; /* waittime if hidden (or zero) */
+	time_t		 longpoll; /* server hold time (or zero) */
+	int		 nowait; /* next request needn't wait */
+	unsigned int	 intervals; /* newest wanted (or 0 for all) */
+#define	RECS_QMIN	 0x0001
+#define	RECS_MIN	 0x0002
+#define	RECS_HOUR	 0x0004
+#define	RECS_DAY	 0x0008
+#define	RECS_WEEK	 0x0010
+#define	RECS_YEAR	 0x0020
+	size_t		 depth[INTERVALS]; /* most records kept */
+	int		 timing; /* ask for server timings */
+	int		 refetch; /* next request is for all records */
 	int		 dirty; /* new results */
+	int		 stale; /* recs are from the cache */
+	struct latency	 latency; /* recent transfer phases */
 };
 
 /*
@@ -208,8 +431,35 @@ struct	config {
 	struct nconfig	 *urls; /* nodes (URLs) */
 	size_t		  urlsz; /* number of urls */
 	size_t		  waittime; /* global timeout */
+	size_t		  maxconns; /* in-flight connections (or 0) */
+	size_t		  jitter; /* waittime jitter (percent) */
+	size_t		  hidewait; /* waittime if hidden (or 0) */
+	size_t		  longpoll; /* server hold time (or 0) */
+	int		  latencylog; /* log transfer phases */
+};
+
+/*
+ * Operations timed by a headless benchmark run.
+ */
+enum	benchm {
+	BENCH_CYCLE = 0, /* event loop iteration (not waiting) */
+	BENCH_UPDATE, /* nodes_update() */
+	BENCH_DECODE, /* decoding a response (by workers) */
+	BENCH_DRAW, /* draw() and terminal update */
+	BENCH__MAX
 };
 
+/*
+ * Clients a relay serves at once, and the event slots it needs (its
+ * listening descriptor and one per client).
+ */
+#define	RELAY_CLIENTS	 64
+#define	RELAY_SLOTS	 (RELAY_CLIENTS + 1)
+
+struct	events;
+struct	relay;
+struct	replay;
+
 /*
  * Output information (window, etc.).
  */
@@ -218,6 +468,8 @@ struct	out {
 	WINDOW		*mainwin; /* main panel */
 	FILE		*errs; /* output error file */
 	int		 debug; /* print debugging if non-zero */
+	struct bench	*bench; /* headless benchmark (or NULL) */
+	int		 latencylog; /* log transfer phases */
 };
 
 __BEGIN_DECLS
@@ -226,6 +478,7 @@ void	 xdbg(struct out *, const char *, ...)
 		__attribute__((format(printf, 2, 3)));
 void	 xwarnx(struct out *, const char *, ...)
 		__attribute__((format(printf, 2, 3)));
+void	 xwarnbuf(struct out *, const char *, size_t);
 void	 xwarn(struct out *, const char *, ...)
 		__attribute__((format(printf, 2, 3)));
 
@@ -233,7 +486,9 @@ size_t	 compute_width(const struct node *, size_t,
 		const struct draw *);
 
 void	 dns_parse_url(struct out *, struct node *);
-int	 dns_resolve(struct out *, const char *, struct dns *);
+int	 dns_resolve(struct out *, struct node *);
+int	 dns_stale(const struct node *, time_t);
+void	 dns_free(struct dns *);
 
 int	 http_init_connect(struct out *, struct node *);
 int	 http_close_done(struct out *, struct node *);
@@ -241,15 +496,81 @@ int	 http_close_err(struct out *, struct node *);
 int	 http_connect(struct out *, struct node *);
 int	 http_write(struct out *, struct node *n);
 int	 http_read(struct out *, struct node *n);
+int	 http_keepalive(struct out *, struct node *n);
+void	 http_free(struct node *);
+void	 http_phase(struct node *, enum phase);
+void	 http_phase_start(struct node *, enum phase);
+double	 latency_last(const struct latency *, enum phase);
+double	 latency_pct(const struct latency *, enum phase, size_t);
 
 void	 draw(struct out *, struct draw *, int,
-		const struct node *, size_t, time_t);
-void	 drawtimes(struct out *, const struct draw *, 
-		const struct node *, size_t, time_t);
+		struct node *const *, size_t, time_t);
+int	 draw_scroll(struct draw *, int, size_t);
+int	 draw_sum_alloc(struct drawsum *, size_t);
+void	 draw_sum_free(struct drawsum *);
+unsigned int draw_intervals(const struct draw *, size_t *);
+int	 draw_timings(const struct draw *);
+time_t	 node_waitend(const struct node *);
 
-int 	 json_parse(struct out *, struct node *n, const char *, size_t);
+int 	 json_parse(struct out *, struct node *n, 
+		const char *, size_t, struct recset *);
+int 	 binary_parse(struct out *, struct node *n, 
+		const char *, size_t, struct recset *);
+
+int	 recarray_alloc(struct recarray *, size_t);
+void	 recarray_free(struct recarray *);
+const void *recarray_buf(const struct recarray *, size_t *);
+int	 recarray_load(struct recarray *, size_t, const void *);
+int	 recarray_records(struct recarray *, 
+		const struct record *, size_t);
 
 void	 recset_free(struct recset *);
+int	 recset_keep(struct recset *, const size_t *);
+int	 recset_build(struct out *, const struct node *, time_t,
+		const size_t *, const struct recset *, 
+		struct recset *, struct recset **);
+size_t	 recset_size(const struct recset *, enum interval);
+time_t	 recset_ctime(const struct recset *, enum interval, size_t);
+double	 recset_get(const struct recset *, enum interval, 
+		size_t, enum recfield);
+int	 recset_avg(const struct recset *, enum interval, 
+		size_t, enum recfield, double *);
+
+struct bench	*bench_alloc(void);
+void	 bench_free(struct bench *);
+void	 bench_start(struct timespec *);
+double	 bench_stop(const struct timespec *);
+double	 bench_elapsed(const struct bench *);
+void	 bench_add(struct bench *, enum benchm, double);
+int	 bench_print(FILE *, struct bench *, size_t, size_t);
+
+struct work	*work_alloc(size_t, size_t);
+void	 work_free(struct work *);
+int	 work_fd(const struct work *);
+int	 work_nodes(struct work *, size_t);
+void	 work_record(struct work *, FILE *);
+int	 work_submit(struct work *, struct node *);
+int	 work_collect(struct work *, struct out *,
+		struct node *const **, size_t *);
+
+struct relay	*relay_alloc(const char *, struct pollfd *, size_t,
+		const struct node *, size_t);
+void	 relay_free(struct relay *);
+int	 relay_ready(struct out *, struct relay *,
+		struct events *, size_t);
+int	 relay_update(struct out *, struct relay *,
+		struct events *, size_t);
+
+int	 cache_load(struct out *, int, struct node *, size_t);
+int	 cache_save(struct out *, int, const struct node *, size_t);
+
+struct replay	*replay_alloc(const char *, size_t);
+void	 replay_free(struct replay *);
+int	 replay_feed(struct out *, struct replay *,
+		struct node *, size_t, time_t *);
+time_t	 replay_time(const struct replay *);
+int	 replay_write(FILE *, const struct node *, 
+		const char *, size_t);
 
 int 	 config_parse(const char *, struct config *, int, char *[]);
 void	 config_free(struct config *);